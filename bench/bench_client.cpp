@@ -0,0 +1,468 @@
+#include "bench_client.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <thread>
+
+namespace {
+
+uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+}
+
+/* one UDP association, shared by its sending and receiving coroutine */
+struct udp_flow {
+    explicit udp_flow(const asio::any_io_executor &executor)
+        : socket(executor), signal(executor), in_flight(0) {}
+
+    asio::ip::udp::socket socket;
+    /* cancelled by the receiver to wake a sender waiting for the window */
+    asio::steady_timer signal;
+    int64_t in_flight;
+};
+
+asio::awaitable<void> udp_receive_loop(std::shared_ptr<udp_flow> flow,
+                                       uint64_t &round_trips) {
+    asio::error_code ec;
+    std::array<char, 65536> buf;
+
+    for (;;) {
+        co_await flow->socket.async_receive(
+            asio::buffer(buf), asio::redirect_error(asio::use_awaitable, ec));
+        if (ec == asio::error::operation_aborted || !flow->socket.is_open()) {
+            co_return;
+        }
+
+        if (ec) {
+            continue;
+        }
+
+        round_trips++;
+        flow->in_flight--;
+        flow->signal.cancel();
+    }
+}
+
+}    // namespace
+
+bench_client::bench_client(const bench_options &options,
+                           const asio::ip::tcp::endpoint &proxy)
+    : options_(options), proxy_(proxy) {}
+
+template <typename Loop>
+double bench_client::run_threads(Loop loop, std::vector<thread_stats> &stats) {
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+
+    stats = std::vector<thread_stats>(this->options_.threads);
+
+    for (std::size_t i = 0; i < this->options_.threads; i++) {
+        threads.emplace_back([this, &loop, &stats = stats[i]] {
+            asio::io_context io_context(1);
+
+            for (std::size_t c = 0; c < this->options_.connections; c++) {
+                asio::co_spawn(io_context, loop(stats), asio::detached);
+            }
+
+            io_context.run();
+        });
+    }
+
+    for (auto &&thread : threads) {
+        thread.join();
+    }
+
+    return elapsed_ns(start) / 1e9;
+}
+
+asio::awaitable<bool> bench_client::socks_connect(
+    asio::ip::tcp::socket &socket, const asio::ip::tcp::endpoint &target) {
+    asio::error_code ec;
+
+    co_await socket.async_connect(
+        this->proxy_, asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return false;
+    }
+
+    socket.set_option(asio::ip::tcp::no_delay(true), ec);
+
+    /* greeting and CONNECT pipelined in one write, as fast clients do */
+    auto addr = target.address().to_v4().to_bytes();
+    std::array<uint8_t, 13> request = {
+        {0x05, 0x01, 0x00, 0x05, 0x01, 0x00, 0x01, addr[0], addr[1], addr[2],
+         addr[3], static_cast<uint8_t>(target.port() >> 8),
+         static_cast<uint8_t>(target.port() & 0xFF)}};
+
+    co_await asio::async_write(socket, asio::buffer(request),
+                               asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return false;
+    }
+
+    /* method selection followed by an IPv4 bound address */
+    std::array<uint8_t, 12> reply;
+
+    co_await asio::async_read(socket, asio::buffer(reply),
+                              asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return false;
+    }
+
+    co_return reply[1] == 0x00 && reply[3] == 0x00 && reply[5] == 0x01;
+}
+
+asio::awaitable<void> bench_client::churn_loop(
+    asio::ip::tcp::endpoint target, std::chrono::steady_clock::time_point end,
+    thread_stats &stats) {
+    auto executor = co_await asio::this_coro::executor;
+    asio::error_code ec;
+
+    while (std::chrono::steady_clock::now() < end) {
+        asio::ip::tcp::socket socket(executor);
+        auto start = std::chrono::steady_clock::now();
+
+        if (!co_await this->socks_connect(socket, target)) {
+            stats.errors++;
+            continue;
+        }
+
+        uint64_t handshake_ns = elapsed_ns(start);
+        char byte = 0;
+
+        co_await asio::async_write(
+            socket, asio::buffer(&byte, 1),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (!ec) {
+            co_await asio::async_read(
+                socket, asio::buffer(&byte, 1),
+                asio::redirect_error(asio::use_awaitable, ec));
+        }
+        if (ec) {
+            stats.errors++;
+            continue;
+        }
+
+        stats.ops++;
+        stats.samples_ns.push_back(handshake_ns);
+        stats.flow_samples_ns.push_back(elapsed_ns(start));
+    }
+}
+
+asio::awaitable<void> bench_client::bulk_loop(asio::ip::tcp::endpoint target,
+                                              thread_stats &stats) {
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::socket socket(executor);
+    asio::error_code ec;
+
+    if (!co_await this->socks_connect(socket, target)) {
+        stats.errors++;
+        co_return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t remaining = this->options_.bulk_bytes;
+    std::vector<char> buf(65536);
+
+    co_await asio::async_write(socket,
+                               asio::buffer(&remaining, sizeof(remaining)),
+                               asio::redirect_error(asio::use_awaitable, ec));
+
+    while (!ec && remaining > 0) {
+        std::size_t n = std::min<uint64_t>(remaining, buf.size());
+
+        co_await asio::async_write(
+            socket, asio::buffer(buf.data(), n),
+            asio::redirect_error(asio::use_awaitable, ec));
+        remaining -= n;
+    }
+
+    char ack;
+
+    if (!ec) {
+        co_await asio::async_read(
+            socket, asio::buffer(&ack, 1),
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+    if (ec) {
+        stats.errors++;
+        co_return;
+    }
+
+    stats.ops++;
+    stats.samples_ns.push_back(elapsed_ns(start));
+}
+
+asio::awaitable<void> bench_client::latency_loop(
+    asio::ip::tcp::endpoint target, std::chrono::steady_clock::time_point end,
+    thread_stats &stats) {
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::socket socket(executor);
+    asio::error_code ec;
+
+    if (!co_await this->socks_connect(socket, target)) {
+        stats.errors++;
+        co_return;
+    }
+
+    std::vector<char> request(this->options_.message_size, 'x');
+    std::vector<char> response(this->options_.message_size);
+
+    while (std::chrono::steady_clock::now() < end) {
+        auto start = std::chrono::steady_clock::now();
+
+        co_await asio::async_write(
+            socket, asio::buffer(request),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (!ec) {
+            co_await asio::async_read(
+                socket, asio::buffer(response),
+                asio::redirect_error(asio::use_awaitable, ec));
+        }
+        if (ec) {
+            stats.errors++;
+            co_return;
+        }
+
+        stats.ops++;
+        stats.samples_ns.push_back(elapsed_ns(start));
+    }
+}
+
+asio::awaitable<void> bench_client::udp_loop(
+    asio::ip::udp::endpoint target, std::chrono::steady_clock::time_point end,
+    thread_stats &stats) {
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::socket control(executor);
+    asio::error_code ec;
+
+    co_await control.async_connect(
+        this->proxy_, asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        stats.errors++;
+        co_return;
+    }
+
+    /* greeting and UDP ASSOCIATE from any IPv4 client address */
+    std::array<uint8_t, 13> request = {
+        {0x05, 0x01, 0x00, 0x05, 0x03, 0x00, 0x01, 0, 0, 0, 0, 0, 0}};
+    std::array<uint8_t, 12> reply;
+
+    co_await asio::async_write(control, asio::buffer(request),
+                               asio::redirect_error(asio::use_awaitable, ec));
+    if (!ec) {
+        co_await asio::async_read(
+            control, asio::buffer(reply),
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+    if (ec || reply[3] != 0x00) {
+        stats.errors++;
+        co_return;
+    }
+
+    /* BND.ADDR is the wildcard the relay is bound to, reach it via loopback */
+    asio::ip::udp::endpoint relay(this->proxy_.address(),
+                                  static_cast<uint16_t>((reply[10] << 8) |
+                                                        reply[11]));
+
+    auto addr = target.address().to_v4().to_bytes();
+    std::vector<char> datagram = {
+        0x00, 0x00, 0x00, 0x01,
+        static_cast<char>(addr[0]), static_cast<char>(addr[1]),
+        static_cast<char>(addr[2]), static_cast<char>(addr[3]),
+        static_cast<char>(target.port() >> 8),
+        static_cast<char>(target.port() & 0xFF)};
+    datagram.resize(datagram.size() + this->options_.message_size, 'x');
+
+    auto flow = std::make_shared<udp_flow>(executor);
+    flow->socket.open(asio::ip::udp::v4(), ec);
+    if (ec) {
+        stats.errors++;
+        co_return;
+    }
+
+    asio::co_spawn(executor, udp_receive_loop(flow, stats.ops),
+                   asio::detached);
+
+    while (std::chrono::steady_clock::now() < end) {
+        if (flow->in_flight >=
+            static_cast<int64_t>(this->options_.udp_window)) {
+            flow->signal.expires_after(std::chrono::milliseconds(10));
+            co_await flow->signal.async_wait(
+                asio::redirect_error(asio::use_awaitable, ec));
+            if (!ec) {
+                /* no reply for a whole window, the rest was dropped */
+                stats.lost += flow->in_flight;
+                flow->in_flight = 0;
+            }
+            continue;
+        }
+
+        co_await flow->socket.async_send_to(
+            asio::buffer(datagram), relay,
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            stats.errors++;
+            break;
+        }
+
+        flow->in_flight++;
+    }
+
+    flow->socket.close(ec);
+    control.close(ec);
+}
+
+asio::awaitable<void> bench_client::idle_connect(
+    asio::ip::tcp::socket &socket, asio::ip::tcp::endpoint target,
+    thread_stats &stats) {
+    bool connected = co_await this->socks_connect(socket, target);
+
+    if (connected) {
+        stats.ops++;
+    } else {
+        stats.errors++;
+    }
+
+    co_return;
+}
+
+churn_result bench_client::run_churn(const asio::ip::tcp::endpoint &echo) {
+    std::vector<thread_stats> stats;
+    auto end = std::chrono::steady_clock::now() + this->options_.duration;
+
+    double seconds = this->run_threads(
+        [&](thread_stats &s) { return this->churn_loop(echo, end, s); },
+        stats);
+
+    churn_result result{0, 0, seconds, {}, {}};
+    for (auto &&s : stats) {
+        result.handshakes += s.ops;
+        result.errors += s.errors;
+    }
+    result.handshake = summarize(merge(stats));
+    result.flow = summarize(merge(stats, &thread_stats::flow_samples_ns));
+
+    return result;
+}
+
+bulk_result bench_client::run_bulk(const asio::ip::tcp::endpoint &sink) {
+    std::vector<thread_stats> stats;
+
+    double seconds = this->run_threads(
+        [&](thread_stats &s) { return this->bulk_loop(sink, s); }, stats);
+
+    bulk_result result{0, 0, 0, seconds, 0, 0, 0};
+    for (auto &&s : stats) {
+        result.transfers += s.ops;
+        result.errors += s.errors;
+    }
+    result.bytes = result.transfers * this->options_.bulk_bytes;
+
+    /* the slowest transfer has the lowest rate */
+    auto durations = merge(stats);
+    if (!durations.empty()) {
+        double bytes = static_cast<double>(this->options_.bulk_bytes);
+        result.connection_min = bytes * 1e9 / durations.back();
+        result.connection_p50 = bytes * 1e9 / durations[durations.size() / 2];
+        result.connection_max = bytes * 1e9 / durations.front();
+    }
+
+    return result;
+}
+
+latency_result bench_client::run_latency(const asio::ip::tcp::endpoint &echo) {
+    std::vector<thread_stats> stats;
+    auto end = std::chrono::steady_clock::now() + this->options_.duration;
+
+    double seconds = this->run_threads(
+        [&](thread_stats &s) { return this->latency_loop(echo, end, s); },
+        stats);
+
+    latency_result result{0, 0, seconds, {}};
+    for (auto &&s : stats) {
+        result.requests += s.ops;
+        result.errors += s.errors;
+    }
+    result.rtt = summarize(merge(stats));
+
+    return result;
+}
+
+udp_result bench_client::run_udp(const asio::ip::udp::endpoint &echo) {
+    std::vector<thread_stats> stats;
+    auto end = std::chrono::steady_clock::now() + this->options_.duration;
+
+    double seconds = this->run_threads(
+        [&](thread_stats &s) { return this->udp_loop(echo, end, s); }, stats);
+
+    udp_result result{0, 0, 0, seconds};
+    for (auto &&s : stats) {
+        result.round_trips += s.ops;
+        result.lost += s.lost;
+        result.errors += s.errors;
+    }
+
+    return result;
+}
+
+idle_result bench_client::run_idle(
+    const asio::ip::tcp::endpoint &echo,
+    const std::function<void()> &measure) {
+    asio::io_context io_context(1);
+    std::vector<asio::ip::tcp::socket> sockets;
+    thread_stats stats;
+
+    /* as many sessions as the other scenarios keep open at once */
+    for (std::size_t i = 0;
+         i < this->options_.threads * this->options_.connections; i++) {
+        sockets.emplace_back(io_context);
+    }
+
+    for (auto &&socket : sockets) {
+        asio::co_spawn(io_context, this->idle_connect(socket, echo, stats),
+                       asio::detached);
+    }
+
+    io_context.run();
+
+    measure();
+
+    return {stats.ops, stats.errors};
+}
+
+std::vector<uint64_t> bench_client::merge(
+    std::vector<thread_stats> &stats,
+    std::vector<uint64_t> thread_stats::*samples) {
+    std::vector<uint64_t> merged;
+
+    for (auto &&s : stats) {
+        merged.insert(merged.end(), (s.*samples).begin(), (s.*samples).end());
+        s.*samples = std::vector<uint64_t>();
+    }
+
+    std::sort(merged.begin(), merged.end());
+
+    return merged;
+}
+
+latency_summary bench_client::summarize(
+    const std::vector<uint64_t> &sorted_ns) {
+    if (sorted_ns.empty()) {
+        return {0, 0, 0, 0};
+    }
+
+    auto quantile = [&](double q) {
+        std::size_t i = std::min(
+            sorted_ns.size() - 1,
+            static_cast<std::size_t>(q * sorted_ns.size()));
+        return sorted_ns[i] / 1e3;
+    };
+
+    return {quantile(0.5), quantile(0.99), quantile(0.999),
+            sorted_ns.back() / 1e3};
+}
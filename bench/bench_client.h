@@ -0,0 +1,137 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "asiomp.h"
+
+struct bench_options {
+    std::size_t threads = 4;
+    /* concurrent connections on each client thread */
+    std::size_t connections = 16;
+    std::chrono::seconds duration{5};
+    uint64_t bulk_bytes = 64 * 1024 * 1024;
+    std::size_t message_size = 64;
+    /* datagrams in flight on each UDP association */
+    std::size_t udp_window = 32;
+};
+
+struct latency_summary {
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double max_us;
+};
+
+struct churn_result {
+    uint64_t handshakes;
+    uint64_t errors;
+    double seconds;
+    latency_summary handshake;
+    /* connect to the echoed byte, what a short request/response flow sees */
+    latency_summary flow;
+};
+
+struct bulk_result {
+    uint64_t bytes;
+    uint64_t transfers;
+    uint64_t errors;
+    double seconds;
+    /* bytes per second of the single connections */
+    double connection_min;
+    double connection_p50;
+    double connection_max;
+};
+
+struct latency_result {
+    uint64_t requests;
+    uint64_t errors;
+    double seconds;
+    latency_summary rtt;
+};
+
+struct idle_result {
+    uint64_t sessions;
+    uint64_t errors;
+};
+
+struct udp_result {
+    uint64_t round_trips;
+    uint64_t lost;
+    uint64_t errors;
+    double seconds;
+};
+
+/*
+ * SOCKS5 load generator. Every scenario runs options.connections client
+ * coroutines on each of options.threads threads, each thread with its own
+ * io_context, and merges the per-thread samples once all of them are done.
+ */
+class bench_client {
+public:
+    bench_client(const bench_options& options,
+                 const asio::ip::tcp::endpoint& proxy);
+
+    /* a new connection and handshake for every one byte round trip */
+    churn_result run_churn(const asio::ip::tcp::endpoint& echo);
+
+    /* one transfer of options.bulk_bytes per connection */
+    bulk_result run_bulk(const asio::ip::tcp::endpoint& sink);
+
+    /* options.message_size round trips on long lived connections */
+    latency_result run_latency(const asio::ip::tcp::endpoint& echo);
+
+    /* options.message_size datagrams echoed through UDP ASSOCIATE */
+    udp_result run_udp(const asio::ip::udp::endpoint& echo);
+
+    /* one CONNECT per connection left idle, measured while all are open */
+    idle_result run_idle(const asio::ip::tcp::endpoint& echo,
+                         const std::function<void()>& measure);
+
+private:
+    struct thread_stats {
+        uint64_t ops = 0;
+        uint64_t errors = 0;
+        uint64_t lost = 0;
+        std::vector<uint64_t> samples_ns;
+        std::vector<uint64_t> flow_samples_ns;
+    };
+
+    template <typename Loop>
+    double run_threads(Loop loop, std::vector<thread_stats>& stats);
+
+    asio::awaitable<bool> socks_connect(asio::ip::tcp::socket& socket,
+                                        const asio::ip::tcp::endpoint& target);
+
+    asio::awaitable<void> churn_loop(asio::ip::tcp::endpoint target,
+                                     std::chrono::steady_clock::time_point end,
+                                     thread_stats& stats);
+
+    asio::awaitable<void> bulk_loop(asio::ip::tcp::endpoint target,
+                                    thread_stats& stats);
+
+    asio::awaitable<void> latency_loop(
+        asio::ip::tcp::endpoint target,
+        std::chrono::steady_clock::time_point end, thread_stats& stats);
+
+    asio::awaitable<void> udp_loop(asio::ip::udp::endpoint target,
+                                   std::chrono::steady_clock::time_point end,
+                                   thread_stats& stats);
+
+    asio::awaitable<void> idle_connect(asio::ip::tcp::socket& socket,
+                                       asio::ip::tcp::endpoint target,
+                                       thread_stats& stats);
+
+    static std::vector<uint64_t> merge(
+        std::vector<thread_stats>& stats,
+        std::vector<uint64_t> thread_stats::*samples =
+            &thread_stats::samples_ns);
+
+    static latency_summary summarize(const std::vector<uint64_t>& sorted_ns);
+
+private:
+    bench_options options_;
+    asio::ip::tcp::endpoint proxy_;
+};
@@ -0,0 +1,310 @@
+#include <malloc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_client.h"
+#include "bench_upstream.h"
+#include "config.h"
+#include "dns_cache.h"
+#include "metrics.h"
+#include "socks_session.h"
+
+/*
+ * coro_socks_bench: runs the upstream servers, one proxy worker and the
+ * load generator in one process on loopback and prints the results as
+ * JSON. The proxy worker is a single io_context thread accepting into
+ * socks_session, which is what every asiomp worker process runs. With
+ * --proxy-threads, connections are spread over that many io_context
+ * threads the way threaded_server does.
+ *
+ * Heap use of the proxy threads is counted by the global operator new
+ * below, for the allocations per handshake and the bytes an idle session
+ * keeps. The proxy threads get metrics slots of their own, so the report
+ * also carries the phase quantiles the proxy measured for all scenarios.
+ */
+
+namespace {
+
+thread_local bool proxy_thread = false;
+std::atomic<uint64_t> proxy_allocations{0};
+std::atomic<int64_t> proxy_heap_bytes{0};
+
+void usage(const char *prog) {
+    std::fprintf(
+        stderr,
+        "usage: %s [--config file] [--threads n] [--connections n]\n"
+        "          [--duration seconds] [--bulk-bytes n] [--message-size n]\n"
+        "          [--udp-window n] [--proxy-threads n] [--output file]\n",
+        prog);
+}
+
+asio::awaitable<void> proxy_accept(
+    asio::ip::tcp::acceptor &acceptor,
+    std::vector<std::unique_ptr<asio::io_context>> &contexts) {
+    asio::error_code ec;
+
+    for (std::size_t next = 0;; next = (next + 1) % contexts.size()) {
+        asio::io_context &context = *contexts[next];
+
+        auto socket = co_await acceptor.async_accept(
+            context, asio::redirect_error(asio::use_awaitable, ec));
+        if (ec == asio::error::operation_aborted) {
+            co_return;
+        }
+
+        if (ec) {
+            continue;
+        }
+
+        asio::post(context, [socket = std::move(socket)]() mutable {
+            socks_session::create(std::move(socket))->start();
+        });
+    }
+}
+
+std::string format_latency(const latency_summary &s) {
+    return fmt::format(
+        "{{\"p50_us\": {:.1f}, \"p99_us\": {:.1f}, \"p999_us\": {:.1f}, "
+        "\"max_us\": {:.1f}}}",
+        s.p50_us, s.p99_us, s.p999_us, s.max_us);
+}
+
+std::string format_phases() {
+    const char *const names[] = {"handshake", "resolve", "connect",
+                                 "first_byte"};
+    std::string out;
+
+    for (std::size_t p = 0; p < std::size(names); p++) {
+        auto summary =
+            socks_metrics::summarize(static_cast<socks_metrics::phase>(p));
+
+        out += fmt::format(
+            "{}\"{}\": {{\"count\": {}, \"p50_us\": {}, \"p99_us\": {}, "
+            "\"p999_us\": {}}}",
+            p > 0 ? ", " : "", names[p], summary.count, summary.quantile(0.5),
+            summary.quantile(0.99), summary.quantile(0.999));
+    }
+
+    return out;
+}
+
+std::string format_report(const bench_options &options,
+                          std::size_t proxy_thread_num,
+                          const churn_result &churn,
+                          uint64_t churn_allocations, const bulk_result &bulk,
+                          const latency_result &latency,
+                          const udp_result &udp, const idle_result &idle,
+                          int64_t idle_heap_bytes) {
+    return fmt::format(
+        "{{\n"
+        "  \"options\": {{\"threads\": {}, \"connections\": {}, "
+        "\"duration_s\": {}, \"bulk_bytes\": {}, \"message_size\": {}, "
+        "\"udp_window\": {}, \"splice\": {}, \"io_uring\": {}, "
+        "\"udp_offload\": {}, \"optimistic_connect\": {}, "
+        "\"tcp_fast_open\": {}, \"access_log\": {}, "
+        "\"proxy_threads\": {}}},\n"
+        "  \"churn\": {{\"handshakes\": {}, \"errors\": {}, "
+        "\"handshakes_per_sec\": {:.1f}, \"handshake_latency\": {}, "
+        "\"flow_latency\": {}, \"proxy_allocs_per_handshake\": {:.1f}}},\n"
+        "  \"bulk\": {{\"transfers\": {}, \"errors\": {}, \"bytes\": {}, "
+        "\"aggregate_bytes_per_sec\": {:.0f}, "
+        "\"connection_bytes_per_sec\": {{\"min\": {:.0f}, \"p50\": {:.0f}, "
+        "\"max\": {:.0f}}}}},\n"
+        "  \"latency\": {{\"requests\": {}, \"errors\": {}, "
+        "\"requests_per_sec\": {:.1f}, \"rtt\": {}}},\n"
+        "  \"udp\": {{\"round_trips\": {}, \"lost\": {}, \"errors\": {}, "
+        "\"relayed_datagrams_per_sec\": {:.1f}}},\n"
+        "  \"idle\": {{\"sessions\": {}, \"errors\": {}, "
+        "\"proxy_heap_bytes_per_session\": {:.0f}}},\n"
+        "  \"proxy_phases\": {{{}}}\n"
+        "}}\n",
+        options.threads, options.connections, options.duration.count(),
+        options.bulk_bytes, options.message_size, options.udp_window,
+        socks_config::get()->splice(), socks_config::get()->io_uring(),
+        socks_config::get()->udp_offload(),
+        socks_config::get()->optimistic_connect(),
+        socks_config::get()->tcp_fast_open(),
+        !socks_config::get()->access_log().empty(), proxy_thread_num,
+        churn.handshakes, churn.errors, churn.handshakes / churn.seconds,
+        format_latency(churn.handshake), format_latency(churn.flow),
+        churn.handshakes > 0
+            ? static_cast<double>(churn_allocations) / churn.handshakes
+            : 0.0,
+        bulk.transfers, bulk.errors,
+        bulk.bytes, bulk.bytes / bulk.seconds, bulk.connection_min,
+        bulk.connection_p50, bulk.connection_max, latency.requests,
+        latency.errors, latency.requests / latency.seconds,
+        format_latency(latency.rtt), udp.round_trips, udp.lost, udp.errors,
+        2 * udp.round_trips / udp.seconds, idle.sessions, idle.errors,
+        idle.sessions > 0 ? static_cast<double>(idle_heap_bytes) / idle.sessions
+                          : 0.0,
+        format_phases());
+}
+
+}    // namespace
+
+void *operator new(std::size_t size) {
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    if (proxy_thread) {
+        proxy_allocations.fetch_add(1, std::memory_order_relaxed);
+        proxy_heap_bytes.fetch_add(::malloc_usable_size(p),
+                                   std::memory_order_relaxed);
+    }
+
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    if (p != nullptr && proxy_thread) {
+        proxy_heap_bytes.fetch_sub(::malloc_usable_size(p),
+                                   std::memory_order_relaxed);
+    }
+
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept { operator delete(p); }
+
+int main(int argc, char *argv[]) {
+    bench_options options;
+    std::size_t proxy_thread_num = 1;
+    std::string output;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (i + 1 == argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        const char *value = argv[++i];
+
+        if (std::strcmp(arg, "--config") == 0) {
+            if (!socks_config::load(value)) {
+                return EXIT_FAILURE;
+            }
+        } else if (std::strcmp(arg, "--threads") == 0) {
+            options.threads = std::max(std::stoul(value), 1UL);
+        } else if (std::strcmp(arg, "--connections") == 0) {
+            options.connections = std::max(std::stoul(value), 1UL);
+        } else if (std::strcmp(arg, "--duration") == 0) {
+            options.duration = std::chrono::seconds(std::stoul(value));
+        } else if (std::strcmp(arg, "--bulk-bytes") == 0) {
+            options.bulk_bytes = std::stoull(value);
+        } else if (std::strcmp(arg, "--message-size") == 0) {
+            options.message_size = std::max(std::stoul(value), 1UL);
+        } else if (std::strcmp(arg, "--udp-window") == 0) {
+            options.udp_window = std::max(std::stoul(value), 1UL);
+        } else if (std::strcmp(arg, "--proxy-threads") == 0) {
+            proxy_thread_num = std::max(std::stoul(value), 1UL);
+        } else if (std::strcmp(arg, "--output") == 0) {
+            output = value;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    spdlog::set_level(spdlog::level::warn);
+
+    asio::io_context upstream_context(1);
+    std::vector<std::unique_ptr<asio::io_context>> proxy_contexts;
+
+    if (proxy_thread_num > 1) {
+        dns_cache::share_between_threads();
+    }
+
+    if (!socks_metrics::init(proxy_thread_num)) {
+        return EXIT_FAILURE;
+    }
+
+    for (std::size_t i = 0; i < proxy_thread_num; i++) {
+        proxy_contexts.push_back(std::make_unique<asio::io_context>(1));
+    }
+
+    bench_upstream upstream(upstream_context);
+    upstream.start();
+
+    asio::ip::tcp::acceptor acceptor(
+        *proxy_contexts[0],
+        asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    asio::co_spawn(*proxy_contexts[0], proxy_accept(acceptor, proxy_contexts),
+                   asio::detached);
+
+    auto upstream_guard = asio::make_work_guard(upstream_context);
+    std::thread upstream_thread([&] { upstream_context.run(); });
+
+    std::vector<std::thread> proxy_threads;
+    for (auto &&context : proxy_contexts) {
+        proxy_threads.emplace_back([&context] {
+            proxy_thread = true;
+            auto guard = asio::make_work_guard(*context);
+            context->run();
+        });
+    }
+
+    bench_client client(options, acceptor.local_endpoint());
+
+    uint64_t allocations = proxy_allocations.load();
+    auto churn = client.run_churn(upstream.echo_endpoint());
+    uint64_t churn_allocations = proxy_allocations.load() - allocations;
+
+    auto bulk = client.run_bulk(upstream.sink_endpoint());
+    auto latency = client.run_latency(upstream.echo_endpoint());
+    auto udp = client.run_udp(upstream.udp_echo_endpoint());
+
+    /* last, so the per-worker pools and caches are warm already, once the
+     * sessions of the other scenarios are gone */
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    int64_t heap_bytes = proxy_heap_bytes.load();
+    int64_t idle_heap_bytes = 0;
+    auto idle = client.run_idle(upstream.echo_endpoint(), [&] {
+        /* the relays start after the reply reached the client */
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        idle_heap_bytes = proxy_heap_bytes.load() - heap_bytes;
+    });
+
+    upstream_context.stop();
+    upstream_thread.join();
+    for (auto &&context : proxy_contexts) {
+        context->stop();
+    }
+    for (auto &&thread : proxy_threads) {
+        thread.join();
+    }
+
+    std::string report =
+        format_report(options, proxy_thread_num, churn, churn_allocations,
+                      bulk, latency, udp, idle, idle_heap_bytes);
+
+    if (output.empty()) {
+        std::fputs(report.c_str(), stdout);
+        return EXIT_SUCCESS;
+    }
+
+    std::FILE *file = std::fopen(output.c_str(), "w");
+    if (file == nullptr) {
+        std::fprintf(stderr, "failed to open %s: %s\n", output.c_str(),
+                     std::strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    std::fputs(report.c_str(), file);
+    std::fclose(file);
+
+    return EXIT_SUCCESS;
+}
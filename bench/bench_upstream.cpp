@@ -0,0 +1,158 @@
+#include "bench_upstream.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+#include <array>
+
+bench_upstream::bench_upstream(asio::io_context &io_context)
+    : echo_acceptor_(io_context),
+      sink_acceptor_(io_context),
+      udp_echo_socket_(io_context, asio::ip::udp::endpoint(
+                                       asio::ip::address_v4::loopback(), 0)) {
+    listen(this->echo_acceptor_);
+    listen(this->sink_acceptor_);
+
+    this->echo_endpoint_ = this->echo_acceptor_.local_endpoint();
+    this->sink_endpoint_ = this->sink_acceptor_.local_endpoint();
+    this->udp_echo_endpoint_ = this->udp_echo_socket_.local_endpoint();
+}
+
+void bench_upstream::listen(asio::ip::tcp::acceptor &acceptor) {
+    /* an ephemeral loopback port, throws when the listener cannot be set up */
+    asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::loopback(), 0);
+
+    acceptor.open(endpoint.protocol());
+    acceptor.bind(endpoint);
+
+    /* lets tcp_fast_open be measured, when net.ipv4.tcp_fastopen allows */
+    asio::error_code ignored_ec;
+    acceptor.set_option(
+        asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>(256),
+        ignored_ec);
+
+    acceptor.listen(asio::socket_base::max_listen_connections);
+}
+
+void bench_upstream::start() {
+    asio::co_spawn(this->echo_acceptor_.get_executor(),
+                   this->handle_accept(this->echo_acceptor_, true),
+                   asio::detached);
+
+    asio::co_spawn(this->sink_acceptor_.get_executor(),
+                   this->handle_accept(this->sink_acceptor_, false),
+                   asio::detached);
+
+    asio::co_spawn(this->udp_echo_socket_.get_executor(),
+                   this->handle_udp_echo(), asio::detached);
+}
+
+asio::awaitable<void> bench_upstream::handle_accept(
+    asio::ip::tcp::acceptor &acceptor, bool echo) {
+    asio::error_code ec;
+
+    for (;;) {
+        auto socket = co_await acceptor.async_accept(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec == asio::error::operation_aborted) {
+            co_return;
+        }
+
+        if (ec) {
+            continue;
+        }
+
+        socket.set_option(asio::ip::tcp::no_delay(true), ec);
+
+        if (echo) {
+            asio::co_spawn(acceptor.get_executor(),
+                           handle_echo(std::move(socket)), asio::detached);
+        } else {
+            asio::co_spawn(acceptor.get_executor(),
+                           handle_sink(std::move(socket)), asio::detached);
+        }
+    }
+}
+
+asio::awaitable<void> bench_upstream::handle_echo(
+    asio::ip::tcp::socket socket) {
+    asio::error_code ec;
+    std::array<char, 16384> buf;
+
+    for (;;) {
+        std::size_t n = co_await socket.async_read_some(
+            asio::buffer(buf), asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            co_return;
+        }
+
+        co_await asio::async_write(
+            socket, asio::buffer(buf.data(), n),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            co_return;
+        }
+    }
+}
+
+asio::awaitable<void> bench_upstream::handle_sink(
+    asio::ip::tcp::socket socket) {
+    asio::error_code ec;
+    std::array<char, 65536> buf;
+
+    for (;;) {
+        uint64_t remaining = 0;
+
+        co_await asio::async_read(
+            socket, asio::buffer(&remaining, sizeof(remaining)),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            co_return;
+        }
+
+        while (remaining > 0) {
+            std::size_t n = co_await socket.async_read_some(
+                asio::buffer(buf.data(),
+                             std::min<uint64_t>(remaining, buf.size())),
+                asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                co_return;
+            }
+
+            remaining -= n;
+        }
+
+        char ack = 0;
+
+        co_await asio::async_write(
+            socket, asio::buffer(&ack, 1),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            co_return;
+        }
+    }
+}
+
+asio::awaitable<void> bench_upstream::handle_udp_echo() {
+    asio::error_code ec;
+    std::array<char, 65536> buf;
+    asio::ip::udp::endpoint sender;
+
+    for (;;) {
+        std::size_t n = co_await this->udp_echo_socket_.async_receive_from(
+            asio::buffer(buf), sender,
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec == asio::error::operation_aborted) {
+            co_return;
+        }
+
+        if (ec) {
+            continue;
+        }
+
+        co_await this->udp_echo_socket_.async_send_to(
+            asio::buffer(buf.data(), n), sender,
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+
+#include "asiomp.h"
+
+/*
+ * Loopback upstream the benchmark points the proxy at. The echo listener
+ * writes back whatever it reads. The sink listener reads a 64-bit length
+ * followed by that many bytes and acknowledges the transfer with one byte,
+ * since socks_session closes both sides on EOF and a half-close cannot be
+ * used to mark the end of a bulk transfer. The UDP echo socket returns
+ * every datagram to its sender.
+ */
+class bench_upstream {
+public:
+    explicit bench_upstream(asio::io_context& io_context);
+
+    inline asio::ip::tcp::endpoint echo_endpoint() const {
+        return this->echo_endpoint_;
+    }
+
+    inline asio::ip::tcp::endpoint sink_endpoint() const {
+        return this->sink_endpoint_;
+    }
+
+    inline asio::ip::udp::endpoint udp_echo_endpoint() const {
+        return this->udp_echo_endpoint_;
+    }
+
+    void start();
+
+private:
+    static void listen(asio::ip::tcp::acceptor& acceptor);
+
+    asio::awaitable<void> handle_accept(asio::ip::tcp::acceptor& acceptor,
+                                        bool echo);
+
+    static asio::awaitable<void> handle_echo(asio::ip::tcp::socket socket);
+
+    static asio::awaitable<void> handle_sink(asio::ip::tcp::socket socket);
+
+    asio::awaitable<void> handle_udp_echo();
+
+private:
+    asio::ip::tcp::acceptor echo_acceptor_;
+    asio::ip::tcp::acceptor sink_acceptor_;
+    asio::ip::tcp::endpoint echo_endpoint_;
+    asio::ip::tcp::endpoint sink_endpoint_;
+    asio::ip::udp::socket udp_echo_socket_;
+    asio::ip::udp::endpoint udp_echo_endpoint_;
+};
@@ -0,0 +1,184 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "public.h"
+
+/*
+ * coro_socks_micro_bench: the per-message hot paths of socks_session in
+ * isolation. Every benchmark reports allocs/op next to the time, counted
+ * by the global operator new below.
+ */
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+
+class alloc_counter {
+public:
+    explicit alloc_counter(benchmark::State& state)
+        : state_(state), start_(allocations.load(std::memory_order_relaxed)) {}
+
+    ~alloc_counter() {
+        this->state_.counters["allocs/op"] = benchmark::Counter(
+            static_cast<double>(allocations.load(std::memory_order_relaxed) -
+                                this->start_),
+            benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    benchmark::State& state_;
+    uint64_t start_;
+};
+
+const std::string ipv4_bytes("\xC0\xA8\x01\x64", 4);
+const std::string ipv6_bytes(
+    "\x20\x01\x0D\xB8\x85\xA3\x00\x00\x00\x00\x8A\x2E\x03\x70\x73\x34", 16);
+
+/* greeting and CONNECT pipelined by the client in one segment */
+const std::string connect_ipv4(
+    "\x05\x01\x00"
+    "\x05\x01\x00\x01\xC0\xA8\x01\x64\x01\xBB",
+    13);
+const std::string connect_domain(
+    "\x05\x01\x00"
+    "\x05\x01\x00\x03\x0B"
+    "example.com\x01\xBB",
+    21);
+
+std::string udp_datagram(std::string_view header) {
+    return std::string(header) + std::string(512, 'x');
+}
+
+const std::string udp_ipv4 = udp_datagram(
+    std::string_view("\x00\x00\x00\x01\xC0\xA8\x01\x64\x00\x35", 10));
+const std::string udp_ipv6 =
+    udp_datagram(std::string("\x00\x00\x00\x04", 4) + ipv6_bytes +
+                 std::string("\x00\x35", 2));
+const std::string udp_domain = udp_datagram(
+    std::string_view("\x00\x00\x00\x03\x0B"
+                     "example.com\x00\x35",
+                     18));
+
+void parse_handshake(benchmark::State& state, const std::string& buf) {
+    alloc_counter counter(state);
+
+    for (auto _ : state) {
+        std::string_view view(buf);
+        std::size_t consumed;
+        coro_socks::method_request method;
+        coro_socks::client_request request;
+
+        coro_socks::parse_message(view, consumed, method);
+        view.remove_prefix(consumed);
+        coro_socks::parse_message(view, consumed, request);
+
+        benchmark::DoNotOptimize(request);
+    }
+}
+
+void parse_udp_header(benchmark::State& state, const std::string& buf) {
+    alloc_counter counter(state);
+
+    for (auto _ : state) {
+        std::size_t consumed;
+        coro_socks::udp_request request;
+
+        coro_socks::parse_message(buf, consumed, request);
+        benchmark::DoNotOptimize(request);
+    }
+}
+
+void encode_udp_header(benchmark::State& state, const char* address) {
+    asio::ip::udp::endpoint endpoint(asio::ip::make_address(address), 53);
+    char header[coro_socks::max_udp_header_size];
+    alloc_counter counter(state);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            coro_socks::encode_udp_header(endpoint, header));
+        benchmark::ClobberMemory();
+    }
+}
+
+void format_address(benchmark::State& state, const std::string& bytes,
+                    uint8_t atyp) {
+    alloc_counter counter(state);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(coro_socks::format_address(bytes, atyp));
+    }
+}
+
+/* what CONNECT and every UDP datagram do to get an asio address */
+void bytes_to_address(benchmark::State& state, const std::string& bytes,
+                      uint8_t atyp) {
+    asio::error_code ec;
+    alloc_counter counter(state);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(asio::ip::make_address(
+            coro_socks::format_address(bytes, atyp), ec));
+    }
+}
+
+/* the conversion without the string round trip */
+void make_address(benchmark::State& state, const std::string& bytes,
+                  uint8_t atyp) {
+    alloc_counter counter(state);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(coro_socks::make_address(bytes, atyp));
+    }
+}
+
+void format_endpoint(benchmark::State& state, const char* address) {
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(address), 1080);
+    alloc_counter counter(state);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(coro_socks::format_address(endpoint));
+    }
+}
+
+}    // namespace
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+BENCHMARK_CAPTURE(parse_handshake, ipv4, connect_ipv4);
+BENCHMARK_CAPTURE(parse_handshake, domain, connect_domain);
+
+BENCHMARK_CAPTURE(parse_udp_header, ipv4, udp_ipv4);
+BENCHMARK_CAPTURE(parse_udp_header, ipv6, udp_ipv6);
+BENCHMARK_CAPTURE(parse_udp_header, domain, udp_domain);
+
+BENCHMARK_CAPTURE(encode_udp_header, ipv4, "192.168.1.100");
+BENCHMARK_CAPTURE(encode_udp_header, ipv6, "2001:db8:85a3::8a2e:370:7334");
+
+BENCHMARK_CAPTURE(format_address, ipv4, ipv4_bytes, coro_socks::Atyp::IpV4);
+BENCHMARK_CAPTURE(format_address, ipv6, ipv6_bytes, coro_socks::Atyp::IpV6);
+
+BENCHMARK_CAPTURE(bytes_to_address, ipv4, ipv4_bytes, coro_socks::Atyp::IpV4);
+BENCHMARK_CAPTURE(bytes_to_address, ipv6, ipv6_bytes, coro_socks::Atyp::IpV6);
+
+BENCHMARK_CAPTURE(make_address, ipv4, ipv4_bytes, coro_socks::Atyp::IpV4);
+BENCHMARK_CAPTURE(make_address, ipv6, ipv6_bytes, coro_socks::Atyp::IpV6);
+
+BENCHMARK_CAPTURE(format_endpoint, ipv4, "192.168.1.100");
+BENCHMARK_CAPTURE(format_endpoint, ipv6, "2001:db8:85a3::8a2e:370:7334");
+
+BENCHMARK_MAIN();
@@ -1,24 +1,80 @@
+#include <unistd.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
 #include "asiomp.h"
 #include "config.h"
+#include "metrics.h"
+#include "metrics_exporter.h"
+#include "reuseport_server.h"
 #include "socks_session.h"
+#include "threaded_server.h"
 
 int main(int argc, char *argv[]) {
-    if (!socks_config::get()->parse("../config.yml")) {
+    if (!socks_config::load("../config.yml")) {
+        return EXIT_FAILURE;
+    }
+
+    /* reloads are taken by the workers, ignored until they watch for it */
+    ::signal(SIGHUP, SIG_IGN);
+
+    /* the segment and the exporter must exist before asiomp forks */
+    if (socks_config::get()->metrics_port() != 0) {
+        if (!socks_metrics::init(
+                socks_config::get()->worker_threads() > 0
+                    ? socks_config::get()->worker_threads()
+                    : socks_config::get()->worker_process_num()) ||
+            !metrics_exporter::spawn(socks_config::get()->metrics_address(),
+                                     socks_config::get()->metrics_port())) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (socks_config::get()->worker_threads() > 0) {
+        threaded_server(socks_config::get()->address(),
+                        socks_config::get()->port(),
+                        socks_config::get()->worker_threads(),
+                        socks_config::get()->daemon(),
+                        socks_config::get()->worker_cpus())
+            .run();
+        return EXIT_SUCCESS;
+    }
+
+    if (socks_config::get()->reuseport()) {
+        reuseport_server(socks_config::get()->address(),
+                         socks_config::get()->port(),
+                         socks_config::get()->worker_process_num(),
+                         socks_config::get()->daemon(),
+                         socks_config::get()->worker_cpus(),
+                         socks_config::get()->incoming_cpu())
+            .run();
+        return EXIT_SUCCESS;
+    }
+
+    /* daemonized here, the master's reload thread has to survive it */
+    if (socks_config::get()->daemon() && ::daemon(1, 0) < 0) {
+        SPDLOG_ERROR("failed to daemonize: {}", std::strerror(errno));
         return EXIT_FAILURE;
     }
 
-    asiomp_server::register_session<socks_session>("socks_session");
+    /* the master validates and keeps a reload before the workers see it */
+    if (!socks_config::relay_sighup()) {
+        return EXIT_FAILURE;
+    }
+
+    asiomp_server::register_session<slab_session>("socks_session");
 
     if (socks_config::get()->worker_process_num() == 1) {
         asiomp_server(argv, socks_config::get()->address(),
-                      socks_config::get()->port(),
-                      socks_config::get()->daemon(), "socks_session")
+                      socks_config::get()->port(), false, "socks_session")
             .run();
     } else {
         asiomp_server(argv, socks_config::get()->address(),
                       socks_config::get()->port(),
-                      socks_config::get()->worker_process_num(),
-                      socks_config::get()->daemon(), "socks_session")
+                      socks_config::get()->worker_process_num(), false,
+                      "socks_session")
             .run();
     }
 
@@ -0,0 +1,303 @@
+#include "access_log.h"
+
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "metrics.h"
+#include "public.h"
+
+namespace {
+
+/* how long a record may wait in its ring before it is written */
+constexpr std::chrono::milliseconds flush_interval{50};
+
+/* indexed by the REP field, as in the metrics */
+const char* const reply_names[] = {
+    "succeeded",           "general_failure",
+    "not_allowed",         "network_unreachable",
+    "host_unreachable",    "connection_refused",
+    "ttl_expired",         "command_not_supported",
+    "address_type_not_supported"};
+
+/* names and user names are whatever the client sent */
+void append_escaped(std::string& out, std::string_view s) {
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+            fmt::format_to(std::back_inserter(out), "\\u{:04x}",
+                           static_cast<unsigned>(static_cast<uint8_t>(c)));
+        } else {
+            out += c;
+        }
+    }
+}
+
+void append_address(std::string& out, const char* bytes, std::size_t len,
+                    uint8_t atyp, uint16_t port) {
+    out += '"';
+
+    switch (atyp) {
+        case coro_socks::Atyp::IpV4: {
+            out += coro_socks::make_address(std::string_view(bytes, 4), atyp)
+                       .to_string();
+            break;
+        }
+        case coro_socks::Atyp::IpV6: {
+            out += '[';
+            out += coro_socks::make_address(std::string_view(bytes, 16), atyp)
+                       .to_string();
+            out += ']';
+            break;
+        }
+        default: {
+            append_escaped(out, std::string_view(bytes, len));
+            break;
+        }
+    }
+
+    fmt::format_to(std::back_inserter(out), ":{}\"", port);
+}
+
+void append_record(std::string& out, const access_log::record& r) {
+    time_t secs = static_cast<time_t>(r.start_us / 1000000);
+    struct tm tm;
+    ::gmtime_r(&secs, &tm);
+
+    fmt::format_to(std::back_inserter(out),
+                   "{{\"time\":\"{:04d}-{:02d}-{:02d}T{:02d}:{:02d}:{:02d}."
+                   "{:06d}Z\",\"client\":",
+                   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                   tm.tm_min, tm.tm_sec, r.start_us % 1000000);
+    append_address(out, r.client_addr, 16, r.client_atyp, r.client_port);
+
+    out += ",\"user\":";
+    if (r.user_len > 0) {
+        out += '"';
+        append_escaped(out, std::string_view(r.user, r.user_len));
+        out += '"';
+    } else {
+        out += "null";
+    }
+
+    out += ",\"command\":";
+    switch (r.cmd) {
+        case access_log::no_command: {
+            out += "null";
+            break;
+        }
+        case coro_socks::RequestCmd::Connect: {
+            out += "\"connect\"";
+            break;
+        }
+        case coro_socks::RequestCmd::UdpAssociate: {
+            out += "\"udp_associate\"";
+            break;
+        }
+        default: {
+            out += "\"unsupported\"";
+            break;
+        }
+    }
+
+    out += ",\"destination\":";
+    if (r.cmd != access_log::no_command) {
+        append_address(out, r.dst_addr, r.dst_len, r.dst_atyp, r.dst_port);
+    } else {
+        out += "null";
+    }
+
+    out += ",\"reply\":";
+    if (r.rep < std::size(reply_names)) {
+        fmt::format_to(std::back_inserter(out), "\"{}\"", reply_names[r.rep]);
+    } else {
+        out += "null";
+    }
+
+    fmt::format_to(std::back_inserter(out),
+                   ",\"bytes_client_to_remote\":{},"
+                   "\"bytes_remote_to_client\":{},\"duration\":{}.{:06d}}}\n",
+                   r.bytes_client_to_remote, r.bytes_remote_to_client,
+                   r.duration_us / 1000000, r.duration_us % 1000000);
+}
+
+/*
+ * Drains the rings of all workers of the process. Formatting and writing
+ * happen on this thread only, the workers never wait for it.
+ */
+class access_log_writer {
+public:
+    static access_log_writer* get() {
+        /* never torn down, the rings outlive the statics at exit */
+        static access_log_writer* writer = new access_log_writer();
+        return writer;
+    }
+
+    void add(access_log* ring) {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+
+        this->rings_.push_back(ring);
+
+        /* started by the first ring, so that only workers ever have one */
+        if (!this->started_) {
+            this->started_ = true;
+            std::thread([this] { this->run(); }).detach();
+            std::atexit([] { access_log_writer::get()->stop(); });
+        }
+    }
+
+    /* the last batch, afterwards the thread leaves the statics be */
+    void stop() {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+
+        this->flush();
+        this->stopping_ = true;
+    }
+
+private:
+    access_log_writer() : fd_(-1), started_(false), stopping_(false) {}
+
+    void run() {
+        ::prctl(PR_SET_NAME, "access-log");
+
+        for (;;) {
+            std::this_thread::sleep_for(flush_interval);
+
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            if (this->stopping_) {
+                return;
+            }
+
+            this->flush();
+        }
+    }
+
+    void flush() {
+        for (access_log* ring : this->rings_) {
+            ring->drain(this->out_);
+        }
+
+        if (this->out_.empty()) {
+            return;
+        }
+
+        /* a reload opens the file again, so it can be rotated on SIGHUP */
+        auto config = socks_config::snapshot();
+        if (config != this->config_) {
+            this->config_ = std::move(config);
+            this->open(this->config_->access_log());
+        }
+
+        std::size_t written = 0;
+        while (this->fd_ >= 0 && written < this->out_.size()) {
+            ssize_t n = ::write(this->fd_, this->out_.data() + written,
+                                this->out_.size() - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n < 0) {
+                SPDLOG_ERROR("failed to write access log: {}",
+                             std::strerror(errno));
+                ::close(this->fd_);
+                this->fd_ = -1;
+                break;
+            }
+
+            written += static_cast<std::size_t>(n);
+        }
+
+        this->out_.clear();
+    }
+
+    void open(const std::string& file) {
+        if (this->fd_ >= 0) {
+            ::close(this->fd_);
+            this->fd_ = -1;
+        }
+
+        if (file.empty()) {
+            return;
+        }
+
+        /* appends of all workers land whole, one batch per write */
+        this->fd_ = ::open(file.c_str(),
+                           O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (this->fd_ < 0) {
+            SPDLOG_ERROR("failed to open access log [{}]: {}", file,
+                         std::strerror(errno));
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<access_log*> rings_;
+    std::string out_;
+    /* the snapshot the file was opened for */
+    std::shared_ptr<const socks_config> config_;
+    int fd_;
+    bool started_;
+    bool stopping_;
+};
+
+}    // namespace
+
+access_log* access_log::get() {
+    /* never torn down, sessions may outlive the thread locals at exit */
+    static thread_local access_log* log = [] {
+        auto* log = new access_log(socks_config::get()->access_log_buffer());
+        access_log_writer::get()->add(log);
+        return log;
+    }();
+    return log;
+}
+
+void access_log::flush() { access_log_writer::get()->stop(); }
+
+access_log::access_log(std::size_t capacity)
+    : slots_(new record[std::bit_ceil(std::max<std::size_t>(capacity, 1))]),
+      mask_(std::bit_ceil(std::max<std::size_t>(capacity, 1)) - 1),
+      head_(0),
+      tail_(0) {}
+
+access_log::record* access_log::reserve() {
+    uint64_t head = this->head_.load(std::memory_order_relaxed);
+
+    if (head - this->tail_.load(std::memory_order_acquire) > this->mask_) {
+        socks_metrics::get()->add(socks_metrics::counter::access_log_dropped);
+        return nullptr;
+    }
+
+    return &this->slots_[head & this->mask_];
+}
+
+void access_log::commit() {
+    this->head_.store(this->head_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+}
+
+void access_log::drain(std::string& out) {
+    uint64_t tail = this->tail_.load(std::memory_order_relaxed);
+    uint64_t head = this->head_.load(std::memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        append_record(out, this->slots_[tail & this->mask_]);
+    }
+
+    this->tail_.store(tail, std::memory_order_release);
+}
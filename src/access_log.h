@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/*
+ * Access log with one record per session. A worker puts fixed size binary
+ * records into a ring of its own and never waits for the file, a record
+ * that finds the ring full is dropped and counted. One writer thread per
+ * process drains all rings in batches, formats the records as JSON lines
+ * there and appends each batch to the file with a single write.
+ */
+class access_log {
+public:
+    static constexpr uint8_t no_command = 0x00;
+    static constexpr uint8_t no_reply = 0xff;
+
+    /* addresses and names are kept as they came off the wire */
+    struct record {
+        /* system clock, microseconds since the epoch */
+        int64_t start_us;
+        uint64_t duration_us;
+        uint64_t bytes_client_to_remote;
+        uint64_t bytes_remote_to_client;
+        char client_addr[16];
+        uint16_t client_port;
+        uint8_t client_atyp;
+        uint8_t cmd;
+        uint8_t rep;
+        uint8_t dst_atyp;
+        uint16_t dst_port;
+        uint8_t dst_len;
+        uint8_t user_len;
+        char dst_addr[255];
+        char user[255];
+    };
+
+    /* the calling thread's ring, created on first use */
+    static access_log* get();
+
+    /*
+     * writes the last batch of every ring of the process, for a worker
+     * that leaves with _exit() and skips the one written at exit
+     */
+    static void flush();
+
+    /* the slot for the next record, null when the ring is full */
+    record* reserve();
+
+    /* publishes the slot reserve() returned */
+    void commit();
+
+    /* consumer side, appends the formatted records to out */
+    void drain(std::string& out);
+
+private:
+    explicit access_log(std::size_t capacity);
+
+    access_log(const access_log&) = delete;
+
+    access_log& operator=(const access_log&) = delete;
+
+private:
+    std::unique_ptr<record[]> slots_;
+    std::size_t mask_;
+    /* written by the worker and the writer thread, one line each */
+    alignas(64) std::atomic<uint64_t> head_;
+    alignas(64) std::atomic<uint64_t> tail_;
+};
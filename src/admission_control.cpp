@@ -0,0 +1,187 @@
+#include "admission_control.h"
+
+#include "config.h"
+#include "metrics.h"
+
+admission_control* admission_control::get(const asio::any_io_executor& ex) {
+    /* never torn down, sessions may outlive the thread locals at exit */
+    static thread_local admission_control* control = new admission_control(ex);
+    return control;
+}
+
+admission_control::admission_control(const asio::any_io_executor& ex)
+    : executor_(ex),
+      sessions_(0),
+      handshakes_(0),
+      derivations_(0),
+      rejects_(0),
+      lag_(clock::duration::zero()),
+      overloaded_since_(),
+      probing_(false),
+      overloaded_(false) {}
+
+bool admission_control::admit() {
+    this->update();
+    if (this->overloaded_) {
+        return false;
+    }
+
+    this->sessions_++;
+    this->handshakes_++;
+    socks_metrics::get()->add(socks_metrics::gauge::handshakes_active, 1);
+
+    if (!this->probing_ && socks_config::get()->max_loop_lag() > 0) {
+        this->probing_ = true;
+        asio::co_spawn(this->executor_, this->probe_lag(), asio::detached);
+    }
+
+    this->update();
+    return true;
+}
+
+void admission_control::handshake_done() {
+    this->handshakes_--;
+    socks_metrics::get()->add(socks_metrics::gauge::handshakes_active, -1);
+    this->update();
+}
+
+asio::awaitable<bool> admission_control::derivation_begin() {
+    std::size_t max_derivations = socks_config::get()->max_derivations();
+
+    if (this->derivations_ < max_derivations) {
+        this->derivations_++;
+        socks_metrics::get()->add(socks_metrics::gauge::derivations_active,
+                                  1);
+        co_return true;
+    }
+
+    if (this->derivation_waiters_.size() >= max_derivations) {
+        co_return false;
+    }
+
+    asio::steady_timer slot(this->executor_, clock::time_point::max());
+    asio::error_code ec;
+
+    this->derivation_waiters_.push_back(&slot);
+    co_await slot.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+
+    co_return true;
+}
+
+void admission_control::derivation_done() {
+    if (!this->derivation_waiters_.empty()) {
+        /* the slot passes on, the count stays */
+        this->derivation_waiters_.front()->cancel();
+        this->derivation_waiters_.pop_front();
+        return;
+    }
+
+    this->derivations_--;
+    socks_metrics::get()->add(socks_metrics::gauge::derivations_active, -1);
+}
+
+bool admission_control::reject_begin() {
+    if (this->rejects_ >= max_rejects) {
+        return false;
+    }
+
+    this->rejects_++;
+    return true;
+}
+
+void admission_control::reject_done() { this->rejects_--; }
+
+void admission_control::session_done(bool handshaking) {
+    if (handshaking) {
+        this->handshake_done();
+    }
+
+    this->sessions_--;
+    this->update();
+}
+
+bool admission_control::pauses_accept() const {
+    return socks_config::get()->overload_action() ==
+           socks_config::overload::pause;
+}
+
+asio::awaitable<void> admission_control::wait_until_admitting() {
+    asio::steady_timer timer(this->executor_);
+    asio::error_code ec;
+
+    for (;;) {
+        /* a reload may have raised the caps, so check again every time */
+        this->update();
+        if (!this->overloaded_) {
+            co_return;
+        }
+
+        timer.expires_after(std::chrono::milliseconds(10));
+        co_await timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+    }
+}
+
+void admission_control::update() {
+    const socks_config* config = socks_config::get();
+    std::size_t max_sessions = config->max_sessions();
+    std::size_t max_handshakes = config->max_handshakes();
+    auto max_lag = std::chrono::milliseconds(config->max_loop_lag());
+    uint32_t recovery = config->overload_recovery();
+
+    bool overloaded;
+    if (!this->overloaded_) {
+        overloaded = (max_sessions > 0 && this->sessions_ >= max_sessions) ||
+                     (max_handshakes > 0 &&
+                      this->handshakes_ >= max_handshakes) ||
+                     (max_lag.count() > 0 && this->lag_ >= max_lag);
+    } else {
+        /* held a while, then all shares of the caps have to be met */
+        overloaded =
+            clock::now() - this->overloaded_since_ < min_overload ||
+            (max_sessions > 0 &&
+             this->sessions_ * 100 >= max_sessions * recovery) ||
+            (max_handshakes > 0 &&
+             this->handshakes_ * 100 >= max_handshakes * recovery) ||
+            (max_lag.count() > 0 && this->lag_ * 100 >= max_lag * recovery);
+    }
+
+    if (overloaded != this->overloaded_) {
+        this->overloaded_ = overloaded;
+        if (overloaded) {
+            this->overloaded_since_ = clock::now();
+        }
+
+        socks_metrics::get()->add(socks_metrics::gauge::workers_overloaded,
+                                  overloaded ? 1 : -1);
+        SPDLOG_WARN("worker {} overload, {} sessions, {} handshakes, {}ms lag",
+                    overloaded ? "entered" : "left", this->sessions_,
+                    this->handshakes_,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        this->lag_)
+                        .count());
+    }
+}
+
+asio::awaitable<void> admission_control::probe_lag() {
+    asio::steady_timer timer(this->executor_);
+    asio::error_code ec;
+
+    while (this->sessions_ > 0 && socks_config::get()->max_loop_lag() > 0) {
+        auto expected = clock::now() + probe_interval;
+
+        timer.expires_at(expected);
+        co_await timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            break;
+        }
+
+        this->lag_ = clock::now() - expected;
+        this->update();
+    }
+
+    this->lag_ = clock::duration::zero();
+    this->probing_ = false;
+    this->update();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+
+#include "asiomp.h"
+
+/*
+ * Per-worker admission control. A worker is overloaded once its active
+ * sessions, its handshakes in progress or the lag of its event loop reach
+ * the configured caps, and stays so for a while and until all of them are
+ * back below the recovery share of their caps, so it does not flap. New
+ * clients of an overloaded worker are shed, either answered with a failure
+ * right away or, where the server owns the acceptor, left in the listen
+ * backlog until the worker recovers. Password derivations have a cap of
+ * their own, sessions past it wait in line and never overload the worker.
+ */
+class admission_control {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static admission_control* get(const asio::any_io_executor& ex);
+
+    /* counts the session and its handshake, false when it must be shed */
+    bool admit();
+
+    void handshake_done();
+
+    /*
+     * takes a derivation slot, waiting in line at the cap, false when as
+     * many sessions are waiting already
+     */
+    asio::awaitable<bool> derivation_begin();
+
+    void derivation_done();
+
+    /* counts a shed client still being answered, false at the cap */
+    bool reject_begin();
+
+    void reject_done();
+
+    /* for an admitted session, handshaking when it never got that far */
+    void session_done(bool handshaking);
+
+    inline bool overloaded() const { return this->overloaded_; }
+
+    /* true when the configuration wants accepting paused while overloaded */
+    bool pauses_accept() const;
+
+    /* returns once the worker admits again */
+    asio::awaitable<void> wait_until_admitting();
+
+private:
+    explicit admission_control(const asio::any_io_executor& ex);
+
+    admission_control(const admission_control&) = delete;
+
+    admission_control& operator=(const admission_control&) = delete;
+
+    void update();
+
+    /* measures how late a timer fires while there are sessions */
+    asio::awaitable<void> probe_lag();
+
+private:
+    static constexpr std::chrono::milliseconds probe_interval{100};
+    /* least time spent overloaded, bounds the flapping under tiny caps */
+    static constexpr std::chrono::milliseconds min_overload{100};
+    /* shed clients answered at once, the ones past it are just closed */
+    static constexpr std::size_t max_rejects = 64;
+
+    asio::any_io_executor executor_;
+    std::size_t sessions_;
+    std::size_t handshakes_;
+    std::size_t derivations_;
+    std::size_t rejects_;
+    /* woken in order, derivation_done() hands its slot to the first */
+    std::deque<asio::steady_timer*> derivation_waiters_;
+    clock::duration lag_;
+    clock::time_point overloaded_since_;
+    bool probing_;
+    bool overloaded_;
+};
@@ -0,0 +1,146 @@
+#include "buffer_pool.h"
+
+#include <new>
+
+#include "metrics.h"
+
+static_assert(static_cast<std::size_t>(
+                  socks_metrics::gauge::buffers_pooled_4k) -
+                  static_cast<std::size_t>(
+                      socks_metrics::gauge::buffers_in_use_4k) ==
+              buffer_pool::class_num);
+
+buffer_pool* buffer_pool::get() {
+    static thread_local buffer_pool pool;
+    return &pool;
+}
+
+buffer_pool::buffer_pool() : bytes_in_use_(0), bytes_high_water_(0) {
+    for (auto& size_class : this->classes_) {
+        size_class.in_use = 0;
+        size_class.high_water = 0;
+    }
+}
+
+buffer_pool::~buffer_pool() {
+    for (auto& size_class : this->classes_) {
+        for (char* data : size_class.free_list) {
+            ::operator delete(data);
+        }
+    }
+}
+
+char* buffer_pool::acquire(std::size_t size_class) {
+    auto& list = this->classes_[size_class];
+    char* data;
+
+    if (!list.free_list.empty()) {
+        data = list.free_list.back();
+        list.free_list.pop_back();
+        socks_metrics::get()->add(socks_metrics::gauge::buffer_bytes_pooled,
+                                  -static_cast<int64_t>(class_size(size_class)));
+        socks_metrics::get()->add(socks_metrics::gauge::buffers_pooled_4k,
+                                  size_class, -1);
+    } else {
+        data = static_cast<char*>(::operator new(class_size(size_class)));
+    }
+
+    if (++list.in_use > list.high_water) {
+        list.high_water = list.in_use;
+        socks_metrics::get()->add(socks_metrics::gauge::buffers_high_water_4k,
+                                  size_class, 1);
+    }
+    socks_metrics::get()->add(socks_metrics::gauge::buffers_in_use_4k,
+                              size_class, 1);
+
+    this->bytes_in_use_ += class_size(size_class);
+    socks_metrics::get()->add(socks_metrics::gauge::buffer_bytes_in_use,
+                              static_cast<int64_t>(class_size(size_class)));
+    if (this->bytes_in_use_ > this->bytes_high_water_) {
+        this->bytes_high_water_ = this->bytes_in_use_;
+    }
+
+    return data;
+}
+
+void buffer_pool::release(char* data, std::size_t size_class) {
+    auto& list = this->classes_[size_class];
+
+    --list.in_use;
+    this->bytes_in_use_ -= class_size(size_class);
+    socks_metrics::get()->add(socks_metrics::gauge::buffer_bytes_in_use,
+                              -static_cast<int64_t>(class_size(size_class)));
+    socks_metrics::get()->add(socks_metrics::gauge::buffers_in_use_4k,
+                              size_class, -1);
+
+    if ((list.free_list.size() + 1) * class_size(size_class) >
+        max_pooled_bytes) {
+        ::operator delete(data);
+        return;
+    }
+
+    list.free_list.push_back(data);
+    socks_metrics::get()->add(socks_metrics::gauge::buffer_bytes_pooled,
+                              static_cast<int64_t>(class_size(size_class)));
+    socks_metrics::get()->add(socks_metrics::gauge::buffers_pooled_4k,
+                              size_class, 1);
+}
+
+buffer_pool::stats buffer_pool::get_stats() const {
+    stats s;
+
+    s.bytes_in_use = this->bytes_in_use_;
+    s.bytes_high_water = this->bytes_high_water_;
+    s.bytes_pooled = 0;
+
+    for (std::size_t i = 0; i < class_num; i++) {
+        s.classes[i].size = class_size(i);
+        s.classes[i].in_use = this->classes_[i].in_use;
+        s.classes[i].pooled = this->classes_[i].free_list.size();
+        s.classes[i].high_water = this->classes_[i].high_water;
+        s.bytes_pooled += s.classes[i].pooled * class_size(i);
+    }
+
+    return s;
+}
+
+relay_buffer::relay_buffer()
+    : data_(nullptr), size_class_(0), full_reads_(0) {}
+
+relay_buffer::~relay_buffer() { this->release(); }
+
+void relay_buffer::acquire() {
+    if (this->data_ == nullptr) {
+        this->data_ = buffer_pool::get()->acquire(this->size_class_);
+    }
+}
+
+void relay_buffer::release() {
+    if (this->data_ != nullptr) {
+        buffer_pool::get()->release(this->data_, this->size_class_);
+        this->data_ = nullptr;
+    }
+}
+
+void relay_buffer::feedback(std::size_t n) {
+    if (n == this->size()) {
+        /* the socket had at least a full buffer queued, keep the memory and
+         * move up one class after two consecutive full reads */
+        if (++this->full_reads_ >= 2 &&
+            this->size_class_ + 1 < buffer_pool::class_num) {
+            this->release();
+            this->size_class_++;
+            this->full_reads_ = 0;
+            this->acquire();
+        }
+        return;
+    }
+
+    /* the socket is drained, hand the memory back until it is readable */
+    this->full_reads_ = 0;
+    this->release();
+
+    if (n <= this->size() / 4 && this->size_class_ > 0) {
+        this->size_class_--;
+    }
+}
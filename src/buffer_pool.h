@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Per-worker pool of relay buffers, split into power-of-two size classes
+ * from 4 KiB to 256 KiB. Every worker runs a single io_context thread, so
+ * the pool is thread local and needs no locking.
+ */
+class buffer_pool {
+public:
+    static constexpr std::size_t min_size = 4096;
+    static constexpr std::size_t max_size = 262144;
+    static constexpr std::size_t class_num = 7;
+
+    /* upper bound of the bytes kept on the free list of each class */
+    static constexpr std::size_t max_pooled_bytes = 4 * 1024 * 1024;
+
+    struct class_stats {
+        std::size_t size;
+        std::size_t in_use;
+        std::size_t pooled;
+        std::size_t high_water;
+    };
+
+    struct stats {
+        std::array<class_stats, class_num> classes;
+        std::size_t bytes_in_use;
+        std::size_t bytes_pooled;
+        std::size_t bytes_high_water;
+    };
+
+    static buffer_pool* get();
+
+    static constexpr std::size_t class_size(std::size_t size_class) {
+        return min_size << size_class;
+    }
+
+    char* acquire(std::size_t size_class);
+
+    void release(char* data, std::size_t size_class);
+
+    stats get_stats() const;
+
+    ~buffer_pool();
+
+private:
+    buffer_pool();
+
+    buffer_pool(const buffer_pool&) = delete;
+
+    buffer_pool& operator=(const buffer_pool&) = delete;
+
+private:
+    struct size_class_list {
+        std::vector<char*> free_list;
+        std::size_t in_use;
+        std::size_t high_water;
+    };
+
+    std::array<size_class_list, class_num> classes_;
+    std::size_t bytes_in_use_;
+    std::size_t bytes_high_water_;
+};
+
+/*
+ * A relay buffer whose size class adapts to the flow: it grows when reads
+ * keep filling it and shrinks when they only use a fraction of it. The
+ * memory itself is only held while data is in flight, so an idle flow
+ * costs nothing but the size hint.
+ */
+class relay_buffer {
+public:
+    relay_buffer();
+
+    ~relay_buffer();
+
+    relay_buffer(const relay_buffer&) = delete;
+
+    relay_buffer& operator=(const relay_buffer&) = delete;
+
+    inline bool empty() const { return this->data_ == nullptr; }
+
+    inline char* data() const { return this->data_; }
+
+    inline std::size_t size() const {
+        return buffer_pool::class_size(this->size_class_);
+    }
+
+    void acquire();
+
+    void release();
+
+    /* adjust the size class after a read of n bytes */
+    void feedback(std::size_t n);
+
+private:
+    char* data_;
+    std::size_t size_class_;
+    uint32_t full_reads_;
+};
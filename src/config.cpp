@@ -1,10 +1,284 @@
 #include "config.h"
 
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+
+#include "offload_pool.h"
 #include "yaml-cpp/yaml.h"
 
-socks_config* socks_config::get() {
-    static socks_config config;
-    return &config;
+namespace {
+
+/*
+ * What the master of an asiomp tree last loaded, in memory it shares with
+ * its workers. Only the master writes, the sequence is odd meanwhile.
+ */
+struct relayed_config {
+    pid_t master;
+    std::atomic<uint64_t> sequence;
+    std::atomic<uint64_t> digest[coro_socks::sha256::digest_size / 8];
+};
+
+relayed_config* relayed = nullptr;
+
+/* the sequence this process last loaded, a forked worker starts with it */
+uint64_t relayed_sequence = 0;
+
+/* the digest of the file of the last successful load() */
+coro_socks::sha256::digest loaded_digest;
+
+/* held by master reloads, forks wait for it */
+std::mutex relaying;
+
+bool read_file(const std::string& file, std::string& content) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        std::printf("failed to open config file: [%s]\n", file.c_str());
+        return false;
+    }
+
+    std::stringstream buf;
+    buf << in.rdbuf();
+    content = buf.str();
+    return true;
+}
+
+void publish(const coro_socks::sha256::digest& digest) {
+    uint64_t words[coro_socks::sha256::digest_size / 8];
+    std::memcpy(words, digest.data(), digest.size());
+
+    relayed->sequence.fetch_add(1, std::memory_order_acq_rel);
+    for (std::size_t i = 0; i < std::size(words); i++) {
+        relayed->digest[i].store(words[i], std::memory_order_relaxed);
+    }
+    relayed_sequence =
+        relayed->sequence.fetch_add(1, std::memory_order_acq_rel) + 1;
+}
+
+/* the digest the master published and its sequence */
+uint64_t published(coro_socks::sha256::digest& digest) {
+    uint64_t words[coro_socks::sha256::digest_size / 8];
+    uint64_t sequence;
+
+    do {
+        sequence = relayed->sequence.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < std::size(words); i++) {
+            words[i] = relayed->digest[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((sequence & 1) != 0 ||
+             sequence != relayed->sequence.load(std::memory_order_relaxed));
+
+    std::memcpy(digest.data(), words, digest.size());
+    return sequence;
+}
+
+/* the workers asiomp forked, or none in a worker */
+void forward_sighup() {
+    std::ifstream children("/proc/self/task/" + std::to_string(::getpid()) +
+                           "/children");
+    pid_t pid;
+
+    while (children >> pid) {
+        ::kill(pid, SIGHUP);
+    }
+}
+
+}    // namespace
+
+/* the defaults until main() loads the file */
+std::atomic<std::shared_ptr<const socks_config>> socks_config::current_{
+    std::shared_ptr<const socks_config>(new socks_config())};
+std::atomic<uint64_t> socks_config::generation_{0};
+std::string socks_config::file_;
+
+const std::shared_ptr<const socks_config>& socks_config::cached() {
+    /* never torn down, sessions may outlive the thread locals at exit */
+    static thread_local auto* config =
+        new std::shared_ptr<const socks_config>();
+    static thread_local uint64_t generation = UINT64_MAX;
+
+    uint64_t latest = generation_.load(std::memory_order_acquire);
+    if (latest != generation) {
+        *config = current_.load(std::memory_order_acquire);
+        generation = latest;
+    }
+
+    return *config;
+}
+
+const socks_config* socks_config::get() { return cached().get(); }
+
+std::shared_ptr<const socks_config> socks_config::snapshot() {
+    return cached();
+}
+
+bool socks_config::load(const std::string& file) {
+    std::shared_ptr<socks_config> config(new socks_config());
+    std::string content;
+
+    if (!read_file(file, content)) {
+        return false;
+    }
+
+    coro_socks::sha256::digest digest = coro_socks::sha256::hash(content);
+    bool master = relayed == nullptr || relayed->master == ::getpid();
+    uint64_t sequence = relayed_sequence;
+
+    /* a worker takes exactly what its master checked, or nothing */
+    if (!master) {
+        coro_socks::sha256::digest checked;
+        sequence = published(checked);
+
+        if (digest != checked) {
+            std::printf("config file [%s] is not what the master loaded\n",
+                        file.c_str());
+            return false;
+        }
+    }
+
+    if (!config->parse(file, content)) {
+        return false;
+    }
+
+    /* reloads must not depend on the directory a daemon ends up in */
+    std::error_code ec;
+    std::filesystem::path absolute = std::filesystem::absolute(file, ec);
+    file_ = ec ? file : absolute.lexically_normal().string();
+    current_.store(std::move(config), std::memory_order_release);
+    generation_.fetch_add(1, std::memory_order_release);
+
+    loaded_digest = digest;
+    if (relayed != nullptr && master) {
+        publish(digest);
+    } else {
+        relayed_sequence = sequence;
+    }
+
+    return true;
+}
+
+bool socks_config::reload() { return load(file_); }
+
+void socks_config::reload_on_sighup(const asio::any_io_executor& ex) {
+    /* forked workers start over, the pid tells them apart from the parent */
+    static std::atomic<pid_t> watching{0};
+
+    pid_t self = ::getpid();
+    if (watching.load(std::memory_order_relaxed) == self ||
+        watching.exchange(self) == self) {
+        return;
+    }
+
+    /* the master of relay_sighup() takes SIGHUP on its own thread */
+    if (relayed != nullptr && relayed->master == self) {
+        return;
+    }
+
+    asio::co_spawn(ex, watch_sighup(ex), asio::detached);
+}
+
+asio::awaitable<void> socks_config::watch_sighup(asio::any_io_executor ex) {
+    asio::signal_set signals(ex, SIGHUP);
+    asio::error_code ec;
+
+    /* asiomp workers inherit SIGHUP blocked, the handler is in place now */
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGHUP);
+    ::pthread_sigmask(SIG_UNBLOCK, &blocked, nullptr);
+
+    /* an asiomp worker arms late, its master may have reloaded meanwhile */
+    bool missed = relayed != nullptr &&
+                  relayed->sequence.load(std::memory_order_acquire) !=
+                      relayed_sequence;
+
+    for (;;) {
+        if (!missed) {
+            co_await signals.async_wait(
+                asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                co_return;
+            }
+        }
+        missed = false;
+
+        /* named, gcc 12 frees a lambda temporary of a co_await twice */
+        auto parse = [] { return reload(); };
+        bool reloaded = co_await offload_pool::get()->run(std::move(parse));
+
+        if (reloaded) {
+            SPDLOG_INFO("reloaded configuration from [{}]", file_);
+        } else {
+            SPDLOG_ERROR("failed to reload [{}], keeping the configuration",
+                         file_);
+        }
+    }
+}
+
+bool socks_config::relay_sighup() {
+    void* addr = ::mmap(nullptr, sizeof(relayed_config),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (addr == MAP_FAILED) {
+        SPDLOG_ERROR("failed to map the relayed configuration: {}",
+                     std::strerror(errno));
+        return false;
+    }
+
+    relayed = new (addr) relayed_config();
+    relayed->master = ::getpid();
+    publish(loaded_digest);
+
+    /* taken with sigwait() here, the workers unblock it when they watch */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    /* a worker never inherits the locks of a reload half done */
+    ::pthread_atfork([] { relaying.lock(); }, [] { relaying.unlock(); },
+                     [] { relaying.unlock(); });
+
+    /* never joined, it waits for SIGHUP until the master exits */
+    std::thread([] {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGHUP);
+
+        for (;;) {
+            int sig;
+            if (::sigwait(&signals, &sig) != 0) {
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(relaying);
+
+            if (!reload()) {
+                SPDLOG_ERROR("failed to reload [{}], keeping the configuration",
+                             file_);
+                continue;
+            }
+
+            SPDLOG_INFO("reloaded configuration from [{}]", file_);
+            forward_sighup();
+        }
+    }).detach();
+
+    return true;
 }
 
 socks_config::socks_config()
@@ -12,14 +286,44 @@ socks_config::socks_config()
       port_(1080),
       worker_process_num_(std::thread::hardware_concurrency()),
       daemon_(true),
+      worker_threads_(0),
+      reuseport_(false),
+      incoming_cpu_(false),
+      metrics_address_("127.0.0.1"),
+      metrics_port_(0),
+      access_log_buffer_(2048),
       keep_alive_time_(30),
       check_duration_(1),
-      auth_(false) {}
+      auth_(false),
+      splice_(false),
+      io_uring_(false),
+      dns_cache_size_(1024),
+      dns_cache_ttl_(60),
+      dns_negative_ttl_(5),
+      connection_attempt_delay_(250),
+      optimistic_connect_(false),
+      tcp_fast_open_(false),
+      fast_open_wait_(10),
+      udp_batch_size_(32),
+      udp_offload_(false),
+      udp_max_flows_(64),
+      udp_flow_timeout_(60),
+      session_rate_limit_(0),
+      user_rate_limit_(0),
+      worker_rate_limit_(0),
+      rate_limit_burst_(100),
+      max_sessions_(0),
+      max_handshakes_(0),
+      max_derivations_(8),
+      max_loop_lag_(0),
+      overload_recovery_(80),
+      overload_action_(overload::reject) {}
 
-bool socks_config::parse(const std::string& file) {
+bool socks_config::parse(const std::string& file,
+                         const std::string& content) {
     YAML::Node root;
     try {
-        root = YAML::LoadFile(file);
+        root = YAML::Load(content);
 
         if (!root["server"].IsDefined()) {
             return true;
@@ -46,6 +350,42 @@ bool socks_config::parse(const std::string& file) {
             this->daemon_ = nodeServer["daemon"].as<bool>();
         }
 
+        if (nodeServer["worker_threads"].IsDefined()) {
+            this->worker_threads_ =
+                nodeServer["worker_threads"].as<uint32_t>();
+        }
+
+        if (nodeServer["reuseport"].IsDefined()) {
+            this->reuseport_ = nodeServer["reuseport"].as<bool>();
+        }
+
+        if (nodeServer["worker_cpus"].IsDefined()) {
+            this->worker_cpus_ =
+                nodeServer["worker_cpus"].as<std::vector<int>>();
+        }
+
+        if (nodeServer["incoming_cpu"].IsDefined()) {
+            this->incoming_cpu_ = nodeServer["incoming_cpu"].as<bool>();
+        }
+
+        if (nodeServer["metrics_address"].IsDefined()) {
+            this->metrics_address_ =
+                nodeServer["metrics_address"].as<std::string>();
+        }
+
+        if (nodeServer["metrics_port"].IsDefined()) {
+            this->metrics_port_ = nodeServer["metrics_port"].as<uint16_t>();
+        }
+
+        if (nodeServer["access_log"].IsDefined()) {
+            this->access_log_ = nodeServer["access_log"].as<std::string>();
+        }
+
+        if (nodeServer["access_log_buffer"].IsDefined()) {
+            this->access_log_buffer_ = std::clamp<uint32_t>(
+                nodeServer["access_log_buffer"].as<uint32_t>(), 16, 1048576);
+        }
+
         if (!nodeServer["protocol"].IsDefined()) {
             return true;
         }
@@ -66,9 +406,146 @@ bool socks_config::parse(const std::string& file) {
             this->auth_ = nodeProtocol["auth"].as<bool>();
         }
 
+        if (nodeProtocol["splice"].IsDefined()) {
+            this->splice_ = nodeProtocol["splice"].as<bool>();
+        }
+
+        if (nodeProtocol["io_uring"].IsDefined()) {
+            this->io_uring_ = nodeProtocol["io_uring"].as<bool>();
+        }
+
+        if (nodeProtocol["dns_cache_size"].IsDefined()) {
+            this->dns_cache_size_ =
+                nodeProtocol["dns_cache_size"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["dns_cache_ttl"].IsDefined()) {
+            this->dns_cache_ttl_ = nodeProtocol["dns_cache_ttl"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["dns_negative_ttl"].IsDefined()) {
+            this->dns_negative_ttl_ =
+                nodeProtocol["dns_negative_ttl"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["connection_attempt_delay"].IsDefined()) {
+            this->connection_attempt_delay_ =
+                nodeProtocol["connection_attempt_delay"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["optimistic_connect"].IsDefined()) {
+            this->optimistic_connect_ =
+                nodeProtocol["optimistic_connect"].as<bool>();
+        }
+
+        if (nodeProtocol["tcp_fast_open"].IsDefined()) {
+            this->tcp_fast_open_ = nodeProtocol["tcp_fast_open"].as<bool>();
+        }
+
+        if (nodeProtocol["fast_open_wait"].IsDefined()) {
+            this->fast_open_wait_ =
+                nodeProtocol["fast_open_wait"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["udp_batch_size"].IsDefined()) {
+            this->udp_batch_size_ = std::clamp<uint32_t>(
+                nodeProtocol["udp_batch_size"].as<uint32_t>(), 1, 1024);
+        }
+
+        if (nodeProtocol["udp_offload"].IsDefined()) {
+            this->udp_offload_ = nodeProtocol["udp_offload"].as<bool>();
+        }
+
+        if (nodeProtocol["udp_max_flows"].IsDefined()) {
+            this->udp_max_flows_ = std::clamp<uint32_t>(
+                nodeProtocol["udp_max_flows"].as<uint32_t>(), 1, 65536);
+        }
+
+        if (nodeProtocol["udp_flow_timeout"].IsDefined()) {
+            this->udp_flow_timeout_ =
+                nodeProtocol["udp_flow_timeout"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["session_rate_limit"].IsDefined()) {
+            this->session_rate_limit_ =
+                nodeProtocol["session_rate_limit"].as<uint64_t>();
+        }
+
+        if (nodeProtocol["user_rate_limit"].IsDefined()) {
+            this->user_rate_limit_ =
+                nodeProtocol["user_rate_limit"].as<uint64_t>();
+        }
+
+        if (nodeProtocol["worker_rate_limit"].IsDefined()) {
+            this->worker_rate_limit_ =
+                nodeProtocol["worker_rate_limit"].as<uint64_t>();
+        }
+
+        if (nodeProtocol["rate_limit_burst"].IsDefined()) {
+            this->rate_limit_burst_ = std::max<uint32_t>(
+                nodeProtocol["rate_limit_burst"].as<uint32_t>(), 1);
+        }
+
+        if (nodeProtocol["max_sessions"].IsDefined()) {
+            this->max_sessions_ = nodeProtocol["max_sessions"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["max_handshakes"].IsDefined()) {
+            this->max_handshakes_ =
+                nodeProtocol["max_handshakes"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["max_derivations"].IsDefined()) {
+            this->max_derivations_ = std::max<uint32_t>(
+                nodeProtocol["max_derivations"].as<uint32_t>(), 1);
+        }
+
+        if (nodeProtocol["max_loop_lag"].IsDefined()) {
+            this->max_loop_lag_ = nodeProtocol["max_loop_lag"].as<uint32_t>();
+        }
+
+        if (nodeProtocol["overload_recovery"].IsDefined()) {
+            this->overload_recovery_ = std::clamp<uint32_t>(
+                nodeProtocol["overload_recovery"].as<uint32_t>(), 1, 100);
+        }
+
+        if (nodeProtocol["overload_action"].IsDefined()) {
+            auto action = nodeProtocol["overload_action"].as<std::string>();
+
+            if (action == "reject") {
+                this->overload_action_ = overload::reject;
+            } else if (action == "pause") {
+                this->overload_action_ = overload::pause;
+            } else {
+                throw std::runtime_error("Unknown overload_action " + action);
+            }
+        }
+
+        if (nodeProtocol["auth_cache_size"].IsDefined()) {
+            this->credentials_.set_cache_size(
+                nodeProtocol["auth_cache_size"].as<uint32_t>());
+        }
+
         if (this->auth_ && nodeProtocol["credentials"].IsDefined()) {
             for (const auto& credential : nodeProtocol["credentials"]) {
                 auto username = credential["username"].as<std::string>();
+
+                if (credential["rate_limit"].IsDefined()) {
+                    this->user_rate_limits_[username] =
+                        credential["rate_limit"].as<uint64_t>();
+                }
+
+                if (credential["password_hash"].IsDefined()) {
+                    if (username.empty() ||
+                        !this->credentials_.add_hashed(
+                            username,
+                            credential["password_hash"].as<std::string>())) {
+                        throw std::runtime_error(
+                            "Malformed password hash for " + username);
+                    }
+                    continue;
+                }
+
                 auto password = credential["password"].as<std::string>();
 
                 if (username.empty() || password.empty()) {
@@ -76,9 +553,69 @@ bool socks_config::parse(const std::string& file) {
                         "The username and password cannot be empty");
                 }
 
-                this->credentials_[username] = password;
+                this->credentials_.add(username, password);
+            }
+        }
+
+        if (this->auth_ && nodeProtocol["credentials_file"].IsDefined()) {
+            this->credentials_.load(
+                nodeProtocol["credentials_file"].as<std::string>());
+        }
+
+        if (nodeProtocol["upstreams"].IsDefined()) {
+            for (const auto& node : nodeProtocol["upstreams"]) {
+                upstream_config upstream;
+
+                upstream.name = node["name"].IsDefined()
+                                    ? node["name"].as<std::string>()
+                                    : std::string();
+                upstream.address = node["address"].as<std::string>();
+                upstream.port = node["port"].as<uint16_t>();
+                if (node["username"].IsDefined()) {
+                    upstream.username = node["username"].as<std::string>();
+                    upstream.password = node["password"].as<std::string>();
+                }
+                upstream.pool_size = node["pool_size"].IsDefined()
+                                         ? node["pool_size"].as<uint32_t>()
+                                         : 4;
+
+                if (upstream.username.size() > 255 ||
+                    upstream.password.size() > 255) {
+                    throw std::runtime_error(
+                        "The upstream username and password are limited to "
+                        "255 bytes");
+                }
+
+                this->upstreams_.push_back(std::move(upstream));
+            }
+        }
+
+        if (nodeProtocol["upstream_routes"].IsDefined()) {
+            for (const auto& node : nodeProtocol["upstream_routes"]) {
+                auto pattern = node["pattern"].as<std::string>();
+                auto name = node["upstream"].as<std::string>();
+                int index = -1;
+
+                if (name != "direct") {
+                    auto it = std::find_if(
+                        this->upstreams_.begin(), this->upstreams_.end(),
+                        [&](const upstream_config& u) {
+                            return u.name == name;
+                        });
+                    if (it == this->upstreams_.end()) {
+                        throw std::runtime_error("Unknown upstream " + name);
+                    }
+                    index = static_cast<int>(it - this->upstreams_.begin());
+                }
+
+                this->upstream_routes_.emplace_back(std::move(pattern), index);
             }
         }
+
+        if (this->upstream_routes_.empty() && !this->upstreams_.empty()) {
+            /* without routes everything goes through the first upstream */
+            this->upstream_routes_.emplace_back("*", 0);
+        }
     } catch (const std::exception& e) {
         std::printf("failed to parse config file: [%s], error info: [%s]\n",
                     file.c_str(), e.what());
@@ -88,15 +625,56 @@ bool socks_config::parse(const std::string& file) {
     return true;
 }
 
-bool socks_config::check_auth(const std::string& username,
-                              const std::string& password) {
+bool socks_config::check_auth(std::string_view username,
+                              std::string_view password) const {
     if (this->auth_) {
-        if (this->credentials_.count(username) &&
-            this->credentials_[username] == password) {
-            return true;
-        }
-        return false;
+        return this->credentials_.verify(username, password);
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+uint64_t socks_config::user_rate_limit(std::string_view username) const {
+    if (!this->user_rate_limits_.empty()) {
+        auto it = this->user_rate_limits_.find(std::string(username));
+        if (it != this->user_rate_limits_.end()) {
+            return it->second;
+        }
+    }
+
+    return this->user_rate_limit_;
+}
+
+int socks_config::route(std::string_view host) const {
+    auto equal = [](std::string_view a, std::string_view b) {
+        return a.size() == b.size() &&
+               std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+                   return std::tolower(static_cast<unsigned char>(x)) ==
+                          std::tolower(static_cast<unsigned char>(y));
+               });
+    };
+
+    for (const auto& [pattern, index] : this->upstream_routes_) {
+        std::string_view p = pattern;
+
+        /* "*" is any host, "*.example.com" any name below example.com */
+        if (p == "*") {
+            return index;
+        }
+
+        if (p.size() > 2 && p.substr(0, 2) == "*.") {
+            std::string_view suffix = p.substr(1);
+            if (host.size() > suffix.size() &&
+                equal(host.substr(host.size() - suffix.size()), suffix)) {
+                return index;
+            }
+            continue;
+        }
+
+        if (equal(p, host)) {
+            return index;
+        }
+    }
+
+    return -1;
+}
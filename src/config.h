@@ -1,15 +1,75 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "credential_store.h"
 #include "public.h"
 
+/* an upstream SOCKS5 proxy CONNECT requests can be relayed through */
+struct upstream_config {
+    std::string name;
+    std::string address;
+    uint16_t port;
+    std::string username;
+    std::string password;
+    /* connections each worker keeps past negotiation and authentication */
+    uint32_t pool_size;
+};
+
+/*
+ * The configuration is an immutable snapshot. load() parses a file into a
+ * new one and publishes it with an atomic pointer swap and a generation
+ * bump, so a reload on SIGHUP never changes a snapshot anyone is reading.
+ * Sessions hold the snapshot they started with for their whole life, other
+ * readers go through get(), which costs one atomic load of the generation
+ * while nothing changes. Settings that shape per-worker state built once,
+ * such as the server section, check_duration and the DNS cache, still need
+ * a restart.
+ */
 class socks_config {
 
 public:
-    static socks_config* get();
+    /* what an overloaded worker does with new clients */
+    enum class overload {
+        reject,
+        pause,
+    };
+
+    /* this thread's view of the latest snapshot, for immediate use only */
+    static const socks_config* get();
+
+    /* the latest snapshot, to be held across suspension points */
+    static std::shared_ptr<const socks_config> snapshot();
+
+    /* parse and validate the file, publish it only when it is good */
+    static bool load(const std::string& file);
+
+    /* load the file of the last successful load() again, by absolute path */
+    static bool reload();
+
+    /*
+     * reload on SIGHUP while the executor runs, once per process, parsing
+     * on an offload_pool thread
+     */
+    static void reload_on_sighup(const asio::any_io_executor& ex);
+
+    /*
+     * for asiomp, which keeps the master loop, before it forks: this
+     * process becomes the master, it reloads on SIGHUP on a thread of its
+     * own and passes a good reload on to its workers, which take the file
+     * only when it is the one the master checked
+     */
+    static bool relay_sighup();
+
+    ~socks_config() = default;
 
-    bool parse(const std::string& file);
+    bool check_auth(std::string_view username, std::string_view password) const;
 
-    bool check_auth(const std::string& username, const std::string& password);
+    inline const credential_store& credentials() const {
+        return this->credentials_;
+    }
 
     inline std::string address() const { return this->address_; }
 
@@ -19,16 +79,109 @@ public:
 
     inline bool daemon() const { return daemon_; }
 
+    inline uint32_t worker_threads() const { return this->worker_threads_; }
+
+    inline bool reuseport() const { return this->reuseport_; }
+
+    inline std::vector<int> worker_cpus() const { return this->worker_cpus_; }
+
+    inline bool incoming_cpu() const { return this->incoming_cpu_; }
+
+    inline std::string metrics_address() const {
+        return this->metrics_address_;
+    }
+
+    inline uint16_t metrics_port() const { return this->metrics_port_; }
+
+    /* empty when there is no access log */
+    inline const std::string& access_log() const { return this->access_log_; }
+
+    /* records per worker ring */
+    inline uint32_t access_log_buffer() const {
+        return this->access_log_buffer_;
+    }
+
     inline uint32_t keep_alive_time() const { return this->keep_alive_time_; }
 
     inline uint32_t check_duration() const { return this->check_duration_; }
 
     inline bool auth() const { return this->auth_; }
 
+    inline bool splice() const { return this->splice_; }
+
+    inline bool io_uring() const { return this->io_uring_; }
+
+    inline uint32_t dns_cache_size() const { return this->dns_cache_size_; }
+
+    inline uint32_t dns_cache_ttl() const { return this->dns_cache_ttl_; }
+
+    inline uint32_t dns_negative_ttl() const { return this->dns_negative_ttl_; }
+
+    inline uint32_t connection_attempt_delay() const {
+        return this->connection_attempt_delay_;
+    }
+
+    inline bool optimistic_connect() const {
+        return this->optimistic_connect_;
+    }
+
+    inline bool tcp_fast_open() const { return this->tcp_fast_open_; }
+
+    inline uint32_t fast_open_wait() const { return this->fast_open_wait_; }
+
+    inline uint32_t udp_batch_size() const { return this->udp_batch_size_; }
+
+    inline bool udp_offload() const { return this->udp_offload_; }
+
+    inline uint32_t udp_max_flows() const { return this->udp_max_flows_; }
+
+    inline uint32_t udp_flow_timeout() const { return this->udp_flow_timeout_; }
+
+    /* bytes per second, both directions together, 0 for no limit */
+    inline uint64_t session_rate_limit() const {
+        return this->session_rate_limit_;
+    }
+
+    inline uint64_t worker_rate_limit() const {
+        return this->worker_rate_limit_;
+    }
+
+    /* the user's own limit when the credentials give one */
+    uint64_t user_rate_limit(std::string_view username) const;
+
+    inline uint32_t rate_limit_burst() const { return this->rate_limit_burst_; }
+
+    /* per worker, 0 for no cap */
+    inline uint32_t max_sessions() const { return this->max_sessions_; }
+
+    inline uint32_t max_handshakes() const { return this->max_handshakes_; }
+
+    /* password derivations a worker hands off at once, never 0 */
+    inline uint32_t max_derivations() const { return this->max_derivations_; }
+
+    inline uint32_t max_loop_lag() const { return this->max_loop_lag_; }
+
+    inline uint32_t overload_recovery() const {
+        return this->overload_recovery_;
+    }
+
+    inline overload overload_action() const { return this->overload_action_; }
+
+    inline const std::vector<upstream_config>& upstreams() const {
+        return this->upstreams_;
+    }
+
+    /* index of the upstream to reach host through, -1 to connect directly */
+    int route(std::string_view host) const;
+
 private:
     socks_config();
 
-    ~socks_config() = default;
+    bool parse(const std::string& file, const std::string& content);
+
+    static const std::shared_ptr<const socks_config>& cached();
+
+    static asio::awaitable<void> watch_sighup(asio::any_io_executor ex);
 
     socks_config(const socks_config&) = delete;
 
@@ -39,12 +192,51 @@ private:
     socks_config& operator=(socks_config&&) = delete;
 
 private:
+    static std::atomic<std::shared_ptr<const socks_config>> current_;
+    static std::atomic<uint64_t> generation_;
+    static std::string file_;
+
     std::string address_;
     uint16_t port_;
     uint32_t worker_process_num_;
     bool daemon_;
+    uint32_t worker_threads_;
+    bool reuseport_;
+    std::vector<int> worker_cpus_;
+    bool incoming_cpu_;
+    std::string metrics_address_;
+    uint16_t metrics_port_;
+    std::string access_log_;
+    uint32_t access_log_buffer_;
     uint32_t keep_alive_time_;
     uint32_t check_duration_;
     bool auth_;
-    std::unordered_map<std::string, std::string> credentials_;
+    bool splice_;
+    bool io_uring_;
+    uint32_t dns_cache_size_;
+    uint32_t dns_cache_ttl_;
+    uint32_t dns_negative_ttl_;
+    uint32_t connection_attempt_delay_;
+    bool optimistic_connect_;
+    bool tcp_fast_open_;
+    uint32_t fast_open_wait_;
+    uint32_t udp_batch_size_;
+    bool udp_offload_;
+    uint32_t udp_max_flows_;
+    uint32_t udp_flow_timeout_;
+    uint64_t session_rate_limit_;
+    uint64_t user_rate_limit_;
+    uint64_t worker_rate_limit_;
+    uint32_t rate_limit_burst_;
+    std::unordered_map<std::string, uint64_t> user_rate_limits_;
+    uint32_t max_sessions_;
+    uint32_t max_handshakes_;
+    uint32_t max_derivations_;
+    uint32_t max_loop_lag_;
+    uint32_t overload_recovery_;
+    overload overload_action_;
+    credential_store credentials_;
+    std::vector<upstream_config> upstreams_;
+    /* host pattern and upstream index, -1 for direct */
+    std::vector<std::pair<std::string, int>> upstream_routes_;
 };
\ No newline at end of file
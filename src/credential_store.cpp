@@ -0,0 +1,311 @@
+#include "credential_store.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "metrics.h"
+
+namespace {
+
+std::string random_bytes(std::size_t n) {
+    std::random_device rd;
+    std::string bytes(n, '\0');
+
+    for (auto& b : bytes) {
+        b = static_cast<char>(rd());
+    }
+
+    return bytes;
+}
+
+int ab64_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '.' || c == '+') {
+        return 62;
+    }
+    return c == '/' ? 63 : -1;
+}
+
+/* passlib's base64, '.' instead of '+' and no padding */
+bool ab64_decode(std::string_view in, std::string& out) {
+    uint32_t bits = 0;
+    int bit_num = 0;
+
+    out.clear();
+    for (char c : in) {
+        int v = ab64_value(c);
+        if (v < 0) {
+            return false;
+        }
+
+        bits = (bits << 6) | static_cast<uint32_t>(v);
+        bit_num += 6;
+
+        if (bit_num >= 8) {
+            bit_num -= 8;
+            out.push_back(static_cast<char>((bits >> bit_num) & 0xFF));
+        }
+    }
+
+    return true;
+}
+
+/* numbers the stores of a process, a reload builds a newer one */
+std::atomic<uint64_t> stores{0};
+
+}    // namespace
+
+credential_store::credential_store()
+    : dummy_{random_bytes(16), default_iterations, {}},
+      cache_key_(random_bytes(32)),
+      cache_size_(1024),
+      id_(stores.fetch_add(1, std::memory_order_relaxed) + 1) {}
+
+void credential_store::add(const std::string& username,
+                           std::string_view password) {
+    this->credentials_.insert_or_assign(username,
+                                        derived(username, password));
+}
+
+bool credential_store::add_hashed(const std::string& username,
+                                  std::string_view encoded) {
+    credential c;
+
+    if (!decode(encoded, c)) {
+        return false;
+    }
+
+    this->credentials_.insert_or_assign(username, std::move(c));
+    return true;
+}
+
+void credential_store::load(const std::string& file) {
+    std::ifstream in(file);
+    if (!in) {
+        throw std::runtime_error("Cannot open credentials file " + file);
+    }
+
+    /* one read and one pass, the lines are only viewed */
+    std::stringstream content;
+    content << in.rdbuf();
+    const std::string text = content.str();
+
+    std::string_view rest = text;
+    std::size_t line_num = 0;
+
+    this->credentials_.reserve(this->credentials_.size() +
+                               std::count(text.begin(), text.end(), '\n') + 1);
+
+    while (!rest.empty()) {
+        std::size_t end = rest.find('\n');
+        std::string_view line = rest.substr(0, end);
+
+        rest = end == std::string_view::npos ? std::string_view()
+                                             : rest.substr(end + 1);
+        line_num++;
+
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        if (line.empty() || line.front() == '#') {
+            continue;
+        }
+
+        std::size_t colon = line.find(':');
+        if (colon == 0 || colon == std::string_view::npos ||
+            !this->add_hashed(std::string(line.substr(0, colon)),
+                              line.substr(colon + 1))) {
+            throw std::runtime_error("Malformed credential at " + file + ":" +
+                                     std::to_string(line_num));
+        }
+    }
+}
+
+bool credential_store::verify(std::string_view username,
+                              std::string_view password) const {
+    if (this->remembered(username, password)) {
+        return true;
+    }
+
+    if (!this->derive(username, password)) {
+        return false;
+    }
+
+    this->remember(username, password);
+    return true;
+}
+
+bool credential_store::remembered(std::string_view username,
+                                  std::string_view password) const {
+    auto it = this->credentials_.find(username);
+    std::vector<coro_socks::sha256::digest>& slots = this->cache();
+
+    if (it == this->credentials_.end() || slots.empty()) {
+        return false;
+    }
+
+    coro_socks::sha256::digest digest =
+        this->cache_digest(username, password, it->second);
+    std::size_t slot = std::hash<std::string_view>{}(username) % slots.size();
+
+    if (coro_socks::constant_time_equal(slots[slot].data(), digest.data(),
+                                        digest.size())) {
+        socks_metrics::get()->add(socks_metrics::counter::auth_cache_hits);
+        return true;
+    }
+
+    socks_metrics::get()->add(socks_metrics::counter::auth_cache_misses);
+    return false;
+}
+
+bool credential_store::derive(std::string_view username,
+                              std::string_view password) const {
+    auto it = this->credentials_.find(username);
+    bool known = it != this->credentials_.end();
+    const credential& c = known ? it->second : this->dummy_;
+
+    coro_socks::sha256::digest derived;
+    coro_socks::pbkdf2_sha256(password, c.salt, c.iterations, derived.data(),
+                              derived.size());
+
+    return coro_socks::constant_time_equal(derived.data(), c.checksum.data(),
+                                           c.checksum.size()) &&
+           known;
+}
+
+void credential_store::remember(std::string_view username,
+                                std::string_view password) const {
+    auto it = this->credentials_.find(username);
+    std::vector<coro_socks::sha256::digest>& slots = this->cache();
+
+    if (it == this->credentials_.end() || slots.empty()) {
+        return;
+    }
+
+    std::size_t slot = std::hash<std::string_view>{}(username) % slots.size();
+    slots[slot] = this->cache_digest(username, password, it->second);
+}
+
+credential_store::credential credential_store::derived(
+    const std::string& username, std::string_view password) {
+    /* never torn down, a reload may still run on an offload thread at exit */
+    static std::mutex* mutex = new std::mutex();
+    static auto* entries = new std::unordered_map<std::string, credential>();
+    static const std::string key = random_bytes(32);
+
+    coro_socks::sha256 h;
+    uint8_t separator = 0;
+
+    h.update(key);
+    h.update(username);
+    h.update(&separator, 1);
+    h.update(password);
+
+    coro_socks::sha256::digest digest = h.final();
+    std::string id(reinterpret_cast<const char*>(digest.data()),
+                   digest.size());
+
+    {
+        std::lock_guard<std::mutex> lock(*mutex);
+
+        auto it = entries->find(id);
+        if (it != entries->end()) {
+            return it->second;
+        }
+    }
+
+    credential c{random_bytes(16), default_iterations, {}};
+    coro_socks::pbkdf2_sha256(password, c.salt, c.iterations,
+                              c.checksum.data(), c.checksum.size());
+
+    std::lock_guard<std::mutex> lock(*mutex);
+
+    /* plenty for any config file, and a bound however often it changes */
+    if (entries->size() >= max_derived) {
+        entries->clear();
+    }
+    entries->insert_or_assign(std::move(id), c);
+
+    return c;
+}
+
+bool credential_store::decode(std::string_view encoded, credential& c) {
+    static constexpr std::string_view prefix = "$pbkdf2-sha256$";
+
+    if (encoded.substr(0, prefix.size()) != prefix) {
+        return false;
+    }
+    encoded.remove_prefix(prefix.size());
+
+    std::size_t first = encoded.find('$');
+    std::size_t second = encoded.find('$', first + 1);
+    if (first == 0 || second == std::string_view::npos) {
+        return false;
+    }
+
+    c.iterations = 0;
+    for (char d : encoded.substr(0, first)) {
+        if (d < '0' || d > '9' || c.iterations > UINT32_MAX / 10 - 1) {
+            return false;
+        }
+        c.iterations = c.iterations * 10 + (d - '0');
+    }
+
+    std::string checksum;
+    if (c.iterations == 0 ||
+        !ab64_decode(encoded.substr(first + 1, second - first - 1), c.salt) ||
+        !ab64_decode(encoded.substr(second + 1), checksum) ||
+        checksum.size() != c.checksum.size()) {
+        return false;
+    }
+
+    std::copy(checksum.begin(), checksum.end(), c.checksum.begin());
+    return true;
+}
+
+coro_socks::sha256::digest credential_store::cache_digest(
+    std::string_view username, std::string_view password,
+    const credential& c) const {
+    coro_socks::sha256 h;
+    uint8_t separator = 0;
+
+    h.update(this->cache_key_);
+    h.update(username);
+    h.update(&separator, 1);
+    h.update(password);
+    h.update(&separator, 1);
+    h.update(c.salt);
+    h.update(c.checksum.data(), c.checksum.size());
+
+    return h.final();
+}
+
+std::vector<coro_socks::sha256::digest>& credential_store::cache() const {
+    /* never torn down, sessions may outlive the thread locals at exit */
+    static thread_local auto* slots =
+        new std::vector<coro_socks::sha256::digest>();
+    static thread_local auto* unused =
+        new std::vector<coro_socks::sha256::digest>();
+    static thread_local uint64_t owner = 0;
+
+    /* a reloaded store starts over, sessions of older ones go without */
+    if (this->id_ > owner) {
+        owner = this->id_;
+        slots->assign(this->cache_size_, {});
+    }
+
+    return this->id_ == owner ? *slots : *unused;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "pbkdf2.h"
+
+/*
+ * Username/password credentials kept as salted PBKDF2-HMAC-SHA256 hashes.
+ * Entries come from the config file, where plain passwords are hashed when
+ * loaded, or from an htpasswd style file of "username:hash" lines holding
+ * hashes in the passlib format
+ *
+ *     $pbkdf2-sha256$<iterations>$<salt>$<checksum>
+ *
+ * so a large file loads without deriving anything. A plain password is
+ * hashed once per process and reloads reuse the hash while it stays the
+ * same. Deriving is what makes guessing expensive and it is as expensive
+ * for every handshake, so each worker remembers recently verified
+ * passwords in a small direct mapped cache of keyed digests and a
+ * reconnecting client skips the derivation. Sessions check the cache on
+ * their worker and leave the derivation to an offload_pool thread.
+ */
+class credential_store {
+public:
+    /* rounds used to hash the plain passwords of the config file */
+    static constexpr uint32_t default_iterations = 29000;
+
+    /* plain passwords whose hashes a process keeps for reloads */
+    static constexpr std::size_t max_derived = 4096;
+
+    credential_store();
+
+    /*
+     * verified passwords each worker remembers, 0 disables the cache, a
+     * reload resizes it
+     */
+    inline void set_cache_size(std::size_t size) { this->cache_size_ = size; }
+
+    void add(const std::string& username, std::string_view password);
+
+    /* false when the hash is not in the format above */
+    bool add_hashed(const std::string& username, std::string_view encoded);
+
+    /* throws on a malformed line, naming it */
+    void load(const std::string& file);
+
+    /* remembered() or else derive(), all on the calling thread */
+    bool verify(std::string_view username, std::string_view password) const;
+
+    /* the calling worker verified the password before */
+    bool remembered(std::string_view username,
+                    std::string_view password) const;
+
+    /* the full derivation, safe on any thread */
+    bool derive(std::string_view username, std::string_view password) const;
+
+    /* lets the calling worker skip the derivation next time */
+    void remember(std::string_view username, std::string_view password) const;
+
+    inline std::size_t size() const { return this->credentials_.size(); }
+
+private:
+    struct credential {
+        std::string salt;
+        uint32_t iterations;
+        coro_socks::sha256::digest checksum;
+    };
+
+    struct string_hash {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    /* the hash of a plain password, derived the first time only */
+    static credential derived(const std::string& username,
+                              std::string_view password);
+
+    static bool decode(std::string_view encoded, credential& c);
+
+    /* a keyed digest of the password and the credential it was checked on */
+    coro_socks::sha256::digest cache_digest(std::string_view username,
+                                            std::string_view password,
+                                            const credential& c) const;
+
+    std::vector<coro_socks::sha256::digest>& cache() const;
+
+private:
+    std::unordered_map<std::string, credential, string_hash, std::equal_to<>>
+        credentials_;
+    /* burned on unknown usernames so they take as long as wrong passwords */
+    credential dummy_;
+    std::string cache_key_;
+    std::size_t cache_size_;
+    /* the worker caches follow the newest store they have seen */
+    uint64_t id_;
+};
@@ -0,0 +1,241 @@
+#include "dns_cache.h"
+
+#include <algorithm>
+#include <cctype>
+
+#include "config.h"
+#include "metrics.h"
+
+dns_cache* dns_cache::get() {
+    static thread_local dns_cache cache;
+    return &cache;
+}
+
+void dns_cache::share_between_threads() {
+    if (shared_answers_ == nullptr) {
+        shared_answers_ = new std::array<rcu_snapshot<answer_map>, shard_num>();
+    }
+}
+
+dns_cache::dns_cache()
+    : capacity_(socks_config::get()->dns_cache_size()),
+      ttl_(socks_config::get()->dns_cache_ttl()),
+      negative_ttl_(socks_config::get()->dns_negative_ttl()),
+      stats_{} {}
+
+asio::awaitable<dns_cache::addresses> dns_cache::resolve(
+    asio::any_io_executor ex, std::string_view name,
+    asio::error_code& ec) {
+    /* names are case insensitive, one spelling must not dodge the cache */
+    std::string host(name);
+    std::transform(host.begin(), host.end(), host.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+
+    std::shared_ptr<lookup> l;
+    auto now = std::chrono::steady_clock::now();
+
+    auto it = this->entries_.find(host);
+    if (it != this->entries_.end()) {
+        auto& e = it->second;
+
+        if (!e.pending->done) {
+            this->stats_.coalesced++;
+            socks_metrics::get()->add(socks_metrics::counter::dns_coalesced);
+            l = e.pending;
+        } else if (e.expiry > now) {
+            this->lru_.splice(this->lru_.begin(), this->lru_, e.lru);
+
+            if (e.pending->ec) {
+                this->stats_.negative_hits++;
+                socks_metrics::get()->add(
+                    socks_metrics::counter::dns_negative_hits);
+            } else {
+                this->stats_.hits++;
+                socks_metrics::get()->add(socks_metrics::counter::dns_hits);
+            }
+
+            ec = e.pending->ec;
+            co_return e.pending->result;
+        } else {
+            this->lru_.erase(e.lru);
+            this->entries_.erase(it);
+        }
+    }
+
+    /* another thread may have resolved it, keep its answer here too */
+    if (!l && shared_answers_ != nullptr && this->capacity_ > 0) {
+        auto answers = shared_shard(host).load();
+        auto found = answers->find(host);
+
+        if (found != answers->end() && found->second.expiry > now) {
+            const answer& a = found->second;
+
+            if (a.ec) {
+                this->stats_.negative_hits++;
+                socks_metrics::get()->add(
+                    socks_metrics::counter::dns_negative_hits);
+            } else {
+                this->stats_.hits++;
+                socks_metrics::get()->add(socks_metrics::counter::dns_hits);
+            }
+
+            auto adopted = std::make_shared<lookup>();
+            adopted->result = a.result;
+            adopted->ec = a.ec;
+            adopted->done = true;
+
+            this->lru_.emplace_front(host);
+            this->entries_.emplace(
+                this->lru_.front(),
+                entry{adopted, a.expiry, this->lru_.begin()});
+            this->evict();
+
+            ec = a.ec;
+            co_return a.result;
+        }
+    }
+
+    if (!l) {
+        this->stats_.misses++;
+        socks_metrics::get()->add(socks_metrics::counter::dns_misses);
+
+        l = std::make_shared<lookup>();
+
+        if (this->capacity_ > 0) {
+            this->lru_.emplace_front(host);
+            this->entries_.emplace(
+                this->lru_.front(),
+                entry{l, std::chrono::steady_clock::time_point::max(),
+                      this->lru_.begin()});
+            this->evict();
+        }
+
+        asio::co_spawn(ex, this->run_lookup(ex, host, l),
+                       asio::detached);
+    }
+
+    if (!l->done) {
+        asio::steady_timer timer(ex,
+                                 std::chrono::steady_clock::time_point::max());
+        asio::error_code ignored_ec;
+
+        l->waiters.push_back(&timer);
+        co_await timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ignored_ec));
+    }
+
+    ec = l->ec;
+    co_return l->result;
+}
+
+asio::awaitable<void> dns_cache::run_lookup(asio::any_io_executor ex,
+                                            std::string host,
+                                            std::shared_ptr<lookup> l) {
+    asio::error_code ec;
+    asio::ip::tcp::resolver resolver(ex);
+    auto start = std::chrono::steady_clock::now();
+
+    auto endpoints = co_await resolver.async_resolve(
+        host, "", asio::redirect_error(asio::use_awaitable, ec));
+
+    auto now = std::chrono::steady_clock::now();
+    uint64_t elapsed_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - start)
+            .count();
+
+    this->stats_.resolve_count++;
+    this->stats_.resolve_time_us += elapsed_us;
+    if (elapsed_us > this->stats_.resolve_max_us) {
+        this->stats_.resolve_max_us = elapsed_us;
+    }
+    socks_metrics::get()->observe(socks_metrics::histogram::dns_resolve,
+                                  now - start);
+
+    auto result = std::make_shared<std::vector<asio::ip::address>>();
+    if (!ec) {
+        for (auto&& endpoint : endpoints) {
+            result->push_back(endpoint.endpoint().address());
+        }
+
+        if (result->empty()) {
+            ec = asio::error::host_not_found;
+        }
+    }
+
+    if (ec) {
+        this->stats_.failures++;
+        socks_metrics::get()->add(socks_metrics::counter::dns_failures);
+    }
+
+    SPDLOG_DEBUG("resolved [{}] in {}us, {} addresses, error [{}]", host,
+                 elapsed_us, result->size(), ec.message());
+
+    l->result = std::move(result);
+    l->ec = ec;
+    l->done = true;
+
+    /* the entry may have been evicted while the lookup was in flight */
+    auto it = this->entries_.find(host);
+    if (it != this->entries_.end() && it->second.pending == l) {
+        it->second.expiry = now + (ec ? this->negative_ttl_ : this->ttl_);
+    }
+
+    if (shared_answers_ != nullptr && this->capacity_ > 0) {
+        this->publish(host, *l,
+                      now + (ec ? this->negative_ttl_ : this->ttl_));
+    }
+
+    for (auto* waiter : l->waiters) {
+        waiter->cancel();
+    }
+    l->waiters.clear();
+
+    co_return;
+}
+
+rcu_snapshot<dns_cache::answer_map>& dns_cache::shared_shard(
+    std::string_view host) {
+    return (*shared_answers_)[std::hash<std::string_view>{}(host) %
+                              shard_num];
+}
+
+void dns_cache::publish(const std::string& host, const lookup& l,
+                        std::chrono::steady_clock::time_point expiry) {
+    std::size_t shard_capacity =
+        std::max<std::size_t>(this->capacity_ / shard_num, 1);
+
+    shared_shard(host).update([&](answer_map& answers) {
+        answers.insert_or_assign(host, answer{l.result, l.ec, expiry});
+
+        /* make room by dropping the answer that expires first */
+        while (answers.size() > shard_capacity) {
+            answers.erase(std::min_element(
+                answers.begin(), answers.end(),
+                [](const auto& a, const auto& b) {
+                    return a.second.expiry < b.second.expiry;
+                }));
+        }
+    });
+}
+
+void dns_cache::evict() {
+    auto it = this->lru_.end();
+
+    while (this->entries_.size() > this->capacity_ &&
+           it != this->lru_.begin()) {
+        --it;
+
+        auto e = this->entries_.find(*it);
+
+        /* lookups still in flight are kept, their waiters need them */
+        if (!e->second.pending->done) {
+            continue;
+        }
+
+        this->entries_.erase(e);
+        it = this->lru_.erase(it);
+        this->stats_.evictions++;
+    }
+}
+
+dns_cache::stats dns_cache::get_stats() const { return this->stats_; }
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "asiomp.h"
+#include "rcu_snapshot.h"
+
+/*
+ * Per-worker resolver cache shared by the CONNECT and UDP ASSOCIATE paths.
+ * getaddrinfo does not report record TTLs, so positive and negative
+ * results live for the configured times. Concurrent lookups of the same
+ * name wait for the one resolution already in flight. When the workers
+ * are threads of one process, a name missing here is looked up in the
+ * answers all threads publish before it is resolved.
+ */
+class dns_cache {
+public:
+    using addresses = std::shared_ptr<const std::vector<asio::ip::address>>;
+
+    struct stats {
+        uint64_t hits;
+        uint64_t negative_hits;
+        uint64_t misses;
+        uint64_t coalesced;
+        uint64_t evictions;
+        uint64_t failures;
+        uint64_t resolve_count;
+        uint64_t resolve_time_us;
+        uint64_t resolve_max_us;
+    };
+
+    static dns_cache* get();
+
+    /* call before the worker threads start */
+    static void share_between_threads();
+
+    /* looks up the lowercased name, the key of the cache */
+    asio::awaitable<addresses> resolve(asio::any_io_executor ex,
+                                       std::string_view host,
+                                       asio::error_code& ec);
+
+    stats get_stats() const;
+
+private:
+    dns_cache();
+
+    dns_cache(const dns_cache&) = delete;
+
+    dns_cache& operator=(const dns_cache&) = delete;
+
+    struct lookup {
+        addresses result;
+        asio::error_code ec;
+        bool done = false;
+        std::vector<asio::steady_timer*> waiters;
+    };
+
+    struct entry {
+        std::shared_ptr<lookup> pending;
+        std::chrono::steady_clock::time_point expiry;
+        std::list<std::string>::iterator lru;
+    };
+
+    struct string_hash {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    struct answer {
+        addresses result;
+        asio::error_code ec;
+        std::chrono::steady_clock::time_point expiry;
+    };
+
+    using answer_map =
+        std::unordered_map<std::string, answer, string_hash, std::equal_to<>>;
+
+    /* sharded, so publishing an answer copies a small table */
+    static constexpr std::size_t shard_num = 64;
+
+    static rcu_snapshot<answer_map>& shared_shard(std::string_view host);
+
+    void publish(const std::string& host, const lookup& l,
+                 std::chrono::steady_clock::time_point expiry);
+
+    void evict();
+
+    asio::awaitable<void> run_lookup(asio::any_io_executor ex,
+                                     std::string host,
+                                     std::shared_ptr<lookup> l);
+
+private:
+    std::unordered_map<std::string, entry, string_hash, std::equal_to<>>
+        entries_;
+    std::list<std::string> lru_;
+    std::size_t capacity_;
+    std::chrono::seconds ttl_;
+    std::chrono::seconds negative_ttl_;
+    stats stats_;
+
+    static inline std::array<rcu_snapshot<answer_map>, shard_num>*
+        shared_answers_ = nullptr;
+};
@@ -0,0 +1,168 @@
+#include "happy_eyeballs.h"
+
+#include <limits>
+
+#include "config.h"
+
+namespace {
+
+constexpr std::size_t no_winner = std::numeric_limits<std::size_t>::max();
+
+}    // namespace
+
+struct happy_eyeballs::race {
+    explicit race(const asio::any_io_executor& executor)
+        : signal(executor), winner(no_winner), failed(0), done(false),
+          cancelled(false) {}
+
+    /* cancelled whenever an attempt completes to wake the connector */
+    asio::steady_timer signal;
+    std::vector<asio::ip::tcp::socket> sockets;
+    std::size_t winner;
+    std::size_t failed;
+    bool done;
+    bool cancelled;
+    asio::error_code last_ec;
+};
+
+happy_eyeballs::happy_eyeballs(const asio::any_io_executor& executor)
+    : executor_(executor),
+      attempt_delay_(socks_config::get()->connection_attempt_delay()) {}
+
+happy_eyeballs::~happy_eyeballs() { this->cancel(); }
+
+void happy_eyeballs::cancel() {
+    if (!this->race_) {
+        return;
+    }
+
+    asio::error_code ignored_ec;
+
+    this->race_->done = true;
+    this->race_->cancelled = true;
+    for (auto &&socket : this->race_->sockets) {
+        socket.close(ignored_ec);
+    }
+    this->race_->signal.cancel();
+}
+
+std::vector<asio::ip::address> happy_eyeballs::interleave(
+    const std::vector<asio::ip::address> &addresses) {
+    std::vector<asio::ip::address> preferred, other;
+
+    /* the resolver already sorted by RFC 6724, keep its first family first */
+    for (auto &&address : addresses) {
+        if (address.is_v6() == addresses.front().is_v6()) {
+            preferred.emplace_back(address);
+        } else {
+            other.emplace_back(address);
+        }
+    }
+
+    std::vector<asio::ip::address> order;
+    order.reserve(addresses.size());
+
+    for (std::size_t i = 0; i < preferred.size() || i < other.size(); ++i) {
+        if (i < preferred.size()) {
+            order.emplace_back(preferred[i]);
+        }
+        if (i < other.size()) {
+            order.emplace_back(other[i]);
+        }
+    }
+
+    return order;
+}
+
+asio::awaitable<void> happy_eyeballs::attempt(
+    std::shared_ptr<race> state, std::size_t index,
+    asio::ip::tcp::endpoint endpoint) {
+    asio::error_code ec;
+
+    co_await state->sockets[index].async_connect(
+        endpoint, asio::redirect_error(asio::use_awaitable, ec));
+
+    if (!ec && !state->done) {
+        state->winner = index;
+        state->done = true;
+    } else {
+        state->failed++;
+        if (ec && ec != asio::error::operation_aborted) {
+            state->last_ec = ec;
+        }
+    }
+
+    state->signal.cancel();
+}
+
+asio::awaitable<void> happy_eyeballs::async_connect(
+    asio::ip::tcp::socket &socket,
+    const std::vector<asio::ip::address> &addresses, uint16_t port,
+    asio::error_code &ec) {
+    if (addresses.empty()) {
+        ec = asio::error::host_not_found;
+        co_return;
+    }
+
+    auto order = interleave(addresses);
+    auto state = std::make_shared<race>(this->executor_);
+    asio::error_code wait_ec;
+    std::size_t seen_failed = 0;
+
+    /* sockets must not move while their connects are pending */
+    state->sockets.reserve(order.size());
+    this->race_ = state;
+
+    for (std::size_t i = 0; i < order.size() && !state->done; ++i) {
+        state->sockets.emplace_back(this->executor_);
+
+        asio::co_spawn(
+            this->executor_,
+            attempt(state, i, asio::ip::tcp::endpoint(order[i], port)),
+            asio::detached);
+
+        if (i + 1 == order.size()) {
+            break;
+        }
+
+        /* every failure lets the next attempt start without delay */
+        if (state->failed > seen_failed) {
+            seen_failed++;
+            continue;
+        }
+
+        state->signal.expires_after(this->attempt_delay_);
+        co_await state->signal.async_wait(
+            asio::redirect_error(asio::use_awaitable, wait_ec));
+
+        if (state->failed > seen_failed) {
+            seen_failed++;
+        }
+    }
+
+    while (!state->done && state->failed < state->sockets.size()) {
+        state->signal.expires_at(std::chrono::steady_clock::time_point::max());
+        co_await state->signal.async_wait(
+            asio::redirect_error(asio::use_awaitable, wait_ec));
+    }
+
+    this->race_.reset();
+
+    asio::error_code ignored_ec;
+
+    for (std::size_t i = 0; i < state->sockets.size(); ++i) {
+        if (i != state->winner) {
+            state->sockets[i].close(ignored_ec);
+        }
+    }
+
+    if (state->cancelled) {
+        ec = asio::error::operation_aborted;
+    } else if (state->winner != no_winner) {
+        socket = std::move(state->sockets[state->winner]);
+        ec.clear();
+    } else {
+        ec = state->last_ec ? state->last_ec
+                            : asio::error_code(asio::error::connection_refused);
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "asiomp.h"
+
+/*
+ * Happy Eyeballs v2 (RFC 8305) connector. The resolved addresses are
+ * interleaved by family and attempted concurrently, each one started a
+ * connection attempt delay after the previous one or as soon as an
+ * earlier attempt fails. The first socket to connect wins and the other
+ * attempts are closed.
+ */
+class happy_eyeballs {
+public:
+    explicit happy_eyeballs(const asio::any_io_executor& executor);
+
+    ~happy_eyeballs();
+
+    happy_eyeballs(const happy_eyeballs&) = delete;
+
+    happy_eyeballs& operator=(const happy_eyeballs&) = delete;
+
+    asio::awaitable<void> async_connect(
+        asio::ip::tcp::socket& socket,
+        const std::vector<asio::ip::address>& addresses, uint16_t port,
+        asio::error_code& ec);
+
+    /* abort the race in progress, async_connect fails with operation_aborted */
+    void cancel();
+
+private:
+    struct race;
+
+    static std::vector<asio::ip::address> interleave(
+        const std::vector<asio::ip::address>& addresses);
+
+    static asio::awaitable<void> attempt(std::shared_ptr<race> state,
+                                         std::size_t index,
+                                         asio::ip::tcp::endpoint endpoint);
+
+private:
+    asio::any_io_executor executor_;
+    std::chrono::milliseconds attempt_delay_;
+    std::shared_ptr<race> race_;
+};
@@ -0,0 +1,437 @@
+#include "metrics.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include "asiomp.h"
+
+namespace {
+
+struct descriptor {
+    const char* name;
+    const char* help;
+    const char* labels;
+};
+
+const descriptor counter_descriptors[] = {
+    {"coro_socks_sessions_accepted_total",
+     "Client connections accepted.", nullptr},
+    {"coro_socks_sessions_shed_total",
+     "Client connections turned away by an overloaded worker.", nullptr},
+    {"coro_socks_handshakes_total",
+     "Method negotiations by selected method.", "method=\"no_auth\""},
+    {"coro_socks_handshakes_total", nullptr, "method=\"user_passwd\""},
+    {"coro_socks_handshakes_total", nullptr, "method=\"no_acceptable\""},
+    {"coro_socks_auth_failures_total",
+     "Rejected username/password authentications.", nullptr},
+    {"coro_socks_auth_cache_lookups_total",
+     "Password checks by whether a worker had verified them before.",
+     "result=\"hit\""},
+    {"coro_socks_auth_cache_lookups_total", nullptr, "result=\"miss\""},
+    {"coro_socks_auth_unchecked_total",
+     "Authentications closed unanswered, too many were waiting to be checked.",
+     nullptr},
+    {"coro_socks_requests_total",
+     "Client requests by command.", "command=\"connect\""},
+    {"coro_socks_requests_total", nullptr, "command=\"udp_associate\""},
+    {"coro_socks_requests_total", nullptr, "command=\"unsupported\""},
+    {"coro_socks_optimistic_connect_failures_total",
+     "CONNECTs that failed after they had been answered optimistically.",
+     nullptr},
+    {"coro_socks_fast_open_connects_total",
+     "Fast Open connects by whether the SYN carried the first flight.",
+     "result=\"data\""},
+    {"coro_socks_fast_open_connects_total", nullptr, "result=\"fallback\""},
+    {"coro_socks_replies_total",
+     "Replies to client requests by REP code, optimistic ones by outcome.",
+     "code=\"succeeded\""},
+    {"coro_socks_replies_total", nullptr, "code=\"general_failure\""},
+    {"coro_socks_replies_total", nullptr, "code=\"not_allowed\""},
+    {"coro_socks_replies_total", nullptr, "code=\"network_unreachable\""},
+    {"coro_socks_replies_total", nullptr, "code=\"host_unreachable\""},
+    {"coro_socks_replies_total", nullptr, "code=\"connection_refused\""},
+    {"coro_socks_replies_total", nullptr, "code=\"ttl_expired\""},
+    {"coro_socks_replies_total", nullptr, "code=\"command_not_supported\""},
+    {"coro_socks_replies_total",
+     nullptr, "code=\"address_type_not_supported\""},
+    {"coro_socks_relay_bytes_total",
+     "Bytes relayed for CONNECT sessions.", "direction=\"client_to_remote\""},
+    {"coro_socks_relay_bytes_total", nullptr, "direction=\"remote_to_client\""},
+    {"coro_socks_udp_datagrams_total",
+     "Datagrams relayed for UDP ASSOCIATE sessions.",
+     "direction=\"client_to_remote\""},
+    {"coro_socks_udp_datagrams_total",
+     nullptr, "direction=\"remote_to_client\""},
+    {"coro_socks_udp_pending_dropped_total",
+     "Datagrams dropped while too many waited for their names to resolve.",
+     nullptr},
+    {"coro_socks_dns_lookups_total",
+     "Domain name lookups by cache outcome.", "result=\"hit\""},
+    {"coro_socks_dns_lookups_total", nullptr, "result=\"negative_hit\""},
+    {"coro_socks_dns_lookups_total", nullptr, "result=\"miss\""},
+    {"coro_socks_dns_lookups_total", nullptr, "result=\"coalesced\""},
+    {"coro_socks_dns_failures_total", "Resolver calls that failed.", nullptr},
+    {"coro_socks_upstream_pool_acquires_total",
+     "Upstream connections taken for CONNECT, warm from the pool or not.",
+     "result=\"hit\""},
+    {"coro_socks_upstream_pool_acquires_total", nullptr, "result=\"miss\""},
+    {"coro_socks_upstream_pool_refills_total",
+     "Upstream connections negotiated ahead of time for the pool.", nullptr},
+    {"coro_socks_upstream_pool_discarded_total",
+     "Pooled upstream connections found closed when taken.", nullptr},
+    {"coro_socks_throttled_reads_total",
+     "Relay reads delayed by a rate limit, by the limit that held them.",
+     "scope=\"session\""},
+    {"coro_socks_throttled_reads_total", nullptr, "scope=\"user\""},
+    {"coro_socks_throttled_reads_total", nullptr, "scope=\"worker\""},
+    {"coro_socks_access_log_dropped_total",
+     "Access log records lost to a full ring.", nullptr},
+    {"coro_socks_uring_sqes_submitted_total",
+     "Submission queue entries the kernel took from the io_uring rings.",
+     nullptr},
+    {"coro_socks_uring_enter_calls_total",
+     "io_uring_enter system calls made to submit.", nullptr},
+    {"coro_socks_uring_completions_total",
+     "Completion queue entries reaped from the io_uring rings.", nullptr},
+    {"coro_socks_uring_wakeups_total",
+     "Completion eventfd wakeups of the event loops.", nullptr},
+    {"coro_socks_uring_fallbacks_total",
+     "Relays moved to the socket path because the kernel refused an "
+     "io_uring operation.",
+     nullptr},
+};
+
+const descriptor gauge_descriptors[] = {
+    {"coro_socks_sessions_active", "Sessions currently open.", nullptr},
+    {"coro_socks_handshakes_active",
+     "Admitted sessions still negotiating their request.", nullptr},
+    {"coro_socks_derivations_active",
+     "Password derivations handed to the offload threads.",
+     nullptr},
+    {"coro_socks_workers_overloaded",
+     "Workers currently shedding new clients.", nullptr},
+    {"coro_socks_buffer_bytes", "Relay buffer memory.", "state=\"in_use\""},
+    {"coro_socks_buffer_bytes", nullptr, "state=\"pooled\""},
+    {"coro_socks_buffers",
+     "Relay buffers by size class, lent out or kept on the free list.",
+     "size=\"4096\",state=\"in_use\""},
+    {"coro_socks_buffers", nullptr, "size=\"8192\",state=\"in_use\""},
+    {"coro_socks_buffers", nullptr, "size=\"16384\",state=\"in_use\""},
+    {"coro_socks_buffers", nullptr, "size=\"32768\",state=\"in_use\""},
+    {"coro_socks_buffers", nullptr, "size=\"65536\",state=\"in_use\""},
+    {"coro_socks_buffers", nullptr, "size=\"131072\",state=\"in_use\""},
+    {"coro_socks_buffers", nullptr, "size=\"262144\",state=\"in_use\""},
+    {"coro_socks_buffers", nullptr, "size=\"4096\",state=\"pooled\""},
+    {"coro_socks_buffers", nullptr, "size=\"8192\",state=\"pooled\""},
+    {"coro_socks_buffers", nullptr, "size=\"16384\",state=\"pooled\""},
+    {"coro_socks_buffers", nullptr, "size=\"32768\",state=\"pooled\""},
+    {"coro_socks_buffers", nullptr, "size=\"65536\",state=\"pooled\""},
+    {"coro_socks_buffers", nullptr, "size=\"131072\",state=\"pooled\""},
+    {"coro_socks_buffers", nullptr, "size=\"262144\",state=\"pooled\""},
+    {"coro_socks_buffers_high_water",
+     "Most relay buffers of a size class a worker had lent out at once, "
+     "summed over the workers.",
+     "size=\"4096\""},
+    {"coro_socks_buffers_high_water", nullptr, "size=\"8192\""},
+    {"coro_socks_buffers_high_water", nullptr, "size=\"16384\""},
+    {"coro_socks_buffers_high_water", nullptr, "size=\"32768\""},
+    {"coro_socks_buffers_high_water", nullptr, "size=\"65536\""},
+    {"coro_socks_buffers_high_water", nullptr, "size=\"131072\""},
+    {"coro_socks_buffers_high_water", nullptr, "size=\"262144\""},
+};
+
+const descriptor histogram_descriptors[] = {
+    {"coro_socks_handshake_duration_seconds",
+     "Time from accept to the reply of a successful request.", nullptr},
+    {"coro_socks_upstream_connect_duration_seconds",
+     "Time to connect to the requested destination.", nullptr},
+    {"coro_socks_dns_resolve_duration_seconds",
+     "Time spent in the resolver on cache misses.", nullptr},
+};
+
+const descriptor phase_descriptors[] = {
+    {"coro_socks_session_phase_seconds",
+     "Session phases since the workers started: accept to the request read, "
+     "resolving the destination, connecting to it and then its first byte.",
+     "phase=\"handshake\""},
+    {"coro_socks_session_phase_seconds", nullptr, "phase=\"resolve\""},
+    {"coro_socks_session_phase_seconds", nullptr, "phase=\"connect\""},
+    {"coro_socks_session_phase_seconds", nullptr, "phase=\"first_byte\""},
+};
+
+const double phase_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+const descriptor worker_accepted_descriptor = {
+    "coro_socks_worker_sessions_accepted_total",
+    "Client connections accepted by each worker slot.", nullptr};
+
+static_assert(std::size(counter_descriptors) ==
+              static_cast<std::size_t>(socks_metrics::counter::num));
+static_assert(std::size(gauge_descriptors) ==
+              static_cast<std::size_t>(socks_metrics::gauge::num));
+static_assert(std::size(histogram_descriptors) ==
+              static_cast<std::size_t>(socks_metrics::histogram::num));
+static_assert(std::size(phase_descriptors) ==
+              static_cast<std::size_t>(socks_metrics::phase::num));
+
+void render_header(std::string& out, const descriptor& desc,
+                   const char* type) {
+    if (desc.help == nullptr) {
+        return;
+    }
+
+    out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", desc.name, desc.help,
+                       desc.name, type);
+}
+
+void render_sample(std::string& out, const descriptor& desc,
+                   const char* suffix, const std::string& labels,
+                   double value) {
+    out += desc.name;
+    out += suffix;
+    if (!labels.empty()) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += fmt::format(" {}\n", value);
+}
+
+bool owner_alive(int32_t owner) {
+    return owner != 0 && (::kill(owner, 0) == 0 || errno != ESRCH);
+}
+
+}    // namespace
+
+bool socks_metrics::init(std::size_t slot_num) {
+    void* addr = ::mmap(nullptr, slot_num * sizeof(slot),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (addr == MAP_FAILED) {
+        SPDLOG_ERROR("failed to map metrics segment: {}", std::strerror(errno));
+        return false;
+    }
+
+    segment_ = static_cast<slot*>(addr);
+    slot_num_ = slot_num;
+
+    for (std::size_t i = 0; i < slot_num; i++) {
+        new (&segment_[i]) slot();
+    }
+
+    return true;
+}
+
+socks_metrics::socks_metrics() : slot_(claim()) {
+    if (this->slot_ == nullptr) {
+        if (segment_ != nullptr) {
+            SPDLOG_WARN("no free metrics slot, worker {} is not exported",
+                        ::getpid());
+        }
+
+        this->slot_ = new slot();
+    }
+}
+
+socks_metrics::slot* socks_metrics::claim() {
+    int32_t self = static_cast<int32_t>(::gettid());
+
+    /* free slots first, then those left behind by workers that died */
+    for (int pass = 0; pass < 2; pass++) {
+        for (std::size_t i = 0; i < slot_num_; i++) {
+            slot& s = segment_[i];
+            int32_t owner = s.owner.load(std::memory_order_relaxed);
+
+            if (pass == 0 ? owner != 0 : owner_alive(owner)) {
+                continue;
+            }
+
+            if (!s.owner.compare_exchange_strong(owner, self)) {
+                continue;
+            }
+
+            /* counters carry on, gauges of a dead owner are stale */
+            for (auto&& g : s.gauges) {
+                g.store(0, std::memory_order_relaxed);
+            }
+
+            return &s;
+        }
+    }
+
+    return nullptr;
+}
+
+void socks_metrics::observe(histogram h, std::chrono::steady_clock::duration d) {
+    auto& hist = this->slot_->histograms[static_cast<std::size_t>(h)];
+    uint64_t us = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+
+    std::size_t i =
+        std::lower_bound(std::begin(bucket_bounds), std::end(bucket_bounds),
+                         us) -
+        std::begin(bucket_bounds);
+
+    hist.buckets[i].fetch_add(1, std::memory_order_relaxed);
+    hist.sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+uint64_t socks_metrics::phase_summary::quantile(double q) const {
+    if (this->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(
+        static_cast<uint64_t>(q * static_cast<double>(this->count) + 0.5), 1);
+    uint64_t cumulative = 0;
+    std::size_t i = 0;
+
+    for (; i + 1 < phase_bucket_num; i++) {
+        cumulative += this->buckets[i];
+        if (cumulative >= rank) {
+            break;
+        }
+    }
+
+    if (i < 2 * phase_sub_buckets) {
+        return i;
+    }
+
+    /* inverse of phase_bucket() */
+    unsigned shift = static_cast<unsigned>(i / phase_sub_buckets) - 1;
+    uint64_t lowest = (i % phase_sub_buckets + phase_sub_buckets) << shift;
+
+    return lowest + (uint64_t(1) << shift) - 1;
+}
+
+socks_metrics::phase_summary socks_metrics::summarize(phase p) {
+    phase_summary summary = {};
+
+    for (std::size_t i = 0; i < slot_num_; i++) {
+        const phase_slot& hist =
+            segment_[i].phases[static_cast<std::size_t>(p)];
+
+        for (std::size_t b = 0; b < phase_bucket_num; b++) {
+            uint64_t n = hist.buckets[b].load(std::memory_order_relaxed);
+            summary.buckets[b] += n;
+            summary.count += n;
+        }
+        summary.sum_us += hist.sum_us.load(std::memory_order_relaxed);
+    }
+
+    return summary;
+}
+
+std::string socks_metrics::render() {
+    constexpr std::size_t counter_num = static_cast<std::size_t>(counter::num);
+    constexpr std::size_t gauge_num = static_cast<std::size_t>(gauge::num);
+    constexpr std::size_t histogram_num =
+        static_cast<std::size_t>(histogram::num);
+
+    uint64_t counters[counter_num] = {};
+    int64_t gauges[gauge_num] = {};
+    uint64_t buckets[histogram_num][bucket_num] = {};
+    uint64_t sums[histogram_num] = {};
+
+    for (std::size_t i = 0; i < slot_num_; i++) {
+        const slot& s = segment_[i];
+
+        for (std::size_t c = 0; c < counter_num; c++) {
+            counters[c] += s.counters[c].load(std::memory_order_relaxed);
+        }
+
+        if (owner_alive(s.owner.load(std::memory_order_relaxed))) {
+            for (std::size_t g = 0; g < gauge_num; g++) {
+                gauges[g] += s.gauges[g].load(std::memory_order_relaxed);
+            }
+        }
+
+        for (std::size_t h = 0; h < histogram_num; h++) {
+            for (std::size_t b = 0; b < bucket_num; b++) {
+                buckets[h][b] += s.histograms[h].buckets[b].load(
+                    std::memory_order_relaxed);
+            }
+            sums[h] += s.histograms[h].sum_us.load(std::memory_order_relaxed);
+        }
+    }
+
+    std::string out;
+
+    for (std::size_t c = 0; c < counter_num; c++) {
+        const auto& desc = counter_descriptors[c];
+        render_header(out, desc, "counter");
+        render_sample(out, desc, "", desc.labels ? desc.labels : "",
+                      static_cast<double>(counters[c]));
+    }
+
+    /* how evenly the kernel spreads connections over the workers */
+    render_header(out, worker_accepted_descriptor, "counter");
+    for (std::size_t i = 0; i < slot_num_; i++) {
+        const slot& s = segment_[i];
+        if (s.owner.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        render_sample(
+            out, worker_accepted_descriptor, "",
+            fmt::format("worker=\"{}\"", i),
+            static_cast<double>(s.counters[static_cast<std::size_t>(
+                                               counter::sessions_accepted)]
+                                    .load(std::memory_order_relaxed)));
+    }
+
+    for (std::size_t g = 0; g < gauge_num; g++) {
+        const auto& desc = gauge_descriptors[g];
+        render_header(out, desc, "gauge");
+        render_sample(out, desc, "", desc.labels ? desc.labels : "",
+                      static_cast<double>(gauges[g]));
+    }
+
+    for (std::size_t h = 0; h < histogram_num; h++) {
+        const auto& desc = histogram_descriptors[h];
+        uint64_t cumulative = 0;
+
+        render_header(out, desc, "histogram");
+
+        for (std::size_t b = 0; b < bucket_num; b++) {
+            cumulative += buckets[h][b];
+
+            std::string le = b + 1 < bucket_num
+                                 ? fmt::format("le=\"{}\"",
+                                               bucket_bounds[b] / 1e6)
+                                 : std::string("le=\"+Inf\"");
+            render_sample(out, desc, "_bucket", le,
+                          static_cast<double>(cumulative));
+        }
+
+        render_sample(out, desc, "_sum", "", sums[h] / 1e6);
+        render_sample(out, desc, "_count", "",
+                      static_cast<double>(cumulative));
+    }
+
+    /* quantiles of the workers cannot be combined, their buckets can */
+    for (std::size_t p = 0; p < std::size(phase_descriptors); p++) {
+        const auto& desc = phase_descriptors[p];
+        auto summary = summarize(static_cast<phase>(p));
+
+        render_header(out, desc, "summary");
+
+        for (double q : phase_quantiles) {
+            render_sample(out, desc, "",
+                          fmt::format("{},quantile=\"{}\"", desc.labels, q),
+                          summary.quantile(q) / 1e6);
+        }
+
+        render_sample(out, desc, "_sum", desc.labels, summary.sum_us / 1e6);
+        render_sample(out, desc, "_count", desc.labels,
+                      static_cast<double>(summary.count));
+    }
+
+    return out;
+}
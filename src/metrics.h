@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+
+/*
+ * Metrics shared by all worker processes. main() maps one anonymous shared
+ * segment before asiomp forks, every worker then claims its own cache line
+ * aligned slot and is the only writer of it, so an update is a relaxed
+ * atomic add on an uncontended line. The exporter sums up all slots when
+ * it is scraped.
+ */
+class socks_metrics {
+public:
+    /* keep in sync with the descriptors in metrics.cpp */
+    enum class counter : uint32_t {
+        sessions_accepted,
+        sessions_shed,
+        method_no_auth,
+        method_user_passwd,
+        method_no_acceptable,
+        auth_failures,
+        auth_cache_hits,
+        auth_cache_misses,
+        auth_unchecked,
+        command_connect,
+        command_udp_associate,
+        command_unsupported,
+        optimistic_connect_failures,
+        fast_open_data,
+        fast_open_fallback,
+        /* indexed by the REP field of the reply */
+        reply_succeeded,
+        reply_general_failure,
+        reply_not_allowed,
+        reply_network_unreachable,
+        reply_host_unreachable,
+        reply_connection_refused,
+        reply_ttl_expired,
+        reply_command_not_supported,
+        reply_address_type_not_supported,
+        bytes_client_to_remote,
+        bytes_remote_to_client,
+        udp_client_to_remote,
+        udp_remote_to_client,
+        udp_pending_dropped,
+        dns_hits,
+        dns_negative_hits,
+        dns_misses,
+        dns_coalesced,
+        dns_failures,
+        upstream_pool_hits,
+        upstream_pool_misses,
+        upstream_pool_refills,
+        upstream_pool_discarded,
+        /* indexed by traffic_shaper::scope */
+        throttled_session,
+        throttled_user,
+        throttled_worker,
+        access_log_dropped,
+        uring_submitted,
+        uring_enter_calls,
+        uring_completions,
+        uring_wakeups,
+        uring_fallbacks,
+        num
+    };
+
+    enum class gauge : uint32_t {
+        sessions_active,
+        handshakes_active,
+        derivations_active,
+        workers_overloaded,
+        buffer_bytes_in_use,
+        buffer_bytes_pooled,
+        /* indexed by the size class of buffer_pool */
+        buffers_in_use_4k,
+        buffers_in_use_8k,
+        buffers_in_use_16k,
+        buffers_in_use_32k,
+        buffers_in_use_64k,
+        buffers_in_use_128k,
+        buffers_in_use_256k,
+        buffers_pooled_4k,
+        buffers_pooled_8k,
+        buffers_pooled_16k,
+        buffers_pooled_32k,
+        buffers_pooled_64k,
+        buffers_pooled_128k,
+        buffers_pooled_256k,
+        buffers_high_water_4k,
+        buffers_high_water_8k,
+        buffers_high_water_16k,
+        buffers_high_water_32k,
+        buffers_high_water_64k,
+        buffers_high_water_128k,
+        buffers_high_water_256k,
+        num
+    };
+
+    enum class histogram : uint32_t {
+        handshake,
+        upstream_connect,
+        dns_resolve,
+        num
+    };
+
+    /* the phases a slow session is broken down into */
+    enum class phase : uint32_t {
+        /* accept until the request is read */
+        handshake,
+        resolve,
+        connect,
+        /* connected until the remote sends its first byte */
+        first_byte,
+        num
+    };
+
+    /* upper bounds of the histogram buckets in microseconds, +Inf follows */
+    static constexpr uint64_t bucket_bounds[] = {
+        100,    250,    500,     1000,    2500,    5000,    10000,  25000,
+        50000,  100000, 250000,  500000,  1000000, 2500000, 5000000};
+    static constexpr std::size_t bucket_num = std::size(bucket_bounds) + 1;
+
+    /*
+     * Phases go into log-linear buckets as HDR histograms do. Below 16us
+     * every microsecond has a bucket, above that every power of two is
+     * split into 8 buckets, so none is wider than an eighth of its values.
+     * Longer than 2^32us lands in the last bucket.
+     */
+    static constexpr unsigned phase_sub_bucket_bits = 3;
+    static constexpr uint64_t phase_sub_buckets = 1 << phase_sub_bucket_bits;
+    static constexpr unsigned phase_max_bits = 32;
+    static constexpr std::size_t phase_bucket_num =
+        (phase_max_bits - phase_sub_bucket_bits + 1) * phase_sub_buckets;
+
+    static constexpr std::size_t phase_bucket(uint64_t us) {
+        us = std::min(us, (uint64_t(1) << phase_max_bits) - 1);
+        if (us < 2 * phase_sub_buckets) {
+            return us;
+        }
+
+        unsigned shift = std::bit_width(us) - 1 - phase_sub_bucket_bits;
+        return (shift + 1) * phase_sub_buckets + (us >> shift) -
+               phase_sub_buckets;
+    }
+
+    /* the buckets of one phase summed up over all slots */
+    struct phase_summary {
+        uint64_t buckets[phase_bucket_num];
+        uint64_t count;
+        uint64_t sum_us;
+
+        /* highest value of the bucket the q-quantile falls in */
+        uint64_t quantile(double q) const;
+    };
+
+    /* map the shared segment, must run before the workers are forked */
+    static bool init(std::size_t slot_num);
+
+    static inline socks_metrics* get() {
+        /* never torn down, sessions may outlive the thread locals at exit */
+        static thread_local socks_metrics* metrics = new socks_metrics();
+        return metrics;
+    }
+
+    inline void add(counter c, uint64_t n = 1) {
+        this->slot_->counters[static_cast<std::size_t>(c)].fetch_add(
+            n, std::memory_order_relaxed);
+    }
+
+    inline void add(gauge g, int64_t n) {
+        this->slot_->gauges[static_cast<std::size_t>(g)].fetch_add(
+            n, std::memory_order_relaxed);
+    }
+
+    /* first is the gauge of the smallest size class */
+    inline void add(gauge first, std::size_t size_class, int64_t n) {
+        this->add(static_cast<gauge>(static_cast<uint32_t>(first) + size_class),
+                  n);
+    }
+
+    inline void reply(uint8_t rep) {
+        if (rep <= 0x08) {
+            this->add(static_cast<counter>(
+                static_cast<uint32_t>(counter::reply_succeeded) + rep));
+        }
+    }
+
+    void observe(histogram h, std::chrono::steady_clock::duration d);
+
+    inline void observe(phase p, std::chrono::steady_clock::duration d) {
+        auto& hist = this->slot_->phases[static_cast<std::size_t>(p)];
+        uint64_t us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+
+        hist.buckets[phase_bucket(us)].fetch_add(1, std::memory_order_relaxed);
+        hist.sum_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    static phase_summary summarize(phase p);
+
+    /* aggregate of all slots in the Prometheus text format */
+    static std::string render();
+
+private:
+    socks_metrics();
+
+    socks_metrics(const socks_metrics&) = delete;
+
+    socks_metrics& operator=(const socks_metrics&) = delete;
+
+    struct histogram_slot {
+        std::atomic<uint64_t> buckets[bucket_num];
+        std::atomic<uint64_t> sum_us;
+    };
+
+    struct phase_slot {
+        std::atomic<uint64_t> buckets[phase_bucket_num];
+        std::atomic<uint64_t> sum_us;
+    };
+
+    struct alignas(64) slot {
+        std::atomic<int32_t> owner;
+        std::atomic<uint64_t> counters[static_cast<std::size_t>(counter::num)];
+        std::atomic<int64_t> gauges[static_cast<std::size_t>(gauge::num)];
+        histogram_slot histograms[static_cast<std::size_t>(histogram::num)];
+        phase_slot phases[static_cast<std::size_t>(phase::num)];
+    };
+
+    static slot* claim();
+
+private:
+    static inline slot* segment_ = nullptr;
+    static inline std::size_t slot_num_ = 0;
+
+    slot* slot_;
+};
@@ -0,0 +1,188 @@
+#include "metrics_exporter.h"
+
+#include <sys/prctl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+#include "metrics.h"
+
+namespace {
+
+/* a scrape has this long to send its request and take the response */
+constexpr std::chrono::seconds scrape_timeout{10};
+
+/* the request line and headers of a scrape, no body is read */
+constexpr std::size_t max_request_size = 8192;
+
+/* connections beyond this are closed as soon as they are accepted */
+constexpr std::size_t max_scrapes = 32;
+
+std::size_t scrapes = 0;
+
+}    // namespace
+
+bool metrics_exporter::spawn(const std::string &address, uint16_t port) {
+    int lifeline[2];
+
+    if (::pipe(lifeline) < 0) {
+        SPDLOG_ERROR("failed to create metrics lifeline: {}",
+                     std::strerror(errno));
+        return false;
+    }
+
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        SPDLOG_ERROR("failed to fork metrics exporter: {}",
+                     std::strerror(errno));
+        ::close(lifeline[0]);
+        ::close(lifeline[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        ::close(lifeline[1]);
+        run(lifeline[0], address, port);
+        ::_exit(EXIT_SUCCESS);
+    }
+
+    /* inherited by every worker, the exporter sees EOF after the last */
+    ::close(lifeline[0]);
+
+    return true;
+}
+
+void metrics_exporter::run(int lifeline, const std::string &address,
+                           uint16_t port) {
+    asio::error_code ec;
+    asio::io_context io_context;
+
+    /* leave the terminal's process group, the lifeline decides our exit */
+    ::setsid();
+    ::prctl(PR_SET_NAME, "metrics");
+
+    asio::ip::tcp::acceptor acceptor(io_context);
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(address, ec),
+                                     port);
+    if (ec) {
+        SPDLOG_ERROR("invalid metrics address [{}]", address);
+        return;
+    }
+
+    acceptor.open(endpoint.protocol(), ec);
+    if (!ec) {
+        acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true), ec);
+        acceptor.bind(endpoint, ec);
+    }
+    if (!ec) {
+        acceptor.listen(asio::socket_base::max_listen_connections, ec);
+    }
+    if (ec) {
+        SPDLOG_ERROR("failed to listen for metrics on {}:{}: {}", address,
+                     port, ec.message());
+        return;
+    }
+
+    SPDLOG_INFO("metrics exporter listening on {}:{}", address, port);
+
+    asio::posix::stream_descriptor lifeline_desc(io_context, lifeline);
+    char byte;
+
+    lifeline_desc.async_read_some(
+        asio::buffer(&byte, 1),
+        [&](const asio::error_code &, std::size_t) { io_context.stop(); });
+
+    asio::co_spawn(io_context, handle_accept(acceptor), asio::detached);
+
+    io_context.run();
+}
+
+asio::awaitable<void> metrics_exporter::handle_accept(
+    asio::ip::tcp::acceptor &acceptor) {
+    asio::error_code ec;
+
+    for (;;) {
+        auto socket = co_await acceptor.async_accept(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec == asio::error::operation_aborted) {
+            co_return;
+        }
+
+        if (ec) {
+            continue;
+        }
+
+        if (scrapes >= max_scrapes) {
+            socket.close(ec);
+            continue;
+        }
+
+        asio::co_spawn(acceptor.get_executor(),
+                       handle_scrape(std::move(socket)), asio::detached);
+    }
+}
+
+asio::awaitable<void> metrics_exporter::handle_scrape(
+    asio::ip::tcp::socket socket) {
+    asio::error_code ec;
+    std::string request;
+    asio::steady_timer timer(socket.get_executor());
+    auto waiting = std::make_shared<bool>(true);
+
+    scrapes++;
+
+    /* a client that stops reading or writing must not hold the slot */
+    timer.expires_after(scrape_timeout);
+    timer.async_wait([&socket, waiting](const asio::error_code &ec) {
+        asio::error_code ignored_ec;
+
+        if (!ec && *waiting) {
+            socket.close(ignored_ec);
+        }
+    });
+
+    co_await asio::async_read_until(
+        socket, asio::dynamic_buffer(request, max_request_size), "\r\n\r\n",
+        asio::redirect_error(asio::use_awaitable, ec));
+
+    /* one response per connection, whatever else the client sent */
+    if (!ec || ec == asio::error::not_found) {
+        std::string body;
+        std::string status;
+
+        if (ec) {
+            status = "431 Request Header Fields Too Large";
+        } else if (request.starts_with("GET /metrics ") ||
+                   request.starts_with("GET / ")) {
+            status = "200 OK";
+            body = socks_metrics::render();
+        } else {
+            status = "404 Not Found";
+        }
+
+        std::string header = fmt::format(
+            "HTTP/1.1 {}\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: {}\r\n"
+            "Connection: close\r\n\r\n",
+            status, body.size());
+
+        std::array<asio::const_buffer, 2> buf = {
+            {asio::buffer(header), asio::buffer(body)}};
+
+        co_await asio::async_write(
+            socket, buf, asio::redirect_error(asio::use_awaitable, ec));
+
+        socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+    }
+
+    *waiting = false;
+    timer.cancel();
+    socket.close(ec);
+    scrapes--;
+
+    co_return;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+#include "asiomp.h"
+
+/*
+ * Serves socks_metrics::render() in the Prometheus text format. The asiomp
+ * master runs a loop we cannot hook into, so the exporter is a helper
+ * process forked off main() before asiomp starts. It holds the read end of
+ * a lifeline pipe whose write end stays with the master and the workers,
+ * and exits once all of them are gone. A scrape gets one response and is
+ * closed, within a deadline that also covers reading its request.
+ */
+class metrics_exporter {
+public:
+    static bool spawn(const std::string& address, uint16_t port);
+
+private:
+    static void run(int lifeline, const std::string& address, uint16_t port);
+
+    static asio::awaitable<void> handle_accept(
+        asio::ip::tcp::acceptor& acceptor);
+
+    static asio::awaitable<void> handle_scrape(asio::ip::tcp::socket socket);
+};
@@ -0,0 +1,23 @@
+#include "offload_pool.h"
+
+#include <unistd.h>
+
+#include <mutex>
+
+offload_pool* offload_pool::get() {
+    static std::mutex mutex;
+    static pid_t owner = 0;
+    /* never torn down, the threads may still run at exit */
+    static offload_pool* pool = nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (owner != ::getpid()) {
+        pool = new offload_pool();
+        owner = ::getpid();
+    }
+
+    return pool;
+}
+
+offload_pool::offload_pool() : pool_(thread_num) {}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+
+#include "asiomp.h"
+
+/*
+ * A few threads per process for work too heavy for an event loop, such as
+ * deriving password hashes. A coroutine that awaits run() is suspended
+ * while the work is queued and running, and is resumed on its own
+ * executor with the result.
+ */
+class offload_pool {
+public:
+    static constexpr std::size_t thread_num = 2;
+
+    /* threads do not survive fork, a forked process starts its own */
+    static offload_pool* get();
+
+    template <typename Function>
+    auto run(Function f) {
+        using result = std::invoke_result_t<Function&>;
+
+        return asio::async_initiate<const asio::use_awaitable_t<>&,
+                                    void(result)>(
+            [this, f = std::move(f)](auto handler) mutable {
+                /* the worker must not run out of work while it waits */
+                auto ex = asio::prefer(
+                    asio::get_associated_executor(handler),
+                    asio::execution::outstanding_work.tracked);
+
+                asio::post(this->pool_, [handler = std::move(handler),
+                                         f = std::move(f),
+                                         ex = std::move(ex)]() mutable {
+                    asio::post(ex, [handler = std::move(handler),
+                                    r = f()]() mutable {
+                        std::move(handler)(std::move(r));
+                    });
+                });
+            },
+            asio::use_awaitable);
+    }
+
+private:
+    offload_pool();
+
+    offload_pool(const offload_pool&) = delete;
+
+    offload_pool& operator=(const offload_pool&) = delete;
+
+private:
+    asio::thread_pool pool_;
+};
@@ -0,0 +1,261 @@
+#include "pbkdf2.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace coro_socks {
+
+namespace {
+
+// clang-format off
+constexpr uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+// clang-format on
+
+constexpr std::array<uint32_t, 8> initial_state = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void compress(std::array<uint32_t, 8>& state, const uint8_t* block) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (static_cast<uint32_t>(block[4 * i]) << 24) |
+               (static_cast<uint32_t>(block[4 * i + 1]) << 16) |
+               (static_cast<uint32_t>(block[4 * i + 2]) << 8) |
+               static_cast<uint32_t>(block[4 * i + 3]);
+    }
+
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^
+                      (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^
+                      (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + round_constants[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void store_digest(const std::array<uint32_t, 8>& state, uint8_t* out) {
+    for (std::size_t i = 0; i < 8; i++) {
+        out[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+        out[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+        out[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+        out[4 * i + 3] = static_cast<uint8_t>(state[i]);
+    }
+}
+
+/*
+ * HMAC keyed once for all iterations. Past the first block every message
+ * is a previous 32 byte digest, so both hashes of an iteration are single
+ * compressions of a block whose padding is written only once.
+ */
+class hmac_sha256 {
+public:
+    explicit hmac_sha256(std::string_view key)
+        : inner_hash_(),
+          outer_hash_(),
+          inner_(initial_state),
+          outer_(initial_state) {
+        uint8_t pad[sha256::block_size] = {};
+
+        if (key.size() > sha256::block_size) {
+            auto hashed = sha256::hash(key);
+            std::memcpy(pad, hashed.data(), hashed.size());
+        } else {
+            std::memcpy(pad, key.data(), key.size());
+        }
+
+        for (auto& b : pad) {
+            b ^= 0x36;
+        }
+        compress(this->inner_, pad);
+        this->inner_hash_.update(pad, sizeof(pad));
+
+        for (auto& b : pad) {
+            b ^= 0x36 ^ 0x5c;
+        }
+        compress(this->outer_, pad);
+        this->outer_hash_.update(pad, sizeof(pad));
+    }
+
+    sha256::digest mac(std::string_view salt, const uint8_t* index) const {
+        sha256 inner = this->inner_hash_;
+        inner.update(salt);
+        inner.update(index, 4);
+        auto inner_digest = inner.final();
+
+        sha256 outer = this->outer_hash_;
+        outer.update(inner_digest.data(), inner_digest.size());
+        return outer.final();
+    }
+
+    /* u = HMAC(u), through a block laid out as digest, padding, length */
+    void mac_digest(uint8_t* block) const {
+        auto state = this->inner_;
+        compress(state, block);
+        store_digest(state, block);
+
+        state = this->outer_;
+        compress(state, block);
+        store_digest(state, block);
+    }
+
+private:
+    sha256 inner_hash_;
+    sha256 outer_hash_;
+    std::array<uint32_t, 8> inner_;
+    std::array<uint32_t, 8> outer_;
+};
+
+}    // namespace
+
+sha256::sha256()
+    : state_(initial_state),
+      block_(),
+      block_len_(0),
+      total_len_(0) {}
+
+void sha256::update(const void* data, std::size_t len) {
+    auto* p = static_cast<const uint8_t*>(data);
+
+    this->total_len_ += len;
+
+    if (this->block_len_ > 0) {
+        std::size_t n = std::min(len, block_size - this->block_len_);
+
+        std::memcpy(this->block_.data() + this->block_len_, p, n);
+        this->block_len_ += n;
+        p += n;
+        len -= n;
+
+        if (this->block_len_ < block_size) {
+            return;
+        }
+
+        this->compress(this->block_.data());
+        this->block_len_ = 0;
+    }
+
+    for (; len >= block_size; p += block_size, len -= block_size) {
+        this->compress(p);
+    }
+
+    std::memcpy(this->block_.data(), p, len);
+    this->block_len_ = len;
+}
+
+sha256::digest sha256::final() {
+    uint64_t bits = this->total_len_ * 8;
+    uint8_t padding[block_size + 8] = {0x80};
+    std::size_t pad_len = (this->block_len_ < 56 ? 56 : 120) - this->block_len_;
+
+    for (int i = 0; i < 8; i++) {
+        padding[pad_len + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    }
+    this->update(padding, pad_len + 8);
+
+    digest out;
+    store_digest(this->state_, out.data());
+
+    return out;
+}
+
+sha256::digest sha256::hash(std::string_view data) {
+    sha256 h;
+    h.update(data);
+    return h.final();
+}
+
+void sha256::compress(const uint8_t* block) {
+    coro_socks::compress(this->state_, block);
+}
+
+void pbkdf2_sha256(std::string_view password, std::string_view salt,
+                   uint32_t iterations, uint8_t* out, std::size_t len) {
+    hmac_sha256 prf(password);
+
+    /* the 32 byte digest of one block of key and the padding after it */
+    uint8_t block[sha256::block_size] = {};
+    uint64_t bits = (sha256::block_size + sha256::digest_size) * 8;
+
+    block[sha256::digest_size] = 0x80;
+    block[sha256::block_size - 2] = static_cast<uint8_t>(bits >> 8);
+    block[sha256::block_size - 1] = static_cast<uint8_t>(bits);
+
+    for (uint32_t index = 1; len > 0; index++) {
+        uint8_t be_index[4] = {static_cast<uint8_t>(index >> 24),
+                               static_cast<uint8_t>(index >> 16),
+                               static_cast<uint8_t>(index >> 8),
+                               static_cast<uint8_t>(index)};
+
+        sha256::digest t = prf.mac(salt, be_index);
+        std::memcpy(block, t.data(), t.size());
+
+        for (uint32_t i = 1; i < iterations; i++) {
+            prf.mac_digest(block);
+
+            for (std::size_t j = 0; j < t.size(); j++) {
+                t[j] ^= block[j];
+            }
+        }
+
+        std::size_t n = std::min(len, t.size());
+        std::memcpy(out, t.data(), n);
+        out += n;
+        len -= n;
+    }
+}
+
+bool constant_time_equal(const uint8_t* a, const uint8_t* b, std::size_t len) {
+    volatile uint8_t diff = 0;
+
+    for (std::size_t i = 0; i < len; i++) {
+        diff = diff | (a[i] ^ b[i]);
+    }
+
+    return diff == 0;
+}
+
+}    // namespace coro_socks
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+ * SHA-256 and PBKDF2-HMAC-SHA256 (RFC 8018) for the credential store, kept
+ * in tree so authentication does not pull in a crypto library.
+ */
+namespace coro_socks {
+
+class sha256 {
+public:
+    static constexpr std::size_t digest_size = 32;
+    static constexpr std::size_t block_size = 64;
+
+    using digest = std::array<uint8_t, digest_size>;
+
+    sha256();
+
+    void update(const void* data, std::size_t len);
+
+    inline void update(std::string_view data) {
+        this->update(data.data(), data.size());
+    }
+
+    digest final();
+
+    static digest hash(std::string_view data);
+
+private:
+    void compress(const uint8_t* block);
+
+private:
+    std::array<uint32_t, 8> state_;
+    std::array<uint8_t, block_size> block_;
+    std::size_t block_len_;
+    uint64_t total_len_;
+};
+
+void pbkdf2_sha256(std::string_view password, std::string_view salt,
+                   uint32_t iterations, uint8_t* out, std::size_t len);
+
+/* the time taken does not depend on where the buffers differ */
+bool constant_time_equal(const uint8_t* a, const uint8_t* b, std::size_t len);
+
+}    // namespace coro_socks
@@ -0,0 +1,14 @@
+#pragma once
+
+/*
+ * USDT probes for bpftrace and perf, provider coro_socks. A probe is one
+ * nop until a tracer attaches, so its arguments must be values already at
+ * hand, never anything computed for the probe alone. Without <sys/sdt.h>
+ * from systemtap the probes compile to nothing.
+ */
+#if __has_include(<sys/sdt.h>) && !defined(CORO_SOCKS_NO_PROBES)
+#include <sys/sdt.h>
+#define SOCKS_PROBE(name, ...) STAP_PROBEV(coro_socks, name, __VA_ARGS__)
+#else
+#define SOCKS_PROBE(name, ...) ((void)0)
+#endif
@@ -1,20 +1,211 @@
 #include "public.h"
 
+#include <cstring>
+
 namespace coro_socks {
 
+parse_result parse_message(std::string_view buf, std::size_t& consumed,
+                           method_request& msg) {
+    if (buf.size() < 2) {
+        return parse_result::incomplete;
+    }
+
+    if (static_cast<uint8_t>(buf[0]) != Version::V5) {
+        return parse_result::invalid;
+    }
+
+    std::size_t nmethods = static_cast<uint8_t>(buf[1]);
+    if (buf.size() < 2 + nmethods) {
+        return parse_result::incomplete;
+    }
+
+    msg.methods = buf.substr(2, nmethods);
+    consumed = 2 + nmethods;
+
+    return parse_result::complete;
+}
+
+parse_result parse_message(std::string_view buf, std::size_t& consumed,
+                           auth_request& msg) {
+    if (buf.size() < 2) {
+        return parse_result::incomplete;
+    }
+
+    if (buf[0] != 0x01) {
+        return parse_result::invalid;
+    }
+
+    std::size_t ulen = static_cast<uint8_t>(buf[1]);
+    if (ulen == 0) {
+        return parse_result::invalid;
+    }
+
+    if (buf.size() < 2 + ulen + 1) {
+        return parse_result::incomplete;
+    }
+
+    std::size_t plen = static_cast<uint8_t>(buf[2 + ulen]);
+    if (plen == 0) {
+        return parse_result::invalid;
+    }
+
+    if (buf.size() < 3 + ulen + plen) {
+        return parse_result::incomplete;
+    }
+
+    msg.uname = buf.substr(2, ulen);
+    msg.passwd = buf.substr(3 + ulen, plen);
+    consumed = 3 + ulen + plen;
+
+    return parse_result::complete;
+}
+
+parse_result parse_message(std::string_view buf, std::size_t& consumed,
+                           client_request& msg) {
+    if (buf.size() < 4) {
+        return parse_result::incomplete;
+    }
+
+    if (static_cast<uint8_t>(buf[0]) != Version::V5 || buf[2] != 0x00) {
+        return parse_result::invalid;
+    }
+
+    std::size_t offset;
+    std::size_t addr_len;
+
+    msg.cmd = static_cast<uint8_t>(buf[1]);
+    msg.atyp = static_cast<uint8_t>(buf[3]);
+
+    switch (msg.atyp) {
+        case Atyp::IpV4: {
+            offset = 4;
+            addr_len = 4;
+            break;
+        }
+        case Atyp::IpV6: {
+            offset = 4;
+            addr_len = 16;
+            break;
+        }
+        case Atyp::DomainName: {
+            if (buf.size() < 5) {
+                return parse_result::incomplete;
+            }
+
+            offset = 5;
+            addr_len = static_cast<uint8_t>(buf[4]);
+            if (addr_len == 0) {
+                return parse_result::invalid;
+            }
+            break;
+        }
+        default: {
+            return parse_result::invalid;
+        }
+    }
+
+    if (buf.size() < offset + addr_len + 2) {
+        return parse_result::incomplete;
+    }
+
+    msg.dst_addr = buf.substr(offset, addr_len);
+    msg.dst_port = static_cast<uint16_t>(
+        (static_cast<uint8_t>(buf[offset + addr_len]) << 8) +
+        static_cast<uint8_t>(buf[offset + addr_len + 1]));
+    consumed = offset + addr_len + 2;
+
+    return parse_result::complete;
+}
+
+parse_result parse_message(std::string_view buf, std::size_t& consumed,
+                           udp_request& msg) {
+    if (buf.size() <= 4) {
+        return parse_result::incomplete;
+    }
+
+    if (buf[0] != 0x00 || buf[1] != 0x00 || buf[2] != 0x00) {
+        return parse_result::invalid;
+    }
+
+    std::size_t offset;
+    std::size_t addr_len;
+
+    msg.atyp = static_cast<uint8_t>(buf[3]);
+
+    switch (msg.atyp) {
+        case Atyp::IpV4: {
+            offset = 4;
+            addr_len = 4;
+            break;
+        }
+        case Atyp::IpV6: {
+            offset = 4;
+            addr_len = 16;
+            break;
+        }
+        case Atyp::DomainName: {
+            offset = 5;
+            addr_len = static_cast<uint8_t>(buf[4]);
+            break;
+        }
+        default: {
+            return parse_result::invalid;
+        }
+    }
+
+    if (buf.size() <= offset + addr_len + 2) {
+        return parse_result::incomplete;
+    }
+
+    msg.dst_addr = buf.substr(offset, addr_len);
+    msg.dst_port = static_cast<uint16_t>(
+        (static_cast<uint8_t>(buf[offset + addr_len]) << 8) +
+        static_cast<uint8_t>(buf[offset + addr_len + 1]));
+    consumed = offset + addr_len + 2;
+    msg.data = buf.substr(consumed);
+
+    return parse_result::complete;
+}
+
+std::size_t encode_udp_header(const asio::ip::udp::endpoint& endpoint,
+                              char* out) {
+    std::size_t length;
+
+    out[0] = 0x00;
+    out[1] = 0x00;
+    out[2] = 0x00;
+
+    if (endpoint.address().is_v4()) {
+        auto bytes = endpoint.address().to_v4().to_bytes();
+        out[3] = Atyp::IpV4;
+        std::memcpy(out + 4, bytes.data(), bytes.size());
+        length = 4 + bytes.size();
+    } else {
+        auto bytes = endpoint.address().to_v6().to_bytes();
+        out[3] = Atyp::IpV6;
+        std::memcpy(out + 4, bytes.data(), bytes.size());
+        length = 4 + bytes.size();
+    }
+
+    out[length] = static_cast<char>(endpoint.port() >> 8);
+    out[length + 1] = static_cast<char>(endpoint.port() & 0xFF);
+
+    return length + 2;
+}
+
 std::string format_address(std::string_view bytes, uint8_t atyp) {
     switch (atyp) {
         case Atyp::IpV4: {
-            return fmt::format("{:d}.{:d}.{:d}.{:d}", bytes[0], bytes[1],
-                               bytes[2], bytes[3]);
+            auto b = reinterpret_cast<const uint8_t*>(bytes.data());
+            return fmt::format("{:d}.{:d}.{:d}.{:d}", b[0], b[1], b[2], b[3]);
         }
         case Atyp::IpV6: {
+            auto b = reinterpret_cast<const uint8_t*>(bytes.data());
             return fmt::format(
                 "{:02X}{:02X}:{:02X}{:02X}:{:02X}{:02X}:{:02X}{:02X}:"
                 "{:02X}{:02X}:{:02X}{:02X}:{:02X}{:02X}:{:02X}{:02X}",
-                bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5],
-                bytes[6], bytes[7], bytes[8], bytes[9], bytes[10], bytes[11],
-                bytes[12], bytes[13], bytes[14], bytes[15]);
+                b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], b[8], b[9],
+                b[10], b[11], b[12], b[13], b[14], b[15]);
         }
         default: {
             break;
@@ -24,4 +215,16 @@ std::string format_address(std::string_view bytes, uint8_t atyp) {
     return std::string(bytes);
 }
 
+asio::ip::address make_address(std::string_view bytes, uint8_t atyp) {
+    if (atyp == Atyp::IpV6) {
+        asio::ip::address_v6::bytes_type v6;
+        std::memcpy(v6.data(), bytes.data(), v6.size());
+        return asio::ip::address_v6(v6);
+    }
+
+    asio::ip::address_v4::bytes_type v4;
+    std::memcpy(v4.data(), bytes.data(), v4.size());
+    return asio::ip::address_v4(v4);
+}
+
 }    // namespace coro_socks
\ No newline at end of file
@@ -50,9 +50,70 @@ struct ReplyRep {
 };
 // clang-format on
 
+enum class parse_result {
+    complete,
+    incomplete,
+    invalid,
+};
+
+/* the views point into the buffer that was parsed */
+struct method_request {
+    std::string_view methods;
+};
+
+struct auth_request {
+    std::string_view uname;
+    std::string_view passwd;
+};
+
+struct client_request {
+    uint8_t cmd;
+    uint8_t atyp;
+    std::string_view dst_addr;
+    uint16_t dst_port;
+};
+
+/* header of a UDP ASSOCIATE datagram, data is the payload behind it */
+struct udp_request {
+    uint8_t atyp;
+    std::string_view dst_addr;
+    uint16_t dst_port;
+    std::string_view data;
+};
+
+/* RSV, FRAG, ATYP, an IPv6 address and the port */
+constexpr std::size_t max_udp_header_size = 22;
+
+/*
+ * Parse one message from the front of buf. On complete, consumed is the
+ * message length; incomplete means more bytes are needed.
+ */
+parse_result parse_message(std::string_view buf, std::size_t& consumed,
+                           method_request& msg);
+
+parse_result parse_message(std::string_view buf, std::size_t& consumed,
+                           auth_request& msg);
+
+parse_result parse_message(std::string_view buf, std::size_t& consumed,
+                           client_request& msg);
+
+/*
+ * A datagram is never continued, incomplete means it is too short to carry
+ * a header and a non-empty payload. Fragments are reported as invalid.
+ */
+parse_result parse_message(std::string_view buf, std::size_t& consumed,
+                           udp_request& msg);
+
+/* write the header for a datagram from endpoint, returns its length */
+std::size_t encode_udp_header(const asio::ip::udp::endpoint& endpoint,
+                              char* out);
+
 
 std::string format_address(std::string_view bytes, uint8_t atyp);
 
+/* the address of IPv4 or IPv6 bytes in network order, without a string */
+asio::ip::address make_address(std::string_view bytes, uint8_t atyp);
+
 
 template <typename InternetProtocol>
 std::string format_address(
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+/*
+ * Read-mostly value shared by the threads of one process. A reader takes a
+ * reference to the current immutable snapshot and may hold it as long as
+ * it likes, a writer copies the snapshot, changes the copy and publishes
+ * it with one atomic store. The old snapshot is freed with its last
+ * reader, so neither side ever waits for the other.
+ */
+template <typename T>
+class rcu_snapshot {
+public:
+    rcu_snapshot() : current_(std::make_shared<const T>()) {}
+
+    explicit rcu_snapshot(T value)
+        : current_(std::make_shared<const T>(std::move(value))) {}
+
+    rcu_snapshot(const rcu_snapshot&) = delete;
+
+    rcu_snapshot& operator=(const rcu_snapshot&) = delete;
+
+    inline std::shared_ptr<const T> load() const {
+        return this->current_.load(std::memory_order_acquire);
+    }
+
+    inline void store(std::shared_ptr<const T> value) {
+        this->current_.store(std::move(value), std::memory_order_release);
+    }
+
+    /* copy, change and publish, writers see each other's changes */
+    template <typename Update>
+    void update(Update update) {
+        std::lock_guard<std::mutex> lock(this->writer_);
+
+        auto copy = std::make_shared<T>(*this->load());
+        update(*copy);
+        this->store(std::move(copy));
+    }
+
+private:
+    std::atomic<std::shared_ptr<const T>> current_;
+    std::mutex writer_;
+};
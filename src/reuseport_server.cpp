@@ -0,0 +1,303 @@
+#include "reuseport_server.h"
+
+#include <linux/filter.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "access_log.h"
+#include "admission_control.h"
+#include "socks_session.h"
+
+reuseport_server::reuseport_server(const std::string &address, uint16_t port,
+                                   uint32_t worker_num, bool daemon,
+                                   std::vector<int> cpus, bool incoming_cpu)
+    : address_(address),
+      port_(port),
+      worker_num_(std::max<uint32_t>(worker_num, 1)),
+      daemon_(daemon),
+      cpus_(std::move(cpus)),
+      incoming_cpu_(incoming_cpu) {}
+
+reuseport_server::~reuseport_server() {
+    for (int fd : this->listeners_) {
+        ::close(fd);
+    }
+}
+
+void reuseport_server::run() {
+    if (this->daemon_ && ::daemon(1, 0) < 0) {
+        SPDLOG_ERROR("failed to daemonize: {}", std::strerror(errno));
+        return;
+    }
+
+    if (!this->listen()) {
+        return;
+    }
+
+    if (this->incoming_cpu_) {
+        if (this->cpus_.empty()) {
+            SPDLOG_WARN("incoming_cpu needs worker_cpus, not steering");
+        } else if (!this->attach_steering()) {
+            SPDLOG_WARN("failed to attach reuseport program: {}",
+                        std::strerror(errno));
+        }
+    }
+
+    /* taken with sigwait(), the workers unblock them again */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGHUP);
+    ::signal(SIGHUP, SIG_DFL);
+    ::sigprocmask(SIG_BLOCK, &signals, nullptr);
+
+    this->workers_.assign(this->worker_num_, 0);
+    for (std::size_t i = 0; i < this->worker_num_; i++) {
+        this->workers_[i] = this->spawn(i);
+    }
+
+    SPDLOG_INFO("{} reuseport workers listening on {}:{}", this->worker_num_,
+                this->address_, this->port_);
+
+    for (;;) {
+        int sig;
+        if (::sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+
+        if (sig == SIGHUP) {
+            /* validated here first, a broken file never reaches a worker */
+            if (!socks_config::reload()) {
+                SPDLOG_ERROR("failed to reload the configuration, keeping it");
+                continue;
+            }
+
+            for (pid_t pid : this->workers_) {
+                if (pid > 0) {
+                    ::kill(pid, SIGHUP);
+                }
+            }
+            continue;
+        }
+
+        if (sig != SIGCHLD) {
+            break;
+        }
+
+        pid_t pid;
+        int status;
+        while ((pid = ::waitpid(-1, &status, WNOHANG)) > 0) {
+            auto it = std::find(this->workers_.begin(), this->workers_.end(),
+                                pid);
+            if (it == this->workers_.end()) {
+                continue;
+            }
+
+            std::size_t worker = it - this->workers_.begin();
+            SPDLOG_WARN("worker {} (pid {}) exited, respawning", worker, pid);
+
+            /* its socket stayed open here, pending connections wait */
+            *it = this->spawn(worker);
+        }
+    }
+
+    for (pid_t pid : this->workers_) {
+        if (pid > 0) {
+            ::kill(pid, SIGTERM);
+        }
+    }
+
+    for (pid_t pid : this->workers_) {
+        if (pid > 0) {
+            ::waitpid(pid, nullptr, 0);
+        }
+    }
+}
+
+bool reuseport_server::listen() {
+    asio::error_code ec;
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(this->address_, ec),
+                                     this->port_);
+    if (ec) {
+        SPDLOG_ERROR("invalid listening address [{}]", this->address_);
+        return false;
+    }
+
+    for (std::size_t i = 0; i < this->worker_num_; i++) {
+        int fd = ::socket(endpoint.protocol().family(),
+                          SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            SPDLOG_ERROR("failed to create listening socket: {}",
+                         std::strerror(errno));
+            return false;
+        }
+
+        this->listeners_.push_back(fd);
+
+        int on = 1;
+        if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            SPDLOG_ERROR("failed to set SO_REUSEPORT: {}",
+                         std::strerror(errno));
+            return false;
+        }
+
+        /* a hint for the lookup even when no program is attached */
+        if (this->incoming_cpu_ && !this->cpus_.empty()) {
+            int cpu = this->cpus_[i % this->cpus_.size()];
+            ::setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+        }
+
+        /* bound in order, socket i is index i of the reuseport group */
+        if (::bind(fd, endpoint.data(), endpoint.size()) < 0 ||
+            ::listen(fd, SOMAXCONN) < 0) {
+            SPDLOG_ERROR("failed to listen on {}:{}: {}", this->address_,
+                         this->port_, std::strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool reuseport_server::attach_steering() {
+    std::vector<sock_filter> code;
+
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                            static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+
+    for (std::size_t i = 0; i < this->worker_num_; i++) {
+        uint32_t cpu =
+            static_cast<uint32_t>(this->cpus_[i % this->cpus_.size()]);
+        code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1));
+        code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(i)));
+    }
+
+    /* a CPU no worker is pinned to still spreads evenly */
+    code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, this->worker_num_));
+    code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+
+    sock_fprog prog;
+    prog.len = static_cast<unsigned short>(code.size());
+    prog.filter = code.data();
+
+    return ::setsockopt(this->listeners_[0], SOL_SOCKET,
+                        SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+pid_t reuseport_server::spawn(std::size_t worker) {
+    pid_t master = ::getpid();
+    pid_t pid = ::fork();
+
+    if (pid < 0) {
+        SPDLOG_ERROR("failed to fork worker {}: {}", worker,
+                     std::strerror(errno));
+        return 0;
+    }
+
+    if (pid > 0) {
+        return pid;
+    }
+
+    /* never outlive the master, the sockets would stay in the group */
+    ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (::getppid() != master) {
+        ::_exit(EXIT_SUCCESS);
+    }
+
+    /* a reload must not kill the worker before it watches for SIGHUP */
+    ::signal(SIGHUP, SIG_IGN);
+
+    sigset_t signals;
+    sigfillset(&signals);
+    ::sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+
+    this->run_worker(worker);
+
+    /* the sessions are gone with the io_context, _exit() skips atexit */
+    access_log::flush();
+    ::_exit(EXIT_SUCCESS);
+}
+
+void reuseport_server::run_worker(std::size_t worker) {
+    if (!this->cpus_.empty()) {
+        int cpu = this->cpus_[worker % this->cpus_.size()];
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (::sched_setaffinity(0, sizeof(set), &set) < 0) {
+            SPDLOG_WARN("failed to pin worker {} to cpu {}: {}", worker, cpu,
+                        std::strerror(errno));
+        }
+    }
+
+    for (std::size_t i = 0; i < this->listeners_.size(); i++) {
+        if (i != worker) {
+            ::close(this->listeners_[i]);
+        }
+    }
+
+    int fd = this->listeners_[worker];
+    this->listeners_.clear();
+
+    asio::error_code ec;
+    asio::io_context io_context(1);
+    asio::ip::tcp::acceptor acceptor(io_context);
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(this->address_, ec),
+                                     this->port_);
+
+    acceptor.assign(endpoint.protocol(), fd, ec);
+    if (ec) {
+        SPDLOG_ERROR("worker {} failed to take its socket: {}", worker,
+                     ec.message());
+        return;
+    }
+
+    asio::signal_set signals(io_context, SIGINT, SIGTERM, SIGQUIT);
+    signals.async_wait(
+        [&](const asio::error_code &, int) { io_context.stop(); });
+
+    socks_config::reload_on_sighup(io_context.get_executor());
+
+    asio::co_spawn(io_context, handle_accept(acceptor), asio::detached);
+
+    io_context.run();
+}
+
+asio::awaitable<void> reuseport_server::handle_accept(
+    asio::ip::tcp::acceptor &acceptor) {
+    asio::error_code ec;
+
+    while (acceptor.is_open()) {
+        /* new clients wait in the listen backlog until the worker recovers */
+        auto control = admission_control::get(acceptor.get_executor());
+        if (control->pauses_accept() && control->overloaded()) {
+            co_await control->wait_until_admitting();
+        }
+
+        auto socket = co_await acceptor.async_accept(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec == asio::error::operation_aborted) {
+            co_return;
+        }
+
+        if (ec) {
+            SPDLOG_WARN("failed to accept: {}", ec.message());
+            continue;
+        }
+
+        socks_session::create(std::move(socket))->start();
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "asiomp.h"
+
+/*
+ * Multi-process server where every worker accepts on a SO_REUSEPORT socket
+ * of its own instead of the one asiomp shares among them, so a connection
+ * wakes a single worker and the kernel spreads connections over all of
+ * them. The master opens the sockets before it forks, so worker i owns
+ * index i of the reuseport group, and keeps them open to respawn a worker
+ * that died. Workers can be pinned to CPUs. With incoming_cpu, a CBPF
+ * program hands a connection to the worker pinned to the CPU whose softirq
+ * took it in.
+ */
+class reuseport_server {
+public:
+    reuseport_server(const std::string& address, uint16_t port,
+                     uint32_t worker_num, bool daemon, std::vector<int> cpus,
+                     bool incoming_cpu);
+
+    ~reuseport_server();
+
+    reuseport_server(const reuseport_server&) = delete;
+
+    reuseport_server& operator=(const reuseport_server&) = delete;
+
+    void run();
+
+private:
+    bool listen();
+
+    /* the reuseport program indexing workers by their pinned CPU */
+    bool attach_steering();
+
+    pid_t spawn(std::size_t worker);
+
+    void run_worker(std::size_t worker);
+
+    static asio::awaitable<void> handle_accept(
+        asio::ip::tcp::acceptor& acceptor);
+
+private:
+    std::string address_;
+    uint16_t port_;
+    uint32_t worker_num_;
+    bool daemon_;
+    std::vector<int> cpus_;
+    bool incoming_cpu_;
+
+    std::vector<int> listeners_;
+    std::vector<pid_t> workers_;
+};
@@ -0,0 +1,57 @@
+#include "slab_allocator.h"
+
+#include <new>
+#include <vector>
+
+slab* slab::get(std::size_t size) {
+    /* never torn down, sessions may outlive the thread locals at exit */
+    static thread_local std::vector<slab*>* slabs = new std::vector<slab*>();
+
+    /* a handful of object sizes per worker, a scan is the cheapest lookup */
+    for (slab* s : *slabs) {
+        if (s->size_ == size) {
+            return s;
+        }
+    }
+
+    slabs->push_back(new slab(size));
+    return slabs->back();
+}
+
+slab::slab(std::size_t size) : size_(size), free_(nullptr) {}
+
+void* slab::allocate() {
+    if (this->free_ == nullptr) {
+        this->grow();
+    }
+
+    header* block = this->free_;
+    this->free_ = block->next;
+
+    return block + 1;
+}
+
+void slab::deallocate(void* p) {
+    header* block = static_cast<header*>(p) - 1;
+    slab* owner = block->owner;
+
+    block->next = owner->free_;
+    owner->free_ = block;
+}
+
+void slab::grow() {
+    /* whole headers, so the next block stays aligned */
+    std::size_t stride =
+        sizeof(header) +
+        (this->size_ + sizeof(header) - 1) / sizeof(header) * sizeof(header);
+    char* chunk = static_cast<char*>(
+        ::operator new(stride * blocks_per_chunk));
+
+    for (std::size_t i = 0; i < blocks_per_chunk; i++) {
+        header* block = reinterpret_cast<header*>(chunk + i * stride);
+
+        block->owner = this;
+        block->next = this->free_;
+        this->free_ = block;
+    }
+}
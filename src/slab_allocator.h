@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+ * Per-worker pool of equally sized blocks, cut from chunks that are never
+ * given back. Freed blocks are handed out again before a new chunk is cut,
+ * so a worker under connection churn keeps reusing the same memory instead
+ * of going through malloc and fragmenting the heap. Every block remembers
+ * its slab, it has to be freed on the worker that allocated it, or once
+ * that worker has stopped.
+ */
+class slab {
+public:
+    static constexpr std::size_t blocks_per_chunk = 32;
+
+    /* the calling worker's slab for blocks of size bytes */
+    static slab* get(std::size_t size);
+
+    void* allocate();
+
+    static void deallocate(void* p);
+
+private:
+    explicit slab(std::size_t size);
+
+    slab(const slab&) = delete;
+
+    slab& operator=(const slab&) = delete;
+
+    void grow();
+
+private:
+    /* in front of every block, keeps the block suitably aligned */
+    struct alignas(std::max_align_t) header {
+        slab* owner;
+        header* next;
+    };
+
+    std::size_t size_;
+    header* free_;
+};
+
+/* allocator for std::allocate_shared and the containers, backed by slabs */
+template <typename T>
+class slab_allocator {
+public:
+    using value_type = T;
+
+    slab_allocator() noexcept = default;
+
+    template <typename U>
+    slab_allocator(const slab_allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(slab::get(n * sizeof(T))->allocate());
+    }
+
+    void deallocate(T* p, std::size_t) noexcept { slab::deallocate(p); }
+
+    template <typename U>
+    bool operator==(const slab_allocator<U>&) const noexcept {
+        return true;
+    }
+};
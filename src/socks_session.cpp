@@ -1,15 +1,130 @@
 #include "socks_session.h"
 
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "offload_pool.h"
+#include "probes.h"
+
+namespace {
+
+/* per process, probes and traces of several workers tell them by pid */
+std::atomic<uint64_t> session_ids{0};
+
+/* datagrams of an association held while their names are resolved */
+constexpr std::size_t max_pending_datagrams = 64;
+
+/* what io_uring answers for an opcode or flag this kernel does not know */
+bool uring_unsupported(const asio::error_code &ec) {
+    return ec == asio::error::invalid_argument ||
+           ec == asio::error::operation_not_supported ||
+           ec == asio::error_code(ENOSYS, asio::error::get_system_category());
+}
+
+class splice_pipe {
+public:
+    static constexpr std::size_t chunk_size = 65536;
+
+    splice_pipe() {
+        if (::pipe2(this->fds_, O_NONBLOCK | O_CLOEXEC) < 0) {
+            this->fds_[0] = this->fds_[1] = -1;
+        }
+    }
+
+    ~splice_pipe() {
+        if (this->is_open()) {
+            ::close(this->fds_[0]);
+            ::close(this->fds_[1]);
+        }
+    }
+
+    splice_pipe(const splice_pipe &) = delete;
+
+    splice_pipe &operator=(const splice_pipe &) = delete;
+
+    inline bool is_open() const { return this->fds_[0] >= 0; }
+
+    inline int read_fd() const { return this->fds_[0]; }
+
+    inline int write_fd() const { return this->fds_[1]; }
+
+private:
+    int fds_[2];
+};
+
+}    // namespace
+
 socks_session::socks_session(asio::ip::tcp::socket socket)
     : socket_(std::move(socket)),
-      keep_alive_time_(socks_config::get()->keep_alive_time()),
-      keep_alive_timer_(socket_.get_executor()),
-      tcp_dst_socket_(socket_.get_executor()) {
-    this->keep_alive_timer_.expires_at(
-        std::chrono::steady_clock::time_point::max());
+      id_(session_ids.fetch_add(1, std::memory_order_relaxed) + 1),
+      config_(socks_config::snapshot()),
+      accept_time_(std::chrono::steady_clock::now()),
+      keep_alive_time_(config_->keep_alive_time()),
+      wheel_(timer_wheel::get(socket_.get_executor())),
+      admission_(nullptr),
+      handshaking_(false),
+      rejecting_(false),
+      handshake_begin_(0),
+      handshake_end_(0),
+      pending_reply_len_(0),
+      cmd_(access_log::no_command),
+      rep_(access_log::no_reply),
+      dst_atyp_(0),
+      dst_len_(0),
+      dst_port_(0),
+      bytes_client_to_remote_(0),
+      bytes_remote_to_client_(0),
+      upload_timer_(socket_.get_executor()),
+      download_timer_(socket_.get_executor()),
+      tcp_dst_socket_(socket_.get_executor()),
+      connector_(socket_.get_executor()),
+      udp_pending_num_(0),
+      uring_(nullptr) {
+    this->wheel_->set_callback(this->idle_entry_, [this] {
+        SOCKS_PROBE(expire, this->id_);
+        this->stop();
+    });
+
+    socks_metrics::get()->add(socks_metrics::counter::sessions_accepted);
+    socks_metrics::get()->add(socks_metrics::gauge::sessions_active, 1);
+}
+
+std::shared_ptr<socks_session> socks_session::create(
+    asio::ip::tcp::socket socket) {
+    return std::allocate_shared<socks_session>(slab_allocator<socks_session>(),
+                                               std::move(socket));
+}
+
+socks_session::~socks_session() {
+    if (!this->config_->access_log().empty()) {
+        this->log_access();
+    }
+
+    if (this->admission_ != nullptr) {
+        this->admission_->session_done(this->handshaking_);
+    }
+
+    if (this->rejecting_) {
+        admission_control::get(this->socket_.get_executor())->reject_done();
+    }
+
+    socks_metrics::get()->add(socks_metrics::gauge::sessions_active, -1);
 }
 
-socks_session::~socks_session() {}
+slab_session::slab_session(asio::ip::tcp::socket socket)
+    : socket_(std::move(socket)) {}
+
+void slab_session::start() {
+    /* asiomp has no hook for its workers, the first client arms the reload */
+    socks_config::reload_on_sighup(this->socket_.get_executor());
+
+    socks_session::create(std::move(this->socket_))->start();
+}
 
 void socks_session::start() {
     asio::error_code ec;
@@ -26,75 +141,279 @@ void socks_session::start() {
 
     this->flush_deadline();
 
-    asio::co_spawn(
-        this->socket_.get_executor(),
-        [self = getDerivedSharedPtr<socks_session>()] {
-            return self->handle_packet();
-        },
-        asio::detached);
+    /* shed before anything is set up for the session */
+    auto admission = admission_control::get(this->socket_.get_executor());
+    bool admitted = admission->admit();
+
+    SOCKS_PROBE(accept, this->id_, this->client_endpoint_.data(),
+                static_cast<int>(admitted));
+
+    if (!admitted) {
+        socks_metrics::get()->add(socks_metrics::counter::sessions_shed);
+
+        /* a storm must not pile up sessions, past the cap they just close */
+        if (!admission->reject_begin()) {
+            return;
+        }
+
+        this->rejecting_ = true;
+        /* one tick of the wheel for the whole exchange */
+        this->wheel_->expires_after(this->idle_entry_,
+                                    std::chrono::seconds(1));
+
+        asio::co_spawn(
+            this->socket_.get_executor(),
+            [self = getDerivedSharedPtr<socks_session>()] {
+                return self->reject_overloaded();
+            },
+            asio::detached);
+        return;
+    }
+
+    this->admission_ = admission;
+    this->handshaking_ = true;
+
+    if (this->config_->io_uring()) {
+        this->uring_ = uring_service::get(this->socket_.get_executor());
+    }
 
     asio::co_spawn(
         this->socket_.get_executor(),
         [self = getDerivedSharedPtr<socks_session>()] {
-            return self->handle_keep_alive();
+            return self->handle_packet();
         },
         asio::detached);
 }
 
 void socks_session::flush_deadline() {
-    this->deadline_ = std::chrono::steady_clock::now() +
-                      std::chrono::seconds(this->keep_alive_time_);
+    this->wheel_->expires_after(this->idle_entry_,
+                                std::chrono::seconds(this->keep_alive_time_));
+}
+
+void socks_session::end_handshake() {
+    if (this->handshaking_) {
+        this->handshaking_ = false;
+        this->admission_->handshake_done();
+    }
+}
+
+void socks_session::remember_request(
+    const coro_socks::client_request &request) {
+    this->cmd_ = request.cmd;
+    this->dst_atyp_ = request.atyp;
+    this->dst_port_ = request.dst_port;
+    this->dst_len_ = static_cast<uint8_t>(
+        std::min(request.dst_addr.size(), this->dst_addr_.size()));
+    std::memcpy(this->dst_addr_.data(), request.dst_addr.data(),
+                this->dst_len_);
+}
+
+void socks_session::log_access() const {
+    access_log *log = access_log::get();
+    access_log::record *r = log->reserve();
+    if (r == nullptr) {
+        return;
+    }
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - this->accept_time_);
+    auto start = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch() - duration);
+
+    r->start_us = start.count();
+    r->duration_us = static_cast<uint64_t>(duration.count());
+    r->bytes_client_to_remote = this->bytes_client_to_remote_;
+    r->bytes_remote_to_client = this->bytes_remote_to_client_;
+
+    auto address = this->client_endpoint_.address();
+    if (address.is_v4()) {
+        auto bytes = address.to_v4().to_bytes();
+        std::memcpy(r->client_addr, bytes.data(), bytes.size());
+        r->client_atyp = coro_socks::Atyp::IpV4;
+    } else {
+        auto bytes = address.to_v6().to_bytes();
+        std::memcpy(r->client_addr, bytes.data(), bytes.size());
+        r->client_atyp = coro_socks::Atyp::IpV6;
+    }
+    r->client_port = this->client_endpoint_.port();
+
+    r->cmd = this->cmd_;
+    r->rep = this->rep_;
+    r->dst_atyp = this->dst_atyp_;
+    r->dst_port = this->dst_port_;
+    r->dst_len = this->dst_len_;
+    std::memcpy(r->dst_addr, this->dst_addr_.data(), this->dst_len_);
+
+    r->user_len = static_cast<uint8_t>(
+        std::min<std::size_t>(this->username_.size(), sizeof(r->user)));
+    std::memcpy(r->user, this->username_.data(), r->user_len);
+
+    log->commit();
+}
+
+socks_metrics::counter socks_session::relay_bytes_counter(
+    const asio::ip::tcp::socket &src) const {
+    return &src == &this->socket_
+               ? socks_metrics::counter::bytes_client_to_remote
+               : socks_metrics::counter::bytes_remote_to_client;
+}
+
+uint64_t &socks_session::relay_bytes(const asio::ip::tcp::socket &src) {
+    return &src == &this->socket_ ? this->bytes_client_to_remote_
+                                  : this->bytes_remote_to_client_;
+}
+
+asio::steady_timer &socks_session::shape_timer(
+    const asio::ip::tcp::socket &src) {
+    return &src == &this->socket_ ? this->upload_timer_
+                                  : this->download_timer_;
+}
+
+asio::awaitable<std::size_t> socks_session::shape(asio::steady_timer &timer) {
+    asio::error_code ec;
+
+    for (;;) {
+        traffic_shaper::clock::duration delay;
+        traffic_shaper::scope limit;
+
+        std::size_t allowed = this->shaper_.allowance(
+            traffic_shaper::clock::now(), delay, limit);
+        if (allowed > 0) {
+            co_return allowed;
+        }
+
+        socks_metrics::get()->add(static_cast<socks_metrics::counter>(
+            static_cast<uint32_t>(socks_metrics::counter::throttled_session) +
+            static_cast<uint32_t>(limit)));
+
+        timer.expires_after(delay);
+        co_await timer.async_wait(
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec || !this->socket_.is_open()) {
+            co_return 0;
+        }
+    }
 }
 
 void socks_session::stop() {
     asio::error_code ignored_ec;
+
+    /* every relay direction stops the session, only the first is traced */
+    if (this->socket_.is_open()) {
+        SOCKS_PROBE(stop, this->id_, this->bytes_client_to_remote_,
+                    this->bytes_remote_to_client_);
+    }
+
+    /* io_uring requests pin the file, closing alone would not end them */
+    if (this->uring_ != nullptr) {
+        this->uring_->cancel(this->socket_.native_handle());
+        this->uring_->cancel(this->tcp_dst_socket_.native_handle());
+        if (this->udp_socket_) {
+            this->uring_->cancel(this->udp_socket_->native_handle());
+        }
+    }
+
     this->socket_.close(ignored_ec);
-    this->keep_alive_timer_.cancel(ignored_ec);
+    this->idle_entry_.cancel();
+    this->upload_timer_.cancel();
+    this->download_timer_.cancel();
+    this->connector_.cancel();
     this->tcp_dst_socket_.close(ignored_ec);
+    if (this->udp_socket_) {
+        this->udp_socket_->close(ignored_ec);
+    }
 }
 
-asio::awaitable<void> socks_session::handle_keep_alive() {
-    auto check_duration =
-        std::chrono::seconds(socks_config::get()->check_duration());
+template <typename Message>
+asio::awaitable<bool> socks_session::read_message(Message &msg) {
+    bool ret = co_await this->read_message(
+        msg,
+        std::span<char>(this->handshake_buf_.data(),
+                        this->handshake_buf_.size()),
+        this->handshake_begin_, this->handshake_end_);
 
-    while (this->socket_.is_open()) {
-        this->keep_alive_timer_.expires_after(check_duration);
+    co_return ret;
+}
 
-        co_await this->keep_alive_timer_.async_wait(asio::use_awaitable);
+template <typename Message>
+asio::awaitable<bool> socks_session::read_message(Message &msg,
+                                                  std::span<char> buf,
+                                                  std::size_t &begin,
+                                                  std::size_t &end) {
+    asio::error_code ec;
 
-        if (this->deadline_ <= std::chrono::steady_clock::now()) {
-            this->stop();
+    for (;;) {
+        std::size_t consumed = 0;
+        auto result = coro_socks::parse_message(
+            std::string_view(buf.data() + begin, end - begin), consumed, msg);
+
+        if (result == coro_socks::parse_result::complete) {
+            begin += consumed;
+            co_return true;
+        }
+
+        if (result == coro_socks::parse_result::invalid) {
+            co_return false;
+        }
+
+        /* the client may be waiting for our replies before it sends more */
+        if (this->pending_reply_len_ > 0) {
+            bool flushed = co_await this->flush_reply();
+            if (!flushed) {
+                co_return false;
+            }
+        }
+
+        if (begin > 0) {
+            std::memmove(buf.data(), buf.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+        }
+
+        if (end == buf.size()) {
+            co_return false;
+        }
+
+        std::size_t n = co_await this->socket_.async_read_some(
+            asio::buffer(buf.data() + end, buf.size() - end),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            co_return false;
         }
+
+        end += n;
     }
+}
 
-    co_return;
+void socks_session::queue_reply(uint8_t ver, uint8_t status) {
+    this->pending_reply_[this->pending_reply_len_++] = ver;
+    this->pending_reply_[this->pending_reply_len_++] = status;
 }
 
-asio::awaitable<void> socks_session::handle_packet() {
-    bool ret;
-    uint8_t ver;
-    uint8_t nmethods;
-    std::string methods;
-    uint8_t choose_method;
+asio::awaitable<bool> socks_session::flush_reply() {
+    asio::error_code ec;
 
-    ret = co_await this->read_byte(&ver);
-    if (!ret) {
-        this->stop();
-        co_return;
+    if (this->pending_reply_len_ == 0) {
+        co_return true;
     }
 
-    if (ver != coro_socks::Version::V5) {
-        this->stop();
-        co_return;
-    }
+    co_await asio::async_write(
+        this->socket_,
+        asio::buffer(this->pending_reply_.data(), this->pending_reply_len_),
+        asio::redirect_error(asio::use_awaitable, ec));
+    this->pending_reply_len_ = 0;
 
-    ret = co_await this->read_byte(&nmethods);
-    if (!ret) {
-        this->stop();
-        co_return;
-    }
+    co_return !ec;
+}
+
+asio::awaitable<void> socks_session::handle_packet() {
+    bool ret;
+    coro_socks::method_request request;
+    uint8_t choose_method;
+
+    this->handshake_buf_.acquire();
 
-    ret = co_await this->read_bytes_n(methods, nmethods);
+    ret = co_await this->read_message(request);
     if (!ret) {
         this->stop();
         co_return;
@@ -102,37 +421,37 @@ asio::awaitable<void> socks_session::handle_packet() {
 
     choose_method = coro_socks::Method::NoAcceptable;
 
-    for (uint8_t method : methods) {
+    for (uint8_t method : request.methods) {
         if (method == coro_socks::Method::NoAuth &&
-            !socks_config::get()->auth()) {
+            !this->config_->auth()) {
             choose_method = method;
         } else if (method == coro_socks::Method::UserPassWd &&
-                   socks_config::get()->auth()) {
+                   this->config_->auth()) {
             choose_method = method;
         }
     }
 
-    std::array<asio::const_buffer, 2> buf = {
-        {asio::buffer(&ver, 1), asio::buffer(&choose_method, 1)}};
+    SOCKS_PROBE(method, this->id_, choose_method);
 
-    asio::error_code ec;
-    co_await asio::async_write(this->socket_, buf,
-                               asio::redirect_error(asio::use_awaitable, ec));
-    if (ec) {
-        this->stop();
-        co_return;
-    }
+    /* replies are coalesced until we have to wait for the client again */
+    this->queue_reply(coro_socks::Version::V5, choose_method);
 
     switch (choose_method) {
         case coro_socks::Method::NoAuth: {
+            socks_metrics::get()->add(socks_metrics::counter::method_no_auth);
             co_await this->handle_client_request();
             break;
         }
         case coro_socks::Method::UserPassWd: {
+            socks_metrics::get()->add(
+                socks_metrics::counter::method_user_passwd);
             co_await this->handle_authentication();
             break;
         }
         default: {
+            socks_metrics::get()->add(
+                socks_metrics::counter::method_no_acceptable);
+            co_await this->flush_reply();
             this->stop();
             break;
         }
@@ -141,82 +460,130 @@ asio::awaitable<void> socks_session::handle_packet() {
     co_return;
 }
 
-asio::awaitable<void> socks_session::handle_authentication() {
+/*
+ * Only a client that may go without authentication is asked for its
+ * request, so it can be told GENERAL FAILURE, the others are refused at
+ * method selection without a password ever being checked.
+ */
+asio::awaitable<void> socks_session::reject_overloaded() {
     bool ret;
-    uint8_t ver;
-    uint8_t ulen;
-    std::string uname;
-    uint8_t plen;
-    std::string passwd;
-    uint8_t status;
-
-    ret = co_await this->read_byte(&ver);
+    coro_socks::method_request method_request;
+    coro_socks::client_request client_request;
+    /* a method request and a client request at their longest, no pool */
+    std::array<char, 520> buf;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+
+    ret = co_await this->read_message(method_request, buf, begin, end);
     if (!ret) {
         this->stop();
         co_return;
     }
 
-    if (ver != 0x01) {
+    bool no_auth = !this->config_->auth() &&
+                   std::find(method_request.methods.begin(),
+                             method_request.methods.end(),
+                             coro_socks::Method::NoAuth) !=
+                       method_request.methods.end();
+
+    if (!no_auth) {
+        this->queue_reply(coro_socks::Version::V5,
+                          coro_socks::Method::NoAcceptable);
+        co_await this->flush_reply();
         this->stop();
         co_return;
     }
 
-    ret = co_await this->read_byte(&ulen);
+    this->queue_reply(coro_socks::Version::V5, coro_socks::Method::NoAuth);
+
+    ret = co_await this->read_message(client_request, buf, begin, end);
     if (!ret) {
         this->stop();
         co_return;
     }
 
-    if (ulen == 0) {
-        this->stop();
-        co_return;
+    this->remember_request(client_request);
+
+    co_await this->reply_and_stop(coro_socks::ReplyRep::GenServFailed);
+
+    co_return;
+}
+
+asio::awaitable<std::optional<bool>> socks_session::check_auth(
+    const coro_socks::auth_request &request) {
+    if (!this->config_->auth()) {
+        co_return true;
     }
 
-    ret = co_await this->read_bytes_n(uname, ulen);
-    if (!ret) {
-        this->stop();
-        co_return;
+    const credential_store &credentials = this->config_->credentials();
+
+    if (credentials.remembered(request.uname, request.passwd)) {
+        co_return true;
     }
 
-    ret = co_await this->read_byte(&plen);
-    if (!ret) {
-        this->stop();
-        co_return;
+    /* the session keeps counting as a handshake meanwhile */
+    bool slot = co_await this->admission_->derivation_begin();
+    if (!slot) {
+        socks_metrics::get()->add(socks_metrics::counter::auth_unchecked);
+        co_return std::nullopt;
     }
 
-    if (plen == 0) {
+    /* named, gcc 12 frees a lambda temporary of a co_await twice */
+    auto derive = [config = this->config_,
+                   username = std::string(request.uname),
+                   password = std::string(request.passwd)] {
+        return config->credentials().derive(username, password);
+    };
+    bool ok = co_await offload_pool::get()->run(std::move(derive));
+
+    this->admission_->derivation_done();
+
+    if (ok) {
+        credentials.remember(request.uname, request.passwd);
+    }
+
+    co_return ok;
+}
+
+asio::awaitable<void> socks_session::handle_authentication() {
+    bool ret;
+    coro_socks::auth_request request;
+    uint8_t status;
+
+    ret = co_await this->read_message(request);
+    if (!ret) {
         this->stop();
         co_return;
     }
 
-    ret = co_await this->read_bytes_n(passwd, plen);
-    if (!ret) {
+    std::optional<bool> authenticated = co_await this->check_auth(request);
+    if (!authenticated) {
+        /* no status at all, a failure would call the password wrong */
         this->stop();
         co_return;
     }
 
-    if (socks_config::get()->check_auth(uname, passwd)) {
+    if (*authenticated) {
         status = coro_socks::ReplyAuthStatus::Success;
     } else {
         status = coro_socks::ReplyAuthStatus::Failure;
     }
 
-    std::array<asio::const_buffer, 2> buf = {
-        {asio::buffer(&ver, 1), asio::buffer(&status, 1)}};
+    SOCKS_PROBE(auth, this->id_, request.uname.data(), request.uname.size(),
+                static_cast<int>(status ==
+                                 coro_socks::ReplyAuthStatus::Success));
 
-    asio::error_code ec;
-    co_await asio::async_write(this->socket_, buf,
-                               asio::redirect_error(asio::use_awaitable, ec));
-    if (ec) {
-        this->stop();
-        co_return;
-    }
+    this->queue_reply(0x01, status);
 
     if (status == coro_socks::ReplyAuthStatus::Failure) {
+        socks_metrics::get()->add(socks_metrics::counter::auth_failures);
+        co_await this->flush_reply();
         this->stop();
         co_return;
     }
 
+    this->username_ = request.uname;
+
     co_await this->handle_client_request();
 
     co_return;
@@ -225,123 +592,113 @@ asio::awaitable<void> socks_session::handle_authentication() {
 asio::awaitable<void> socks_session::handle_client_request() {
     bool ret;
     asio::error_code ec;
-    uint8_t ver;
-    uint8_t cmd;
-    uint8_t rsv;
-    uint8_t atyp;
-    std::string dst_addr;
-    uint16_t dst_port;
+    coro_socks::client_request request;
 
-    ret = co_await this->read_byte(&ver);
+    ret = co_await this->read_message(request);
     if (!ret) {
         this->stop();
         co_return;
     }
 
-    if (ver != coro_socks::Version::V5) {
-        this->stop();
-        co_return;
-    }
+    socks_metrics::get()->observe(
+        socks_metrics::phase::handshake,
+        std::chrono::steady_clock::now() - this->accept_time_);
 
-    ret = co_await this->read_byte(&cmd);
-    if (!ret) {
-        this->stop();
-        co_return;
-    }
+    this->remember_request(request);
 
-    ret = co_await this->read_byte(&rsv);
-    if (!ret) {
-        this->stop();
-        co_return;
-    }
+    SOCKS_PROBE(request, this->id_, request.cmd, request.atyp,
+                request.dst_addr.data(), request.dst_addr.size(),
+                request.dst_port);
 
-    if (rsv != 0x00) {
-        this->stop();
-        co_return;
-    }
+    uint8_t cmd = request.cmd;
+    uint8_t atyp = request.atyp;
+    std::string_view dst_addr = request.dst_addr;
+    uint16_t dst_port = request.dst_port;
 
-    ret = co_await this->read_byte(&atyp);
-    if (!ret) {
-        this->stop();
-        co_return;
-    }
+    switch (cmd) {
+        case coro_socks::RequestCmd::Connect: {
+            bool connect_success = false;
+            uint8_t connect_rep = coro_socks::ReplyRep::ConnRefused;
+            std::chrono::steady_clock::time_point connect_start;
+            int upstream = -1;
 
-    if (atyp == coro_socks::Atyp::IpV4) {
-        ret = co_await this->read_bytes_n(dst_addr, 4);
-        if (!ret) {
-            this->stop();
-            co_return;
-        }
-    } else if (atyp == coro_socks::Atyp::IpV6) {
-        ret = co_await this->read_bytes_n(dst_addr, 16);
-        if (!ret) {
-            this->stop();
-            co_return;
-        }
-    } else if (atyp == coro_socks::Atyp::DomainName) {
-        /* this rsv use to domain length */
-        ret = co_await this->read_byte(&rsv);
-        if (!ret) {
-            this->stop();
-            co_return;
-        }
+            socks_metrics::get()->add(socks_metrics::counter::command_connect);
 
-        if (rsv == 0) {
-            this->stop();
-            co_return;
-        }
+            if (!this->config_->upstreams().empty()) {
+                upstream = this->config_->route(
+                    atyp == coro_socks::Atyp::DomainName
+                        ? std::string(dst_addr)
+                        : coro_socks::format_address(dst_addr, atyp));
+            }
 
-        ret = co_await this->read_bytes_n(dst_addr, rsv);
-        if (!ret) {
-            this->stop();
-            co_return;
-        }
-    } else {
-        this->stop();
-        co_return;
-    }
+            if (upstream >= 0) {
+                /*the upstream resolves names itself*/
+                connect_start = std::chrono::steady_clock::now();
+                SOCKS_PROBE(connect_start, this->id_, upstream);
+                connect_rep = co_await this->connect_upstream(
+                    upstream, atyp, dst_addr, dst_port);
+                connect_success =
+                    connect_rep == coro_socks::ReplyRep::Succeeded;
+
+            } else if (this->config_->optimistic_connect()) {
+                std::vector<asio::ip::address> addresses;
+
+                if (atyp == coro_socks::Atyp::DomainName) {
+                    auto resolve_start = std::chrono::steady_clock::now();
+                    SOCKS_PROBE(resolve_start, this->id_, dst_addr.data(),
+                                dst_addr.size());
+                    auto resolved = co_await dns_cache::get()->resolve(
+                        this->socket_.get_executor(), dst_addr, ec);
+                    SOCKS_PROBE(resolve_end, this->id_, ec.value());
+                    socks_metrics::get()->observe(
+                        socks_metrics::phase::resolve,
+                        std::chrono::steady_clock::now() - resolve_start);
+
+                    if (ec) {
+                        this->stop();
+                        co_return;
+                    }
 
-    ret = co_await this->read_port(&dst_port);
-    if (!ret) {
-        this->stop();
-        co_return;
-    }
+                    addresses = *resolved;
+                } else {
+                    addresses.push_back(
+                        coro_socks::make_address(dst_addr, atyp));
+                }
 
-    switch (cmd) {
-        case coro_socks::RequestCmd::Connect: {
-            bool connect_success = false;
+                co_await this->connect_optimistic(addresses, dst_port);
+                co_return;
 
-            if (atyp == coro_socks::Atyp::DomainName) {
-                asio::ip::tcp::resolver resolver(this->socket_.get_executor());
-                auto endpoints = co_await resolver.async_resolve(
-                    dst_addr, std::to_string(dst_port),
-                    asio::redirect_error(asio::use_awaitable, ec));
+            } else if (atyp == coro_socks::Atyp::DomainName) {
+                auto resolve_start = std::chrono::steady_clock::now();
+                SOCKS_PROBE(resolve_start, this->id_, dst_addr.data(),
+                            dst_addr.size());
+                auto addresses = co_await dns_cache::get()->resolve(
+                    this->socket_.get_executor(), dst_addr, ec);
+                SOCKS_PROBE(resolve_end, this->id_, ec.value());
+                socks_metrics::get()->observe(
+                    socks_metrics::phase::resolve,
+                    std::chrono::steady_clock::now() - resolve_start);
 
                 if (ec) {
                     this->stop();
                     co_return;
                 }
 
-                /*try to connect one endpoint from all endpoints*/
-                for (auto &&endpoint : endpoints) {
-                    co_await this->tcp_dst_socket_.async_connect(
-                        endpoint,
-                        asio::redirect_error(asio::use_awaitable, ec));
-                    if (!ec) {
-                        connect_success = true;
-                        break;
-                    }
+                /*race the endpoints, the first to connect is kept*/
+                connect_start = std::chrono::steady_clock::now();
+                SOCKS_PROBE(connect_start, this->id_, upstream);
+                co_await this->connector_.async_connect(
+                    this->tcp_dst_socket_, *addresses, dst_port, ec);
+                if (!ec) {
+                    connect_success = true;
                 }
 
             } else {
-                auto addr = asio::ip::make_address(
-                    coro_socks::format_address(dst_addr, atyp), ec);
-                if (ec) {
-                    this->stop();
-                    co_return;
-                }
+                auto addr = coro_socks::make_address(dst_addr, atyp);
 
                 /*connect to the dst host*/
+                connect_start = std::chrono::steady_clock::now();
+                SOCKS_PROBE(connect_start, this->id_, upstream);
                 co_await this->tcp_dst_socket_.async_connect(
                     asio::ip::tcp::endpoint(addr, dst_port),
                     asio::redirect_error(asio::use_awaitable, ec));
@@ -350,47 +707,64 @@ asio::awaitable<void> socks_session::handle_client_request() {
                 }
             }
 
+            SOCKS_PROBE(connect_end, this->id_,
+                        static_cast<int>(connect_success), ec.value());
+
             if (!connect_success) {
-                co_await this->reply_and_stop(
-                    coro_socks::ReplyRep::ConnRefused);
+                co_await this->reply_and_stop(connect_rep);
                 co_return;
             }
 
+            this->connected_time_ = std::chrono::steady_clock::now();
+            socks_metrics::get()->observe(
+                socks_metrics::histogram::upstream_connect,
+                this->connected_time_ - connect_start);
+            socks_metrics::get()->observe(
+                socks_metrics::phase::connect,
+                this->connected_time_ - connect_start);
+
             co_await this->handle_connect();
 
             break;
         }
         case coro_socks::RequestCmd::UdpAssociate: {
+            socks_metrics::get()->add(
+                socks_metrics::counter::command_udp_associate);
+
             if (atyp == coro_socks::Atyp::DomainName) {
-                asio::ip::udp::resolver resolver(this->socket_.get_executor());
-                auto endpoints = co_await resolver.async_resolve(
-                    dst_addr, std::to_string(dst_port),
-                    asio::redirect_error(asio::use_awaitable, ec));
+                auto resolve_start = std::chrono::steady_clock::now();
+                SOCKS_PROBE(resolve_start, this->id_, dst_addr.data(),
+                            dst_addr.size());
+                auto addresses = co_await dns_cache::get()->resolve(
+                    this->socket_.get_executor(), dst_addr, ec);
+                SOCKS_PROBE(resolve_end, this->id_, ec.value());
+                socks_metrics::get()->observe(
+                    socks_metrics::phase::resolve,
+                    std::chrono::steady_clock::now() - resolve_start);
 
-                if (endpoints.empty()) {
+                if (ec) {
                     co_await this->reply_and_stop(
                         coro_socks::ReplyRep::HostUnreachable);
                     co_return;
                 }
 
-                this->udp_endpoints_ = std::vector<asio::ip::udp::endpoint>(
-                    endpoints.begin(), endpoints.end());
+                for (auto &&address : *addresses) {
+                    this->udp_endpoints_.emplace_back(address, dst_port);
+                }
             } else {
-                auto addr = asio::ip::make_address(
-                    coro_socks::format_address(dst_addr, atyp), ec);
-                if (ec) {
-                    this->stop();
-                    co_return;
-                }
-
-                this->udp_endpoints_.emplace_back(addr, dst_port);
+                this->udp_endpoints_.emplace_back(
+                    coro_socks::make_address(dst_addr, atyp), dst_port);
             }
 
+            this->handshake_buf_.release();
+
             co_await this->handle_udp_associate();
 
             break;
         }
         default: {
+            socks_metrics::get()->add(
+                socks_metrics::counter::command_unsupported);
             co_await this->reply_and_stop(
                 coro_socks::ReplyRep::CommandNotSupported);
             break;
@@ -400,14 +774,83 @@ asio::awaitable<void> socks_session::handle_client_request() {
     co_return;
 }
 
+asio::awaitable<uint8_t> socks_session::connect_upstream(
+    std::size_t upstream, uint8_t atyp, std::string_view dst_addr,
+    uint16_t dst_port) {
+    asio::error_code ec;
+
+    auto pool = upstream_pool::get(this->socket_.get_executor(),
+                                   this->config_->upstreams()[upstream]);
+
+    co_await pool->acquire(this->tcp_dst_socket_, ec);
+    if (ec) {
+        SPDLOG_DEBUG("failed to reach upstream {}: {}", upstream,
+                     ec.message());
+        co_return coro_socks::ReplyRep::GenServFailed;
+    }
+
+    /* the connection is past negotiation, the request goes out at once */
+    uint8_t header[4] = {coro_socks::Version::V5,
+                         coro_socks::RequestCmd::Connect, 0x00, atyp};
+    uint8_t len = static_cast<uint8_t>(dst_addr.size());
+    uint16_t port = asio::detail::socket_ops::host_to_network_short(dst_port);
+
+    std::array<asio::const_buffer, 4> request = {
+        {asio::buffer(header),
+         asio::buffer(&len, atyp == coro_socks::Atyp::DomainName ? 1 : 0),
+         asio::buffer(dst_addr.data(), dst_addr.size()),
+         asio::buffer(&port, 2)}};
+
+    co_await asio::async_write(this->tcp_dst_socket_, request,
+                               asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return coro_socks::ReplyRep::GenServFailed;
+    }
+
+    /*
+     * Read exactly the reply, the destination may already be sending
+     * behind it. The first address byte tells the length of a name.
+     */
+    std::array<uint8_t, 5 + 255 + 2> reply;
+
+    co_await asio::async_read(this->tcp_dst_socket_,
+                              asio::buffer(reply.data(), 5),
+                              asio::redirect_error(asio::use_awaitable, ec));
+    if (ec || reply[0] != coro_socks::Version::V5) {
+        co_return coro_socks::ReplyRep::GenServFailed;
+    }
+
+    std::size_t rest;
+    switch (reply[3]) {
+        case coro_socks::Atyp::IpV4: {
+            rest = 4 - 1 + 2;
+            break;
+        }
+        case coro_socks::Atyp::IpV6: {
+            rest = 16 - 1 + 2;
+            break;
+        }
+        case coro_socks::Atyp::DomainName: {
+            rest = reply[4] + 2;
+            break;
+        }
+        default: {
+            co_return coro_socks::ReplyRep::GenServFailed;
+        }
+    }
+
+    co_await asio::async_read(this->tcp_dst_socket_,
+                              asio::buffer(reply.data() + 5, rest),
+                              asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return coro_socks::ReplyRep::GenServFailed;
+    }
+
+    co_return reply[1];
+}
+
 asio::awaitable<void> socks_session::handle_connect() {
     asio::error_code ec;
-    uint8_t ver = coro_socks::Version::V5;
-    uint8_t rep = coro_socks::ReplyRep::Succeeded;
-    uint8_t rsv = 0x00;
-    uint8_t atyp;
-    std::string bnd_addr;
-    uint16_t bnd_port;
 
     auto tcp_bnd_endpoint = this->tcp_dst_socket_.local_endpoint(ec);
     if (ec) {
@@ -415,6 +858,26 @@ asio::awaitable<void> socks_session::handle_connect() {
         co_return;
     }
 
+    bool replied = co_await this->reply_connected(tcp_bnd_endpoint, false);
+    if (!replied) {
+        co_return;
+    }
+
+    co_await this->start_relay();
+
+    co_return;
+}
+
+asio::awaitable<bool> socks_session::reply_connected(
+    const asio::ip::tcp::endpoint &tcp_bnd_endpoint, bool optimistic) {
+    asio::error_code ec;
+    uint8_t ver = coro_socks::Version::V5;
+    uint8_t rep = coro_socks::ReplyRep::Succeeded;
+    uint8_t rsv = 0x00;
+    uint8_t atyp;
+    std::string bnd_addr;
+    uint16_t bnd_port;
+
     if (tcp_bnd_endpoint.address().is_v4()) {
         atyp = coro_socks::Atyp::IpV4;
         auto &&addr_bytes = tcp_bnd_endpoint.address().to_v4().to_bytes();
@@ -428,19 +891,207 @@ asio::awaitable<void> socks_session::handle_connect() {
     bnd_port = asio::detail::socket_ops::host_to_network_short(
         tcp_bnd_endpoint.port());
 
-    std::array<asio::const_buffer, 6> buf = {
-        {asio::buffer(&ver, 1), asio::buffer(&rep, 1), asio::buffer(&rsv, 1),
+    std::array<asio::const_buffer, 7> buf = {
+        {asio::buffer(this->pending_reply_.data(), this->pending_reply_len_),
+         asio::buffer(&ver, 1), asio::buffer(&rep, 1), asio::buffer(&rsv, 1),
          asio::buffer(&atyp, 1),
          asio::buffer(bnd_addr.data(), bnd_addr.length()),
          asio::buffer(&bnd_port, 2)}};
 
     co_await asio::async_write(this->socket_, buf,
                                asio::redirect_error(asio::use_awaitable, ec));
+    this->pending_reply_len_ = 0;
+    if (ec) {
+        this->stop();
+        co_return false;
+    }
+
+    /* an optimistic reply is recorded once the connect has an outcome */
+    if (!optimistic) {
+        this->rep_ = rep;
+        socks_metrics::get()->reply(rep);
+    }
+    socks_metrics::get()->observe(
+        socks_metrics::histogram::handshake,
+        std::chrono::steady_clock::now() - this->accept_time_);
+    this->end_handshake();
+
+    co_return true;
+}
+
+/*
+ * Answers before the remote is connected. What the client sends meanwhile
+ * waits in the handshake buffer and the socket until the connect is done,
+ * with Fast Open the first flight rides in the SYN.
+ */
+asio::awaitable<void> socks_session::connect_optimistic(
+    const std::vector<asio::ip::address> &addresses, uint16_t dst_port) {
+    asio::error_code ec;
+    bool fast_open = false;
+
+    /* the bound address is not known yet, it is answered as zeros */
+    bool replied = co_await this->reply_connected(
+        asio::ip::tcp::endpoint(asio::ip::address_v4::any(), 0), true);
+    if (!replied) {
+        co_return;
+    }
+
+    auto connect_start = std::chrono::steady_clock::now();
+    SOCKS_PROBE(connect_start, this->id_, -1);
+
+    if (this->config_->tcp_fast_open()) {
+        co_await this->read_first_flight();
+
+        /* Fast Open takes one address, so no racing the others */
+        if (this->handshake_end_ > this->handshake_begin_) {
+            fast_open = co_await this->connect_fast_open(
+                asio::ip::tcp::endpoint(addresses.front(), dst_port), ec);
+        }
+    }
+
+    if (!fast_open && addresses.size() == 1) {
+        co_await this->tcp_dst_socket_.async_connect(
+            asio::ip::tcp::endpoint(addresses.front(), dst_port),
+            asio::redirect_error(asio::use_awaitable, ec));
+    } else if (!fast_open) {
+        co_await this->connector_.async_connect(
+            this->tcp_dst_socket_, addresses, dst_port, ec);
+    }
+
+    SOCKS_PROBE(connect_end, this->id_, static_cast<int>(!ec), ec.value());
+
     if (ec) {
+        /* too late for a reply, closing is all the client can be told */
+        this->rep_ = coro_socks::ReplyRep::ConnRefused;
+        socks_metrics::get()->reply(this->rep_);
+        socks_metrics::get()->add(
+            socks_metrics::counter::optimistic_connect_failures);
         this->stop();
         co_return;
     }
 
+    this->rep_ = coro_socks::ReplyRep::Succeeded;
+    socks_metrics::get()->reply(this->rep_);
+
+    this->connected_time_ = std::chrono::steady_clock::now();
+    socks_metrics::get()->observe(socks_metrics::histogram::upstream_connect,
+                                  this->connected_time_ - connect_start);
+    socks_metrics::get()->observe(socks_metrics::phase::connect,
+                                  this->connected_time_ - connect_start);
+
+    co_await this->start_relay();
+
+    co_return;
+}
+
+asio::awaitable<void> socks_session::read_first_flight() {
+    asio::error_code ec;
+
+    /* pipelined behind the request already */
+    if (this->handshake_end_ > this->handshake_begin_) {
+        co_return;
+    }
+
+    asio::steady_timer timer(this->socket_.get_executor());
+    auto waiting = std::make_shared<bool>(true);
+
+    timer.expires_after(
+        std::chrono::milliseconds(this->config_->fast_open_wait()));
+    timer.async_wait([this, waiting](const asio::error_code &ec) {
+        asio::error_code ignored_ec;
+
+        /* a client that expects the server to speak first says nothing */
+        if (!ec && *waiting) {
+            this->socket_.cancel(ignored_ec);
+        }
+    });
+
+    co_await this->socket_.async_wait(
+        asio::ip::tcp::socket::wait_read,
+        asio::redirect_error(asio::use_awaitable, ec));
+    *waiting = false;
+    timer.cancel();
+    if (ec) {
+        co_return;
+    }
+
+    std::size_t n = this->socket_.read_some(
+        asio::buffer(this->handshake_buf_.data() + this->handshake_end_,
+                     this->handshake_buf_.size() - this->handshake_end_),
+        ec);
+    if (!ec) {
+        this->handshake_end_ += n;
+    }
+
+    co_return;
+}
+
+asio::awaitable<bool> socks_session::connect_fast_open(
+    const asio::ip::tcp::endpoint &endpoint, asio::error_code &ec) {
+    this->tcp_dst_socket_.open(endpoint.protocol(), ec);
+    if (!ec) {
+        this->tcp_dst_socket_.native_non_blocking(true, ec);
+    }
+    if (ec) {
+        co_return false;
+    }
+
+    ssize_t n = ::sendto(
+        this->tcp_dst_socket_.native_handle(),
+        this->handshake_buf_.data() + this->handshake_begin_,
+        this->handshake_end_ - this->handshake_begin_,
+        MSG_FASTOPEN | MSG_NOSIGNAL, endpoint.data(), endpoint.size());
+
+    /* disabled by net.ipv4.tcp_fastopen, a plain connect will do */
+    if (n < 0 && errno != EINPROGRESS) {
+        co_return false;
+    }
+
+    /* without a cookie the SYN only asks for one, the data follows later */
+    if (n > 0) {
+        this->handshake_begin_ += n;
+        socks_metrics::get()->add(socks_metrics::counter::fast_open_data);
+    } else {
+        socks_metrics::get()->add(socks_metrics::counter::fast_open_fallback);
+    }
+
+    co_await this->tcp_dst_socket_.async_wait(
+        asio::ip::tcp::socket::wait_write,
+        asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return true;
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (::getsockopt(this->tcp_dst_socket_.native_handle(), SOL_SOCKET,
+                     SO_ERROR, &error, &len) < 0) {
+        error = errno;
+    }
+    ec = asio::error_code(error, asio::system_category());
+
+    co_return true;
+}
+
+asio::awaitable<void> socks_session::start_relay() {
+    asio::error_code ec;
+
+    /* data the client pipelined behind its request */
+    if (this->handshake_end_ > this->handshake_begin_) {
+        co_await asio::async_write(
+            this->tcp_dst_socket_,
+            asio::buffer(this->handshake_buf_.data() + this->handshake_begin_,
+                         this->handshake_end_ - this->handshake_begin_),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            this->stop();
+            co_return;
+        }
+    }
+
+    this->handshake_buf_.release();
+    this->shaper_.configure(*this->config_, this->username_);
+
     asio::co_spawn(
         this->socket_.get_executor(),
         [self = getDerivedSharedPtr<socks_session>()] {
@@ -459,55 +1110,390 @@ asio::awaitable<void> socks_session::handle_connect() {
 }
 
 asio::awaitable<void> socks_session::handle_connect_cli_to_dst() {
+    if (this->config_->splice()) {
+        bool spliced = co_await this->handle_connect_splice(
+            this->socket_, this->tcp_dst_socket_);
+        if (spliced) {
+            co_return;
+        }
+    }
+
+    if (this->uring_ != nullptr) {
+        bool done = co_await this->handle_connect_uring(
+            this->socket_, this->tcp_dst_socket_);
+        if (done) {
+            co_return;
+        }
+    }
+
+    co_await this->handle_connect_copy(this->socket_, this->tcp_dst_socket_);
+
+    co_return;
+}
+
+asio::awaitable<void> socks_session::handle_connect_dst_to_cli() {
+    if (this->config_->splice()) {
+        bool spliced = co_await this->handle_connect_splice(
+            this->tcp_dst_socket_, this->socket_);
+        if (spliced) {
+            co_return;
+        }
+    }
+
+    if (this->uring_ != nullptr) {
+        bool done = co_await this->handle_connect_uring(
+            this->tcp_dst_socket_, this->socket_);
+        if (done) {
+            co_return;
+        }
+    }
+
+    co_await this->handle_connect_copy(this->tcp_dst_socket_, this->socket_);
+
+    co_return;
+}
+
+asio::awaitable<void> socks_session::handle_connect_copy(
+    asio::ip::tcp::socket &src, asio::ip::tcp::socket &dst) {
     asio::error_code ec;
-    char data[1024];
+    relay_buffer buf;
+    auto bytes = this->relay_bytes_counter(src);
+    auto &relayed = this->relay_bytes(src);
+    bool first_byte = &src == &this->tcp_dst_socket_;
+    auto &timer = this->shape_timer(src);
 
     for (;;) {
+        std::size_t allowed = SIZE_MAX;
+
+        /* a limited flow is held back before it reads, never dropped */
+        if (this->shaper_.enabled()) {
+            allowed = co_await this->shape(timer);
+            if (allowed == 0) {
+                this->stop();
+                co_return;
+            }
+        }
+
         this->flush_deadline();
 
-        std::size_t n = co_await this->socket_.async_read_some(
-            asio::buffer(data), asio::redirect_error(asio::use_awaitable, ec));
+        /* an idle flow holds no buffer while it waits for data */
+        if (buf.empty()) {
+            co_await src.async_wait(
+                asio::ip::tcp::socket::wait_read,
+                asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                this->stop();
+                co_return;
+            }
+
+            buf.acquire();
+        }
+
+        std::size_t n = co_await src.async_read_some(
+            asio::buffer(buf.data(), std::min(buf.size(), allowed)),
+            asio::redirect_error(asio::use_awaitable, ec));
         if (ec) {
             this->stop();
             co_return;
         }
 
+        if (first_byte) {
+            first_byte = false;
+            socks_metrics::get()->observe(
+                socks_metrics::phase::first_byte,
+                std::chrono::steady_clock::now() - this->connected_time_);
+        }
+
         co_await asio::async_write(
-            this->tcp_dst_socket_, asio::buffer(data, n),
+            dst, asio::buffer(buf.data(), n),
             asio::redirect_error(asio::use_awaitable, ec));
         if (ec) {
             this->stop();
             co_return;
         }
+
+        socks_metrics::get()->add(bytes, n);
+        relayed += n;
+        SOCKS_PROBE(relay, this->id_, static_cast<int>(&src != &this->socket_),
+                    n);
+        this->shaper_.consume(n);
+        buf.feedback(n);
     }
 
     co_return;
 }
 
-asio::awaitable<void> socks_session::handle_connect_dst_to_cli() {
+/*
+ * Move bytes src -> pipe -> dst with splice(2), so the payload never leaves
+ * the kernel. Readiness is still driven by the asio reactor. Returns false
+ * when splice is unavailable before any byte was moved, in which case the
+ * caller falls back to the copy loop.
+ */
+asio::awaitable<bool> socks_session::handle_connect_splice(
+    asio::ip::tcp::socket &src, asio::ip::tcp::socket &dst) {
     asio::error_code ec;
-    char data[1024];
+    splice_pipe pipe;
+    bool moved = false;
+    auto bytes = this->relay_bytes_counter(src);
+    auto &relayed = this->relay_bytes(src);
+    bool first_byte = &src == &this->tcp_dst_socket_;
+    auto &timer = this->shape_timer(src);
+
+    if (!pipe.is_open()) {
+        co_return false;
+    }
+
+    src.native_non_blocking(true, ec);
+    if (ec) {
+        co_return false;
+    }
+
+    dst.native_non_blocking(true, ec);
+    if (ec) {
+        co_return false;
+    }
 
     for (;;) {
+        std::size_t allowed = splice_pipe::chunk_size;
+
+        if (this->shaper_.enabled()) {
+            allowed = std::min(allowed, co_await this->shape(timer));
+            if (allowed == 0) {
+                this->stop();
+                co_return true;
+            }
+        }
+
         this->flush_deadline();
 
-        std::size_t n = co_await this->tcp_dst_socket_.async_read_some(
-            asio::buffer(data), asio::redirect_error(asio::use_awaitable, ec));
-        if (ec) {
+        ssize_t n = ::splice(src.native_handle(), nullptr, pipe.write_fd(),
+                             nullptr, allowed,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
             this->stop();
-            co_return;
+            co_return true;
         }
 
-        co_await asio::async_write(
-            this->socket_, asio::buffer(data, n),
-            asio::redirect_error(asio::use_awaitable, ec));
-        if (ec) {
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                co_await src.async_wait(
+                    asio::ip::tcp::socket::wait_read,
+                    asio::redirect_error(asio::use_awaitable, ec));
+                if (ec) {
+                    this->stop();
+                    co_return true;
+                }
+                continue;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (!moved && (errno == EINVAL || errno == ENOSYS)) {
+                co_return false;
+            }
+
             this->stop();
-            co_return;
+            co_return true;
+        }
+
+        moved = true;
+
+        if (first_byte) {
+            first_byte = false;
+            socks_metrics::get()->observe(
+                socks_metrics::phase::first_byte,
+                std::chrono::steady_clock::now() - this->connected_time_);
+        }
+
+        socks_metrics::get()->add(bytes, static_cast<uint64_t>(n));
+        relayed += static_cast<uint64_t>(n);
+        SOCKS_PROBE(relay, this->id_, static_cast<int>(&src != &this->socket_),
+                    n);
+        this->shaper_.consume(static_cast<std::size_t>(n));
+
+        /* drain the pipe completely before reading more from src */
+        while (n > 0) {
+            ssize_t m = ::splice(pipe.read_fd(), nullptr, dst.native_handle(),
+                                 nullptr, static_cast<std::size_t>(n),
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (m > 0) {
+                n -= m;
+                continue;
+            }
+
+            if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await dst.async_wait(
+                    asio::ip::tcp::socket::wait_write,
+                    asio::redirect_error(asio::use_awaitable, ec));
+                if (ec) {
+                    this->stop();
+                    co_return true;
+                }
+                continue;
+            }
+
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+
+            this->stop();
+            co_return true;
         }
     }
 
-    co_return;
+    co_return true;
+}
+
+/*
+ * Relay through the worker's io_uring. Reads go into a registered buffer
+ * when one is free, the buffer is handed back whenever src is drained so
+ * that idle flows hold no slot.
+ */
+asio::awaitable<bool> socks_session::handle_connect_uring(
+    asio::ip::tcp::socket &src, asio::ip::tcp::socket &dst) {
+    asio::error_code ec;
+    uring_service *ring = this->uring_;
+    int src_fd = src.native_handle();
+    int dst_fd = dst.native_handle();
+    relay_buffer buf;
+    char *fixed_data = nullptr;
+    int fixed = -1;
+    bool moved = false;
+    auto bytes = this->relay_bytes_counter(src);
+    auto &relayed = this->relay_bytes(src);
+    bool first_byte = &src == &this->tcp_dst_socket_;
+    auto &timer = this->shape_timer(src);
+
+    for (;;) {
+        std::size_t allowed = SIZE_MAX;
+
+        if (this->shaper_.enabled()) {
+            allowed = co_await this->shape(timer);
+            if (allowed == 0) {
+                break;
+            }
+        }
+
+        this->flush_deadline();
+
+        if (fixed < 0 && buf.empty()) {
+            co_await ring->async_poll(
+                src_fd, POLLIN, asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                break;
+            }
+
+            fixed = ring->fixed_buffers() ? ring->acquire_fixed(&fixed_data)
+                                          : -1;
+            if (fixed < 0) {
+                buf.acquire();
+            }
+        }
+
+        char *data = fixed >= 0 ? fixed_data : buf.data();
+        std::size_t size = std::min(
+            fixed >= 0 ? uring_service::fixed_buffer_size : buf.size(),
+            allowed);
+
+        std::size_t n;
+        if (fixed >= 0) {
+            n = co_await ring->async_read_fixed(
+                src_fd, data, size, fixed,
+                asio::redirect_error(asio::use_awaitable, ec));
+        } else {
+            n = co_await ring->async_recv(
+                src_fd, data, size,
+                asio::redirect_error(asio::use_awaitable, ec));
+        }
+
+        if (ec == asio::error::would_block) {
+            co_await ring->async_poll(
+                src_fd, POLLIN, asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                break;
+            }
+            continue;
+        }
+
+        if (ec || n == 0) {
+            break;
+        }
+
+        moved = true;
+
+        if (first_byte) {
+            first_byte = false;
+            socks_metrics::get()->observe(
+                socks_metrics::phase::first_byte,
+                std::chrono::steady_clock::now() - this->connected_time_);
+        }
+
+        std::size_t offset = 0;
+        while (offset < n) {
+            std::size_t m;
+            if (fixed >= 0) {
+                m = co_await ring->async_write_fixed(
+                    dst_fd, data + offset, n - offset, fixed,
+                    asio::redirect_error(asio::use_awaitable, ec));
+            } else {
+                m = co_await ring->async_send(
+                    dst_fd, data + offset, n - offset,
+                    asio::redirect_error(asio::use_awaitable, ec));
+            }
+
+            if (ec == asio::error::would_block) {
+                co_await ring->async_poll(
+                    dst_fd, POLLOUT,
+                    asio::redirect_error(asio::use_awaitable, ec));
+                if (ec) {
+                    break;
+                }
+                continue;
+            }
+
+            if (ec) {
+                break;
+            }
+
+            offset += m;
+        }
+
+        if (ec) {
+            break;
+        }
+
+        socks_metrics::get()->add(bytes, n);
+        relayed += n;
+        SOCKS_PROBE(relay, this->id_, static_cast<int>(&src != &this->socket_),
+                    n);
+        this->shaper_.consume(n);
+
+        if (fixed >= 0) {
+            if (n < size) {
+                ring->release_fixed(fixed);
+                fixed = -1;
+            }
+        } else {
+            buf.feedback(n);
+        }
+    }
+
+    if (fixed >= 0) {
+        ring->release_fixed(fixed);
+    }
+
+    /* the kernel lacks an operation and nothing was read yet, the socket
+     * path can still take the whole flow */
+    if (!moved && uring_unsupported(ec)) {
+        socks_metrics::get()->add(socks_metrics::counter::uring_fallbacks);
+        co_return false;
+    }
+
+    this->stop();
+
+    co_return true;
 }
 
 asio::awaitable<void> socks_session::handle_udp_associate() {
@@ -539,6 +1525,11 @@ asio::awaitable<void> socks_session::handle_udp_associate() {
         co_return;
     }
 
+    if (this->uring_ != nullptr) {
+        this->udp_receiver_ = std::make_unique<uring_datagram_receiver>(
+            this->uring_, this->udp_socket_->native_handle());
+    }
+
     if (this->udp_bnd_endpoint_.address().is_v4()) {
         auto &&addr_bytes =
             this->udp_bnd_endpoint_.address().to_v4().to_bytes();
@@ -552,19 +1543,28 @@ asio::awaitable<void> socks_session::handle_udp_associate() {
     bnd_port = asio::detail::socket_ops::host_to_network_short(
         this->udp_bnd_endpoint_.port());
 
-    std::array<asio::const_buffer, 6> buf = {
-        {asio::buffer(&ver, 1), asio::buffer(&rep, 1), asio::buffer(&rsv, 1),
+    std::array<asio::const_buffer, 7> buf = {
+        {asio::buffer(this->pending_reply_.data(), this->pending_reply_len_),
+         asio::buffer(&ver, 1), asio::buffer(&rep, 1), asio::buffer(&rsv, 1),
          asio::buffer(&atyp, 1),
          asio::buffer(bnd_addr.data(), bnd_addr.length()),
          asio::buffer(&bnd_port, 2)}};
 
     co_await asio::async_write(this->socket_, buf,
                                asio::redirect_error(asio::use_awaitable, ec));
+    this->pending_reply_len_ = 0;
     if (ec) {
         this->stop();
         co_return;
     }
 
+    this->rep_ = rep;
+    socks_metrics::get()->reply(rep);
+    socks_metrics::get()->observe(
+        socks_metrics::histogram::handshake,
+        std::chrono::steady_clock::now() - this->accept_time_);
+    this->end_handshake();
+
     SPDLOG_DEBUG(
         "UDP ASSOCIATE - [TCP Proxy: {} -> TCP Client: {}] VER = [X'{:02X}'], "
         "REP = "
@@ -602,261 +1602,360 @@ bool socks_session::check_udp_sender_endpoint(
 
 asio::awaitable<void> socks_session::handle_udp_associate_detail() {
     asio::error_code ec;
-    std::string buf(UINT16_MAX, 0);
-    uint16_t rsv;
-    uint8_t frag;
-    uint8_t atyp;
-    std::string_view dst_addr;
-    uint16_t dst_port;
-    std::string_view data;
-    asio::ip::udp::endpoint sender_endpoint;
-    asio::ip::udp::endpoint udp_cli_endpoint;
-    asio::ip::udp::endpoint udp_dst_endpoint;
+    /* io_uring delivers one datagram per completion */
+    udp_batch batch(this->udp_receiver_ ? 1
+                                        : this->config_->udp_batch_size());
+    this->udp_flows_ = std::make_unique<udp_flow_table>(
+        this->config_->udp_max_flows(),
+        std::chrono::seconds(this->config_->udp_flow_timeout()));
+
+    if (this->uring_ == nullptr && this->config_->udp_offload() &&
+        !batch.enable_offload(this->udp_socket_->native_handle())) {
+        SPDLOG_DEBUG("UDP ASSOCIATE - no UDP_SEGMENT or UDP_GRO support");
+    }
+
+    this->shaper_.configure(*this->config_, this->username_);
 
     while (this->socket_.is_open()) {
+        /* datagrams are never dropped for a limit, receiving waits */
+        if (this->shaper_.enabled() &&
+            co_await this->shape(this->upload_timer_) == 0) {
+            this->stop();
+            co_return;
+        }
+
         this->flush_deadline();
 
-        std::size_t length = co_await this->udp_socket_->async_receive_from(
-            asio::buffer(buf), sender_endpoint,
-            asio::redirect_error(asio::use_awaitable, ec));
+        std::size_t n = co_await this->udp_receive(batch, ec);
         if (ec) {
             this->stop();
             co_return;
         }
 
-        /* dst to cli */
-        if (!udp_dst_endpoint.address().is_unspecified() &&
-            sender_endpoint == udp_dst_endpoint) {
-            rsv = 0x00;
-            frag = 0x00;
-            std::string addr_bytes;
+        auto now = udp_flow_table::clock::now();
+        for (std::size_t i = 0; i < n; i++) {
+            /* a coalesced receive holds a run of equally sized datagrams */
+            std::string_view data = batch.datagram(i);
+            std::size_t segment_size = batch.segment_size(i);
 
-            if (udp_dst_endpoint.address().is_v4()) {
-                atyp = coro_socks::Atyp::IpV4;
-                auto bytes = udp_dst_endpoint.address().to_v4().to_bytes();
-                addr_bytes = std::string(bytes.begin(), bytes.end());
-            } else {
-                atyp = coro_socks::Atyp::IpV6;
-                auto bytes = udp_dst_endpoint.address().to_v6().to_bytes();
-                addr_bytes = std::string(bytes.begin(), bytes.end());
-            }
+            this->shaper_.consume(data.size());
 
-            dst_port = asio::detail::socket_ops::host_to_network_short(
-                udp_dst_endpoint.port());
+            do {
+                if (batch.queue_full()) {
+                    co_await this->udp_flush(batch, ec);
+                    if (ec) {
+                        this->stop();
+                        co_return;
+                    }
+                }
 
-            std::array<asio::const_buffer, 6> reply_buf = {
-                {asio::buffer(&rsv, 2), asio::buffer(&frag, 1),
-                 asio::buffer(&atyp, 1),
-                 asio::buffer(addr_bytes.data(), addr_bytes.length()),
-                 asio::buffer(&dst_port, 2), asio::buffer(buf.data(), length)}};
+                this->handle_udp_datagram(data.substr(0, segment_size),
+                                          batch.sender(i), now, batch);
+                data.remove_prefix(std::min(segment_size, data.size()));
+            } while (!data.empty());
+        }
 
-            co_await this->udp_socket_->async_send_to(
-                reply_buf, udp_cli_endpoint,
-                asio::redirect_error(asio::use_awaitable, ec));
+        co_await this->udp_flush(batch, ec);
+        if (ec) {
+            this->stop();
+            co_return;
+        }
 
-            SPDLOG_DEBUG(
-                "UDP ASSOCIATE - [UDP Proxy {} -> UDP Client {}] RSV = "
-                "[X'{:04X}'], "
-                "FRAG = [X'{:02X}'],"
-                "ATYP = [X'{:02X}'], DST.ADDR = [{}], DST.PORT = [{}]",
-                coro_socks::format_address(this->udp_bnd_endpoint_),
-                coro_socks::format_address(udp_cli_endpoint), rsv,
-                static_cast<uint16_t>(frag), static_cast<uint16_t>(atyp),
-                coro_socks::format_address(addr_bytes, atyp),
-                udp_dst_endpoint.port());
+        /* nothing points into the arena any more */
+        batch.release();
+    }
 
-            continue;
-        }
+    co_return;
+}
 
-        if (!this->udp_endpoints_[0].address().is_unspecified() &&
-            !this->check_udp_sender_endpoint(sender_endpoint)) {
-            continue;
-        }
+void socks_session::handle_udp_datagram(
+    std::string_view packet, const asio::ip::udp::endpoint &sender_endpoint,
+    udp_flow_table::clock::time_point now, udp_batch &batch) {
+    /* dst to cli, any remote the client has sent to */
+    if (auto *flow = this->udp_flows_->find(sender_endpoint, now);
+        flow != nullptr) {
+        batch.queue(std::string_view(flow->header.data(), flow->header_len),
+                    packet, this->udp_cli_endpoint_);
+        socks_metrics::get()->add(socks_metrics::counter::udp_remote_to_client);
+        this->bytes_remote_to_client_ += packet.size();
+        SOCKS_PROBE(udp_out, this->id_, packet.size(), flow->remote.data());
 
-        udp_cli_endpoint = sender_endpoint;
+        SPDLOG_DEBUG(
+            "UDP ASSOCIATE - [UDP Proxy {} -> UDP Client {}] "
+            "ATYP = [X'{:02X}'], DST.ADDR = [{}], DST.PORT = [{}]",
+            coro_socks::format_address(this->udp_bnd_endpoint_),
+            coro_socks::format_address(this->udp_cli_endpoint_),
+            static_cast<uint16_t>(flow->header[3]),
+            coro_socks::format_address(
+                std::string_view(flow->header.data() + 4,
+                                 flow->header_len - 6),
+                flow->header[3]),
+            flow->remote.port());
 
-        /* this is a client request */
-        if (length <= 4) {
-            continue;
-        }
+        return;
+    }
 
-        rsv = static_cast<uint16_t>(buf[0] << 8) + buf[1];
-        if (rsv != 0x0000) {
-            continue;
-        }
+    if (!this->udp_endpoints_[0].address().is_unspecified() &&
+        !this->check_udp_sender_endpoint(sender_endpoint)) {
+        return;
+    }
 
-        frag = buf[2];
-        if (frag) {
-            continue;
+    this->udp_cli_endpoint_ = sender_endpoint;
+
+    /* this is a client request */
+    std::size_t header_len;
+    coro_socks::udp_request request;
+
+    if (coro_socks::parse_message(packet, header_len, request) !=
+        coro_socks::parse_result::complete) {
+        return;
+    }
+
+    SPDLOG_DEBUG(
+        "UDP ASSOCIATE - [UDP Client {} -> UDP Proxy {}] "
+        "ATYP = [X'{:02X}'], DST.ADDR = [{}], DST.PORT = [{}]",
+        coro_socks::format_address(this->udp_cli_endpoint_),
+        coro_socks::format_address(this->udp_bnd_endpoint_),
+        static_cast<uint16_t>(request.atyp),
+        coro_socks::format_address(request.dst_addr, request.atyp),
+        request.dst_port);
+
+    udp_flow_table::flow *flow;
+
+    if (request.atyp == coro_socks::Atyp::DomainName) {
+        /* a known name is not resolved again while its flow lives */
+        flow = this->udp_flows_->find(request.dst_addr, request.dst_port, now);
+        if (flow == nullptr) {
+            this->resolve_udp_destination(request);
+            return;
         }
+    } else {
+        flow = this->udp_flows_->insert(
+            asio::ip::udp::endpoint(
+                coro_socks::make_address(request.dst_addr, request.atyp),
+                request.dst_port),
+            std::string_view(), now);
+    }
 
-        atyp = buf[3];
+    batch.queue(std::string_view(), request.data, flow->remote);
+    socks_metrics::get()->add(socks_metrics::counter::udp_client_to_remote);
+    this->bytes_client_to_remote_ += request.data.size();
+    SOCKS_PROBE(udp_in, this->id_, request.data.size(), flow->remote.data());
 
-        switch (atyp) {
-            case coro_socks::Atyp::IpV4: {
-                if (length <= static_cast<std::size_t>(4 + 4 + 2)) {
-                    continue;
-                }
+    SPDLOG_DEBUG(
+        "UDP ASSOCIATE - [UDP Proxy {} -> UDP Server {}] "
+        "Data Length = [{}]",
+        coro_socks::format_address(this->udp_bnd_endpoint_),
+        coro_socks::format_address(flow->remote), request.data.length());
+}
 
-                dst_addr = std::string_view(buf.begin() + 4, buf.begin() + 8);
-                dst_port = static_cast<uint16_t>(buf[8] << 8) + buf[9];
-                data = std::string_view(buf.begin() + 10, buf.begin() + length);
-                break;
-            }
-            case coro_socks::Atyp::IpV6: {
-                if (length <= static_cast<std::size_t>(4 + 16 + 2)) {
-                    continue;
-                }
+void socks_session::resolve_udp_destination(
+    const coro_socks::udp_request &request) {
+    if (this->udp_pending_num_ >= max_pending_datagrams) {
+        socks_metrics::get()->add(socks_metrics::counter::udp_pending_dropped);
+        return;
+    }
 
-                dst_addr = std::string_view(buf.begin() + 4, buf.begin() + 20);
-                dst_port = static_cast<uint16_t>(buf[20] << 8) + buf[21];
-                data = std::string_view(buf.begin() + 22, buf.begin() + length);
-                break;
-            }
-            case coro_socks::Atyp::DomainName: {
-                uint8_t dlen = buf[4];
+    this->udp_pending_num_++;
 
-                if (length <= static_cast<std::size_t>(4 + 1 + dlen + 2)) {
-                    continue;
-                }
+    std::string name(request.dst_addr);
+    auto [it, inserted] = this->udp_pending_.try_emplace(name);
 
-                dst_addr =
-                    std::string_view(buf.begin() + 5, buf.begin() + 5 + dlen);
-                dst_port = static_cast<uint16_t>(buf[5 + dlen] << 8) +
-                           buf[5 + dlen + 1];
-                data = std::string_view(buf.begin() + 7 + dlen,
-                                        buf.begin() + length);
-                break;
-            }
-            default: {
-                continue;
-            }
-        };
+    it->second.push_back({request.dst_port, std::string(request.data)});
 
-        SPDLOG_DEBUG(
-            "UDP ASSOCIATE - [UDP Client {} -> UDP Proxy {}] RSV = "
-            "[X'{:04X}'], FRAG = "
-            "[X'{:02X}'], "
-            "ATYP = [X'{:02X}'], DST.ADDR = [{}], DST.PORT = [{}]",
-            coro_socks::format_address(udp_cli_endpoint),
-            coro_socks::format_address(this->udp_bnd_endpoint_), rsv,
-            static_cast<uint16_t>(frag), static_cast<uint16_t>(atyp),
-            coro_socks::format_address(dst_addr, atyp), dst_port);
+    /* later datagrams to the name wait for the lookup already running */
+    if (!inserted) {
+        return;
+    }
 
-        std::vector<asio::ip::udp::endpoint> udp_dst_endpoints;
+    asio::co_spawn(
+        this->socket_.get_executor(),
+        [self = this->getDerivedSharedPtr<socks_session>(),
+         name = std::move(name)]() {
+            return self->send_resolved_datagrams(name);
+        },
+        asio::detached);
+}
 
-        if (atyp == coro_socks::Atyp::DomainName) {
-            asio::ip::udp::resolver resolver(this->socket_.get_executor());
+asio::awaitable<void> socks_session::send_resolved_datagrams(
+    std::string name) {
+    asio::error_code ec;
 
-            auto endpoints = co_await resolver.async_resolve(
-                dst_addr, std::to_string(dst_port),
-                asio::redirect_error(asio::use_awaitable, ec));
-            if (ec) {
-                continue;
-            }
+    auto addresses = co_await dns_cache::get()->resolve(
+        this->socket_.get_executor(), name, ec);
 
-            udp_dst_endpoints = std::vector<asio::ip::udp::endpoint>(
-                endpoints.begin(), endpoints.end());
-        } else {
-            auto addr = asio::ip::make_address(
-                coro_socks::format_address(dst_addr, atyp), ec);
-            if (ec) {
-                continue;
-            }
+    auto node = this->udp_pending_.extract(name);
+    this->udp_pending_num_ -= node.mapped().size();
 
-            udp_dst_endpoints.emplace_back(addr, dst_port);
-        }
+    if (ec || !this->socket_.is_open()) {
+        co_return;
+    }
 
-        for (auto &&endpoint : udp_dst_endpoints) {
-            co_await this->udp_socket_->async_send_to(
-                asio::buffer(data.data(), data.length()), endpoint,
-                asio::redirect_error(asio::use_awaitable, ec));
+    /* the relay socket can only reach its own family */
+    bool v4 = this->udp_bnd_endpoint_.address().is_v4();
+    auto it = std::find_if(
+        addresses->begin(), addresses->end(),
+        [v4](const asio::ip::address &a) { return a.is_v4() == v4; });
+    if (it == addresses->end()) {
+        co_return;
+    }
 
-            if (ec) {
-                SPDLOG_DEBUG("UDP ASSOCIATE - failed to send udp [{}]",
-                             ec.message());
-                continue;
-            } else {
-                SPDLOG_DEBUG(
-                    "UDP ASSOCIATE - [UDP Proxy {} -> UDP Server {}] "
-                    "Data Length = [{}]",
-                    coro_socks::format_address(this->udp_bnd_endpoint_),
-                    coro_socks::format_address(endpoint), data.length());
+    for (auto &&datagram : node.mapped()) {
+        auto *flow = this->udp_flows_->insert(
+            asio::ip::udp::endpoint(*it, datagram.port), name,
+            udp_flow_table::clock::now());
+        asio::ip::udp::endpoint remote = flow->remote;
+        std::array<asio::const_buffer, 1> buffers = {
+            asio::buffer(datagram.data)};
 
-                udp_dst_endpoint = endpoint;
-                break;
-            }
+        co_await this->udp_send_to(buffers, remote, ec);
+        if (!this->socket_.is_open()) {
+            co_return;
         }
+
+        if (ec) {
+            SPDLOG_DEBUG("UDP ASSOCIATE - failed to send udp [{}]",
+                         ec.message());
+            continue;
+        }
+
+        socks_metrics::get()->add(
+            socks_metrics::counter::udp_client_to_remote);
+        this->bytes_client_to_remote_ += datagram.data.size();
+        SOCKS_PROBE(udp_in, this->id_, datagram.data.size(), remote.data());
     }
 
     co_return;
 }
 
-asio::awaitable<void> socks_session::reply_and_stop(uint8_t rep) {
-    asio::error_code ec;
-    uint8_t ver = coro_socks::Version::V5;
-    uint8_t rsv = 0x00;
-    uint8_t atyp = coro_socks::Atyp::IpV4;
-    uint8_t bnd_addr[4] = {0};
-    uint16_t bnd_port = 0;
+asio::awaitable<std::size_t> socks_session::udp_receive(
+    udp_batch &batch, asio::error_code &ec) {
+    if (this->udp_receiver_) {
+        asio::ip::udp::endpoint sender_endpoint;
+        std::size_t length = co_await this->udp_receiver_->async_receive(
+            sender_endpoint, asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            co_return 0;
+        }
 
-    std::array<asio::const_buffer, 6> buf = {
-        {asio::buffer(&ver, 1), asio::buffer(&rep, 1), asio::buffer(&rsv, 1),
-         asio::buffer(&atyp, 1), asio::buffer(bnd_addr, 4),
-         asio::buffer(&bnd_port, 2)}};
+        batch.assign(std::string_view(this->udp_receiver_->data(), length),
+                     sender_endpoint);
+        co_return 1;
+    }
 
-    co_await asio::async_write(this->socket_, buf,
-                               asio::redirect_error(asio::use_awaitable, ec));
-    if (!ec) {
-        this->stop();
+    for (;;) {
+        co_await this->udp_socket_->async_wait(
+            asio::ip::udp::socket::wait_read,
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            co_return 0;
+        }
+
+        std::size_t n =
+            batch.receive(this->udp_socket_->native_handle(), ec);
+        if (ec != asio::error::would_block) {
+            co_return n;
+        }
     }
-    co_return;
 }
 
-asio::awaitable<bool> socks_session::read_byte(uint8_t *addr) noexcept {
-    asio::error_code ec;
-    co_await asio::async_read(this->socket_, asio::buffer(addr, 1),
-                              asio::redirect_error(asio::use_awaitable, ec));
-    if (ec) {
-        co_return false;
+/*
+ * Send what the batch queued. Failures of single datagrams are not fatal
+ * to the association, ec is only set when the relay socket itself is gone.
+ */
+asio::awaitable<void> socks_session::udp_flush(udp_batch &batch,
+                                               asio::error_code &ec) {
+    ec.clear();
+
+    if (this->uring_ != nullptr) {
+        for (std::size_t i = batch.queue_begin(); i < batch.queue_end(); i++) {
+            auto buffers = batch.queued_buffers(i);
+            asio::error_code send_ec;
+
+            co_await this->udp_send_to(buffers, batch.queued_endpoint(i),
+                                       send_ec);
+            if (send_ec) {
+                SPDLOG_DEBUG("UDP ASSOCIATE - failed to send udp [{}]",
+                             send_ec.message());
+            }
+        }
+
+        batch.clear_queue();
+        co_return;
     }
 
-    co_return true;
+    for (;;) {
+        asio::error_code send_ec;
+
+        batch.send(this->udp_socket_->native_handle(), send_ec);
+        if (send_ec != asio::error::would_block) {
+            if (send_ec) {
+                SPDLOG_DEBUG("UDP ASSOCIATE - failed to send udp [{}]",
+                             send_ec.message());
+            }
+            co_return;
+        }
+
+        co_await this->udp_socket_->async_wait(
+            asio::ip::udp::socket::wait_write,
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) {
+            co_return;
+        }
+    }
 }
 
-asio::awaitable<bool> socks_session::read_port(uint16_t *port) noexcept {
-    asio::error_code ec;
-    uint8_t high, low;
+asio::awaitable<void> socks_session::udp_send_to(
+    std::span<const asio::const_buffer> buffers,
+    const asio::ip::udp::endpoint &endpoint, asio::error_code &ec) {
+    if (this->uring_ == nullptr) {
+        co_await this->udp_socket_->async_send_to(
+            buffers, endpoint, asio::redirect_error(asio::use_awaitable, ec));
+        co_return;
+    }
 
-    std::array<asio::mutable_buffer, 2> buf = {
-        {asio::buffer(&high, 1), asio::buffer(&low, 1)}};
+    std::array<iovec, 8> iov;
+    std::size_t iovlen = std::min(buffers.size(), iov.size());
 
-    co_await asio::async_read(this->socket_, buf,
-                              asio::redirect_error(asio::use_awaitable, ec));
-    if (ec) {
-        co_return false;
+    for (std::size_t i = 0; i < iovlen; i++) {
+        iov[i].iov_base = const_cast<void *>(buffers[i].data());
+        iov[i].iov_len = buffers[i].size();
     }
 
-    *port = static_cast<uint16_t>(high << 8) + low;
+    msghdr msg{};
+    msg.msg_name = const_cast<sockaddr *>(endpoint.data());
+    msg.msg_namelen = static_cast<socklen_t>(endpoint.size());
+    msg.msg_iov = iov.data();
+    msg.msg_iovlen = iovlen;
 
-    co_return true;
+    co_await this->uring_->async_sendmsg(
+        this->udp_socket_->native_handle(), &msg,
+        asio::redirect_error(asio::use_awaitable, ec));
+
+    co_return;
 }
 
-asio::awaitable<bool> socks_session::read_bytes_n(std::string &bytes,
-                                                  uint32_t n) noexcept {
+asio::awaitable<void> socks_session::reply_and_stop(uint8_t rep) {
     asio::error_code ec;
+    uint8_t ver = coro_socks::Version::V5;
+    uint8_t rsv = 0x00;
+    uint8_t atyp = coro_socks::Atyp::IpV4;
+    uint8_t bnd_addr[4] = {0};
+    uint16_t bnd_port = 0;
 
-    if (n == 0) {
-        co_return true;
-    }
-
-    bytes.resize(n);
+    std::array<asio::const_buffer, 7> buf = {
+        {asio::buffer(this->pending_reply_.data(), this->pending_reply_len_),
+         asio::buffer(&ver, 1), asio::buffer(&rep, 1), asio::buffer(&rsv, 1),
+         asio::buffer(&atyp, 1), asio::buffer(bnd_addr, 4),
+         asio::buffer(&bnd_port, 2)}};
 
-    co_await asio::async_read(this->socket_, asio::buffer(bytes.data(), n),
-                              asio::redirect_error(asio::use_awaitable, ec));
-    if (ec) {
-        co_return false;
+    co_await asio::async_write(this->socket_, buf,
+                               asio::redirect_error(asio::use_awaitable, ec));
+    this->pending_reply_len_ = 0;
+    if (!ec) {
+        this->rep_ = rep;
+        socks_metrics::get()->reply(rep);
+        this->stop();
     }
-
-    co_return true;
+    co_return;
 }
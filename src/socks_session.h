@@ -1,7 +1,26 @@
 #pragma once
 
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "access_log.h"
+#include "admission_control.h"
 #include "asiomp.h"
+#include "buffer_pool.h"
 #include "config.h"
+#include "dns_cache.h"
+#include "happy_eyeballs.h"
+#include "metrics.h"
+#include "slab_allocator.h"
+#include "timer_wheel.h"
+#include "traffic_shaper.h"
+#include "udp_batch.h"
+#include "udp_flow_table.h"
+#include "upstream_pool.h"
+#include "uring_service.h"
 
 class socks_session
   : public session
@@ -9,6 +28,9 @@ class socks_session
 public:
     socks_session(asio::ip::tcp::socket socket);
 
+    /* the session and its shared_ptr control block come from a slab */
+    static std::shared_ptr<socks_session> create(asio::ip::tcp::socket socket);
+
     ~socks_session();
 
     void start() override;
@@ -18,45 +40,201 @@ private:
 
     void flush_deadline();
 
-    asio::awaitable<void> handle_keep_alive();
+    /* the handshake no longer counts against the admission caps */
+    void end_handshake();
+
+    /* keeps what the access log needs of the request */
+    void remember_request(const coro_socks::client_request& request);
+
+    /* one record into the worker's access log ring */
+    void log_access() const;
+
+    socks_metrics::counter relay_bytes_counter(
+        const asio::ip::tcp::socket& src) const;
+
+    uint64_t& relay_bytes(const asio::ip::tcp::socket& src);
+
+    asio::steady_timer& shape_timer(const asio::ip::tcp::socket& src);
+
+    /* wait for the rate limits to allow a read, 0 once the session stopped */
+    asio::awaitable<std::size_t> shape(asio::steady_timer& timer);
 
     asio::awaitable<void> handle_packet();
 
+    /* answer a client the worker has no room for with a failure */
+    asio::awaitable<void> reject_overloaded();
+
+    /*
+     * derives off the event loop unless the worker remembers the password,
+     * empty when too many derivations are waiting to check it
+     */
+    asio::awaitable<std::optional<bool>> check_auth(
+        const coro_socks::auth_request& request);
+
     asio::awaitable<void> handle_authentication();
 
     asio::awaitable<void> handle_client_request();
 
+    /* CONNECT through an upstream proxy, returns the REP it answered */
+    asio::awaitable<uint8_t> connect_upstream(std::size_t upstream,
+                                              uint8_t atyp,
+                                              std::string_view dst_addr,
+                                              uint16_t dst_port);
+
     asio::awaitable<void> handle_connect();
 
+    /*
+     * the success reply, false once the session stopped, an optimistic one
+     * is left for the caller to record when the connect is done
+     */
+    asio::awaitable<bool> reply_connected(
+        const asio::ip::tcp::endpoint& tcp_bnd_endpoint, bool optimistic);
+
+    asio::awaitable<void> connect_optimistic(
+        const std::vector<asio::ip::address>& addresses, uint16_t dst_port);
+
+    /* waits up to fast_open_wait for the client to send first */
+    asio::awaitable<void> read_first_flight();
+
+    /* false when Fast Open is not available and a plain connect is due */
+    asio::awaitable<bool> connect_fast_open(
+        const asio::ip::tcp::endpoint& endpoint, asio::error_code& ec);
+
+    /* passes on what the client sent so far and starts both relays */
+    asio::awaitable<void> start_relay();
+
     asio::awaitable<void> handle_connect_cli_to_dst();
 
     asio::awaitable<void> handle_connect_dst_to_cli();
 
+    asio::awaitable<void> handle_connect_copy(asio::ip::tcp::socket& src,
+                                              asio::ip::tcp::socket& dst);
+
+    asio::awaitable<bool> handle_connect_splice(asio::ip::tcp::socket& src,
+                                                asio::ip::tcp::socket& dst);
+
+    asio::awaitable<bool> handle_connect_uring(asio::ip::tcp::socket& src,
+                                               asio::ip::tcp::socket& dst);
+
     asio::awaitable<void> handle_udp_associate();
 
     bool check_udp_sender_endpoint(const asio::ip::udp::endpoint& sender_endpoint);
 
     asio::awaitable<void> handle_udp_associate_detail();
 
+    /* queues the datagram into batch, never waits */
+    void handle_udp_datagram(std::string_view packet,
+                             const asio::ip::udp::endpoint& sender_endpoint,
+                             udp_flow_table::clock::time_point now,
+                             udp_batch& batch);
+
+    /* holds the datagram until a spawned lookup of its name is done */
+    void resolve_udp_destination(const coro_socks::udp_request& request);
+
+    asio::awaitable<void> send_resolved_datagrams(std::string name);
+
+    asio::awaitable<std::size_t> udp_receive(udp_batch& batch,
+                                             asio::error_code& ec);
+
+    asio::awaitable<void> udp_flush(udp_batch& batch, asio::error_code& ec);
+
+    asio::awaitable<void> udp_send_to(
+        std::span<const asio::const_buffer> buffers,
+        const asio::ip::udp::endpoint& endpoint, asio::error_code& ec);
+
     asio::awaitable<void> reply_and_stop(uint8_t rep);
 
-    asio::awaitable<bool> read_byte(uint8_t *addr) noexcept;
+    template <typename Message>
+    asio::awaitable<bool> read_message(Message& msg);
+
+    /* the same from buf, holding the bytes from begin to end */
+    template <typename Message>
+    asio::awaitable<bool> read_message(Message& msg, std::span<char> buf,
+                                       std::size_t& begin, std::size_t& end);
 
-    asio::awaitable<bool> read_port(uint16_t *port) noexcept;
+    void queue_reply(uint8_t ver, uint8_t status);
 
-    asio::awaitable<bool> read_bytes_n(std::string& bytes, uint32_t n) noexcept;
+    asio::awaitable<bool> flush_reply();
 
 private:
     asio::ip::tcp::socket socket_;
+    /* tells the session apart in the probes */
+    uint64_t id_;
+    /* reloads on SIGHUP leave the configuration a session started with */
+    std::shared_ptr<const socks_config> config_;
+    std::chrono::steady_clock::time_point accept_time_;
+    /* the remote connect finished, the first_byte phase starts */
+    std::chrono::steady_clock::time_point connected_time_;
     uint32_t keep_alive_time_;
-    asio::steady_timer keep_alive_timer_;
-    std::chrono::steady_clock::time_point deadline_;
+    timer_wheel* wheel_;
+    timer_wheel::entry idle_entry_;
+    /* the worker's, null while the session is not counted there */
+    admission_control* admission_;
+    bool handshaking_;
+    /* shed, and counted in the worker's rejects in flight */
+    bool rejecting_;
+
+    relay_buffer handshake_buf_;
+    std::size_t handshake_begin_;
+    std::size_t handshake_end_;
+    std::array<uint8_t, 4> pending_reply_;
+    std::size_t pending_reply_len_;
+    std::string username_;
+
+    /* for the access log, the request itself lives in the handshake buffer */
+    uint8_t cmd_;
+    uint8_t rep_;
+    uint8_t dst_atyp_;
+    uint8_t dst_len_;
+    uint16_t dst_port_;
+    std::array<char, 255> dst_addr_;
+    uint64_t bytes_client_to_remote_;
+    uint64_t bytes_remote_to_client_;
+
+    traffic_shaper shaper_;
+    /* one per relay direction, UDP ASSOCIATE uses the first */
+    asio::steady_timer upload_timer_;
+    asio::steady_timer download_timer_;
 
     asio::ip::tcp::endpoint client_endpoint_;
     asio::ip::tcp::endpoint proxy_endpoint_;
     asio::ip::tcp::socket tcp_dst_socket_;
+    happy_eyeballs connector_;
 
     std::vector<asio::ip::udp::endpoint> udp_endpoints_;
     std::unique_ptr<asio::ip::udp::socket> udp_socket_;
     asio::ip::udp::endpoint udp_bnd_endpoint_;
-};
\ No newline at end of file
+    asio::ip::udp::endpoint udp_cli_endpoint_;
+    std::unique_ptr<udp_flow_table> udp_flows_;
+
+    struct pending_datagram {
+        uint16_t port;
+        std::string data;
+    };
+
+    /* by the name being resolved, sent once its flow exists */
+    std::unordered_map<std::string, std::vector<pending_datagram>>
+        udp_pending_;
+    std::size_t udp_pending_num_;
+
+    uring_service* uring_;
+    std::unique_ptr<uring_datagram_receiver> udp_receiver_;
+};
+
+/*
+ * What asiomp constructs for every connection, it builds its sessions with
+ * make_shared. Handing the socket on to socks_session::create() puts the
+ * session on the slab like in the other modes, only this small shell comes
+ * from the heap and it is gone once start() returns.
+ */
+class slab_session
+  : public session
+{
+public:
+    explicit slab_session(asio::ip::tcp::socket socket);
+
+    void start() override;
+
+private:
+    asio::ip::tcp::socket socket_;
+};
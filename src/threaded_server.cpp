@@ -0,0 +1,138 @@
+#include "threaded_server.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#include "config.h"
+#include "dns_cache.h"
+#include "socks_session.h"
+
+threaded_server::threaded_server(const std::string &address, uint16_t port,
+                                 uint32_t thread_num, bool daemon,
+                                 std::vector<int> cpus)
+    : address_(address),
+      port_(port),
+      thread_num_(std::max<uint32_t>(thread_num, 1)),
+      daemon_(daemon),
+      cpus_(std::move(cpus)) {}
+
+void threaded_server::run() {
+    if (this->daemon_ && ::daemon(1, 0) < 0) {
+        SPDLOG_ERROR("failed to daemonize: {}", std::strerror(errno));
+        return;
+    }
+
+    /* before any session exists, the threads look answers up in it */
+    dns_cache::share_between_threads();
+
+    for (std::size_t i = 0; i < this->thread_num_; i++) {
+        this->contexts_.push_back(std::make_unique<asio::io_context>(1));
+    }
+
+    asio::error_code ec;
+    asio::io_context &io_context = *this->contexts_[0];
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(this->address_, ec),
+                                     this->port_);
+    if (ec) {
+        SPDLOG_ERROR("invalid listening address [{}]", this->address_);
+        return;
+    }
+
+    asio::ip::tcp::acceptor acceptor(io_context);
+    acceptor.open(endpoint.protocol(), ec);
+    if (!ec) {
+        acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true), ec);
+        acceptor.bind(endpoint, ec);
+    }
+    if (!ec) {
+        acceptor.listen(asio::socket_base::max_listen_connections, ec);
+    }
+    if (ec) {
+        SPDLOG_ERROR("failed to listen on {}:{}: {}", this->address_,
+                     this->port_, ec.message());
+        return;
+    }
+
+    asio::signal_set signals(io_context, SIGINT, SIGTERM, SIGQUIT);
+    signals.async_wait([&](const asio::error_code &, int) {
+        for (auto &&context : this->contexts_) {
+            context->stop();
+        }
+    });
+
+    /* one reload serves every thread, they pick the snapshot up lazily */
+    socks_config::reload_on_sighup(io_context.get_executor());
+
+    asio::co_spawn(io_context, this->handle_accept(acceptor), asio::detached);
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < this->thread_num_; i++) {
+        threads.emplace_back([this, i] {
+            auto guard = asio::make_work_guard(*this->contexts_[i]);
+
+            this->pin(i);
+            this->contexts_[i]->run();
+        });
+    }
+
+    SPDLOG_INFO("{} worker threads listening on {}:{}", this->thread_num_,
+                this->address_, this->port_);
+
+    this->pin(0);
+    io_context.run();
+
+    for (auto &&thread : threads) {
+        thread.join();
+    }
+}
+
+void threaded_server::pin(std::size_t thread) {
+    if (this->cpus_.empty()) {
+        return;
+    }
+
+    int cpu = this->cpus_[thread % this->cpus_.size()];
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    int err = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        SPDLOG_WARN("failed to pin thread {} to cpu {}: {}", thread, cpu,
+                    std::strerror(err));
+    }
+}
+
+asio::awaitable<void> threaded_server::handle_accept(
+    asio::ip::tcp::acceptor &acceptor) {
+    asio::error_code ec;
+
+    for (std::size_t next = 0; acceptor.is_open();
+         next = (next + 1) % this->contexts_.size()) {
+        /* the socket is registered with the thread that will serve it */
+        asio::io_context &context = *this->contexts_[next];
+
+        auto socket = co_await acceptor.async_accept(
+            context, asio::redirect_error(asio::use_awaitable, ec));
+        if (ec == asio::error::operation_aborted) {
+            co_return;
+        }
+
+        if (ec) {
+            SPDLOG_WARN("failed to accept: {}", ec.message());
+            continue;
+        }
+
+        /* created there, so it picks up that thread's thread locals */
+        asio::post(context, [socket = std::move(socket)]() mutable {
+            socks_session::create(std::move(socket))->start();
+        });
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "asiomp.h"
+
+/*
+ * Single process server running one io_context per thread. The acceptor
+ * lives on the first thread and hands every connection to the threads in
+ * turn, where the session is created, so the per-worker thread locals
+ * (buffer pool, timing wheel, DNS cache, metrics slot, io_uring) simply
+ * become per thread. Unlike worker processes, the threads can share
+ * read-mostly state through rcu_snapshot, such as the DNS answers. Threads
+ * can be pinned to CPUs.
+ */
+class threaded_server {
+public:
+    threaded_server(const std::string& address, uint16_t port,
+                    uint32_t thread_num, bool daemon, std::vector<int> cpus);
+
+    threaded_server(const threaded_server&) = delete;
+
+    threaded_server& operator=(const threaded_server&) = delete;
+
+    void run();
+
+private:
+    void pin(std::size_t thread);
+
+    asio::awaitable<void> handle_accept(asio::ip::tcp::acceptor& acceptor);
+
+private:
+    std::string address_;
+    uint16_t port_;
+    uint32_t thread_num_;
+    bool daemon_;
+    std::vector<int> cpus_;
+
+    std::vector<std::unique_ptr<asio::io_context>> contexts_;
+};
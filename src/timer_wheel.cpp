@@ -0,0 +1,151 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+#include <bit>
+
+#include "config.h"
+
+timer_wheel::entry::~entry() { this->cancel(); }
+
+void timer_wheel::entry::cancel() {
+    if (this->linked()) {
+        this->wheel_->unlink(*this);
+    }
+}
+
+timer_wheel* timer_wheel::get(const asio::any_io_executor& ex) {
+    /* never torn down, sessions may outlive the thread locals at exit */
+    static thread_local timer_wheel* wheel = new timer_wheel(ex);
+    return wheel;
+}
+
+timer_wheel::timer_wheel(const asio::any_io_executor& ex)
+    : timer_(ex),
+      origin_(std::chrono::steady_clock::now()),
+      tick_(std::max<uint32_t>(socks_config::get()->check_duration(), 1)),
+      current_(0),
+      size_(0),
+      running_(false) {
+    /* one revolution covers the keep alive time plus the partial tick */
+    uint64_t span = socks_config::get()->keep_alive_time() / tick_.count();
+    std::size_t slot_num = std::bit_ceil(std::max<uint64_t>(span + 2, 8));
+
+    this->mask_ = slot_num - 1;
+    this->slots_ = std::vector<entry>(slot_num);
+    for (auto &&head : this->slots_) {
+        head.prev_ = head.next_ = &head;
+    }
+}
+
+void timer_wheel::set_callback(entry &e, std::function<void()> on_expire) {
+    e.on_expire_ = std::move(on_expire);
+}
+
+void timer_wheel::expires_after(entry &e, std::chrono::seconds timeout) {
+    if (!this->running_) {
+        /* the wheel stood still while empty, catch up with the clock */
+        this->current_ = this->now_tick();
+        this->schedule_tick();
+    }
+
+    /* round up, current_ may already be up to one tick old */
+    uint64_t ticks = (timeout.count() + this->tick_.count() - 1) /
+                     this->tick_.count();
+    uint64_t expiry = this->current_ + ticks + 1;
+
+    if (e.linked()) {
+        if (e.expiry_ == expiry) {
+            return;
+        }
+
+        if (((e.expiry_ ^ expiry) & this->mask_) == 0) {
+            e.expiry_ = expiry;
+            return;
+        }
+
+        this->unlink(e);
+    }
+
+    this->link(expiry, e);
+}
+
+void timer_wheel::link(uint64_t expiry, entry &e) {
+    entry &head = this->slots_[expiry & this->mask_];
+
+    e.wheel_ = this;
+    e.expiry_ = expiry;
+    e.prev_ = head.prev_;
+    e.next_ = &head;
+    head.prev_->next_ = &e;
+    head.prev_ = &e;
+    this->size_++;
+}
+
+void timer_wheel::unlink(entry &e) {
+    e.prev_->next_ = e.next_;
+    e.next_->prev_ = e.prev_;
+    e.prev_ = e.next_ = nullptr;
+    e.wheel_ = nullptr;
+    this->size_--;
+}
+
+uint64_t timer_wheel::now_tick() const {
+    return (std::chrono::steady_clock::now() - this->origin_) / this->tick_;
+}
+
+void timer_wheel::schedule_tick() {
+    this->running_ = true;
+    this->timer_.expires_at(this->origin_ + this->tick_ * (this->current_ + 1));
+    this->timer_.async_wait([this](const asio::error_code &ec) {
+        if (!ec) {
+            this->on_tick();
+        }
+    });
+}
+
+void timer_wheel::on_tick() {
+    uint64_t now = this->now_tick();
+
+    while (this->current_ < now && this->size_ > 0) {
+        this->current_++;
+
+        /* detach the slot first, expiring may reschedule other entries */
+        entry &head = this->slots_[this->current_ & this->mask_];
+        entry due;
+        due.prev_ = due.next_ = &due;
+
+        if (head.next_ != &head) {
+            due.next_ = head.next_;
+            due.prev_ = head.prev_;
+            due.next_->prev_ = &due;
+            due.prev_->next_ = &due;
+            head.prev_ = head.next_ = &head;
+        }
+
+        while (due.next_ != &due) {
+            entry &e = *due.next_;
+            uint64_t expiry = e.expiry_;
+
+            this->unlink(e);
+
+            if (expiry <= this->current_) {
+                if (e.on_expire_) {
+                    e.on_expire_();
+                }
+            } else {
+                /* only when the timeout exceeds one revolution */
+                this->link(expiry, e);
+            }
+        }
+
+        due.prev_ = nullptr;
+    }
+
+    if (this->size_ == 0) {
+        this->running_ = false;
+        return;
+    }
+
+    this->current_ = now;
+    this->schedule_tick();
+}
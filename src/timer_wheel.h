@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "asiomp.h"
+
+/*
+ * Per-worker hashed timing wheel owning the idle deadlines of all sessions.
+ * Entries are intrusive, so rescheduling one is an O(1) move between slot
+ * lists and usually a no-op when it stays in the same slot. The wheel spans
+ * at least the keep alive time, which means every entry in an expiring
+ * slot is due and a tick only touches sessions that really time out. The
+ * underlying timer only runs while there are entries.
+ */
+class timer_wheel {
+public:
+    class entry {
+    public:
+        entry() = default;
+
+        ~entry();
+
+        entry(const entry&) = delete;
+
+        entry& operator=(const entry&) = delete;
+
+        inline bool linked() const { return this->prev_ != nullptr; }
+
+        /* remove the entry from its wheel, its callback will not run */
+        void cancel();
+
+    private:
+        friend class timer_wheel;
+
+        timer_wheel* wheel_ = nullptr;
+        entry* prev_ = nullptr;
+        entry* next_ = nullptr;
+        uint64_t expiry_ = 0;
+        std::function<void()> on_expire_;
+    };
+
+    static timer_wheel* get(const asio::any_io_executor& ex);
+
+    /* (re)arm the entry to call on_expire once timeout has elapsed */
+    void expires_after(entry& e, std::chrono::seconds timeout);
+
+    void set_callback(entry& e, std::function<void()> on_expire);
+
+    inline std::size_t size() const { return this->size_; }
+
+private:
+    explicit timer_wheel(const asio::any_io_executor& ex);
+
+    timer_wheel(const timer_wheel&) = delete;
+
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    void link(uint64_t expiry, entry& e);
+
+    void unlink(entry& e);
+
+    uint64_t now_tick() const;
+
+    void schedule_tick();
+
+    void on_tick();
+
+private:
+    asio::steady_timer timer_;
+    std::chrono::steady_clock::time_point origin_;
+    std::chrono::seconds tick_;
+    uint64_t current_;
+    uint64_t mask_;
+    std::size_t size_;
+    bool running_;
+
+    /* sentinel heads of the circular slot lists */
+    std::vector<entry> slots_;
+};
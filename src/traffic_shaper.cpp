@@ -0,0 +1,160 @@
+#include "traffic_shaper.h"
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <unordered_map>
+
+#include "config.h"
+
+namespace {
+
+/* buckets of the users this worker has sessions of */
+class user_buckets {
+public:
+    static user_buckets* get() {
+        /* never torn down, sessions may outlive the thread locals at exit */
+        static thread_local user_buckets* buckets = new user_buckets();
+        return buckets;
+    }
+
+    std::shared_ptr<token_bucket> find(std::string_view username) {
+        auto& slot = this->buckets_[std::string(username)];
+
+        auto bucket = slot.lock();
+        if (!bucket) {
+            bucket = std::make_shared<token_bucket>();
+            slot = bucket;
+            this->prune();
+        }
+
+        return bucket;
+    }
+
+    token_bucket* worker() { return &this->worker_; }
+
+private:
+    /* forget users without sessions once the map has doubled */
+    void prune() {
+        if (this->buckets_.size() < this->prune_at_) {
+            return;
+        }
+
+        std::erase_if(this->buckets_,
+                      [](const auto& entry) { return entry.second.expired(); });
+        this->prune_at_ = std::max<std::size_t>(this->buckets_.size() * 2, 64);
+    }
+
+    std::unordered_map<std::string, std::weak_ptr<token_bucket>> buckets_;
+    std::size_t prune_at_ = 64;
+    token_bucket worker_;
+};
+
+}    // namespace
+
+token_bucket::token_bucket()
+    : rate_(0), burst_(0), tokens_(0), last_(clock::now()) {}
+
+void token_bucket::set_rate(uint64_t rate, uint64_t burst) {
+    /* never below a quantum, or a read could wait forever */
+    this->burst_ = std::max(static_cast<double>(burst), read_quantum);
+
+    if (this->rate_ == 0) {
+        /* a new bucket starts full */
+        this->tokens_ = this->burst_;
+        this->last_ = clock::now();
+    }
+
+    this->rate_ = rate;
+    this->tokens_ = std::min(this->tokens_, this->burst_);
+}
+
+double token_bucket::refill(clock::time_point now) {
+    if (now > this->last_) {
+        std::chrono::duration<double> elapsed = now - this->last_;
+
+        this->tokens_ = std::min(
+            this->burst_, this->tokens_ + elapsed.count() * this->rate_);
+        this->last_ = now;
+    }
+
+    return this->tokens_;
+}
+
+token_bucket::clock::duration token_bucket::shortfall() const {
+    if (this->tokens_ >= read_quantum) {
+        return clock::duration::zero();
+    }
+
+    std::chrono::duration<double> wait((read_quantum - this->tokens_) /
+                                       this->rate_);
+    return std::chrono::ceil<clock::duration>(wait);
+}
+
+traffic_shaper::traffic_shaper()
+    : session_(), user_(), limits_(), scopes_(), limit_num_(0) {}
+
+void traffic_shaper::configure(const socks_config& config,
+                               std::string_view username) {
+    auto burst = [&config](uint64_t rate) {
+        return rate * config.rate_limit_burst() / 1000;
+    };
+
+    this->limit_num_ = 0;
+
+    if (uint64_t rate = config.session_rate_limit(); rate > 0) {
+        this->add(&this->session_, scope::session, rate, burst(rate));
+    }
+
+    if (uint64_t rate = config.user_rate_limit(username);
+        rate > 0 && !username.empty()) {
+        this->user_ = user_buckets::get()->find(username);
+        this->add(this->user_.get(), scope::user, rate, burst(rate));
+    }
+
+    if (uint64_t rate = config.worker_rate_limit(); rate > 0) {
+        this->add(user_buckets::get()->worker(), scope::worker, rate,
+                  burst(rate));
+    }
+}
+
+void traffic_shaper::add(token_bucket* bucket, scope s, uint64_t rate,
+                         uint64_t burst) {
+    bucket->set_rate(rate, burst);
+
+    this->limits_[this->limit_num_] = bucket;
+    this->scopes_[this->limit_num_] = s;
+    this->limit_num_++;
+}
+
+std::size_t traffic_shaper::allowance(clock::time_point now,
+                                      clock::duration& delay, scope& limit) {
+    double allowed = std::numeric_limits<double>::max();
+
+    delay = clock::duration::zero();
+    for (std::size_t i = 0; i < this->limit_num_; i++) {
+        double tokens = this->limits_[i]->refill(now);
+
+        /* the bucket that keeps the read back longest is the one to blame */
+        if (this->limits_[i]->shortfall() > delay) {
+            delay = this->limits_[i]->shortfall();
+            limit = this->scopes_[i];
+        }
+
+        allowed = std::min(allowed, tokens);
+    }
+
+    if (delay > clock::duration::zero()) {
+        return 0;
+    }
+
+    return allowed >= static_cast<double>(SIZE_MAX)
+               ? SIZE_MAX
+               : static_cast<std::size_t>(allowed);
+}
+
+void traffic_shaper::consume(std::size_t n) {
+    for (std::size_t i = 0; i < this->limit_num_; i++) {
+        this->limits_[i]->consume(n);
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+class socks_config;
+
+/*
+ * Token bucket refilled lazily, the tokens earned since the last access are
+ * added when it is accessed again, so an idle bucket costs nothing. Tokens
+ * may go negative when more was read than was available, the debt is paid
+ * back by waiting.
+ */
+class token_bucket {
+public:
+    using clock = std::chrono::steady_clock;
+
+    /* tokens a read waits for, so a limited flow does not read byte-wise */
+    static constexpr double read_quantum = 4096;
+
+    token_bucket();
+
+    /* bytes per second and burst size, the tokens saved so far are kept */
+    void set_rate(uint64_t rate, uint64_t burst);
+
+    /* the tokens at now, negative while in debt */
+    double refill(clock::time_point now);
+
+    inline void consume(std::size_t n) { this->tokens_ -= n; }
+
+    /* time until a read quantum is saved up, as of the last refill */
+    clock::duration shortfall() const;
+
+private:
+    uint64_t rate_;
+    double burst_;
+    double tokens_;
+    clock::time_point last_;
+};
+
+/*
+ * The rate limits of one session, its own bucket, the one shared by all
+ * sessions of its user in this worker and the worker's. Relays ask for an
+ * allowance before every read and charge what they read, so limits are
+ * enforced by reading later, never by dropping data.
+ */
+class traffic_shaper {
+public:
+    using clock = token_bucket::clock;
+
+    enum class scope : std::size_t {
+        session,
+        user,
+        worker,
+    };
+
+    traffic_shaper();
+
+    /* username is empty when the client did not authenticate */
+    void configure(const socks_config& config, std::string_view username);
+
+    inline bool enabled() const { return this->limit_num_ > 0; }
+
+    /* bytes that may be read now, 0 when delay has to pass first */
+    std::size_t allowance(clock::time_point now, clock::duration& delay,
+                          scope& limit);
+
+    void consume(std::size_t n);
+
+private:
+    void add(token_bucket* bucket, scope s, uint64_t rate, uint64_t burst);
+
+private:
+    token_bucket session_;
+    std::shared_ptr<token_bucket> user_;
+    std::array<token_bucket*, 3> limits_;
+    std::array<scope, 3> scopes_;
+    std::size_t limit_num_;
+};
@@ -0,0 +1,306 @@
+#include "udp_batch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+/* a worker's receive arenas no batch is using, with their slot counts */
+struct spare_arena {
+    std::size_t size;
+    std::unique_ptr<char[]> buffers;
+};
+
+std::vector<spare_arena>& spare_arenas() {
+    /* never torn down, sessions may outlive the thread locals at exit */
+    static thread_local auto* arenas = new std::vector<spare_arena>();
+    return *arenas;
+}
+
+}    // namespace
+
+udp_batch::udp_batch(std::size_t size)
+    : size_(std::max<std::size_t>(size, 1)),
+      gso_(false),
+      gro_(false),
+      recv_msgs_(this->size_),
+      recv_iovs_(this->size_),
+      recv_controls_(this->size_),
+      senders_(this->size_),
+      datagrams_(this->size_),
+      segment_sizes_(this->size_),
+      send_iovs_(2 * this->size_),
+      send_headers_(this->size_),
+      send_endpoints_(this->size_),
+      queued_(0),
+      send_msgs_(this->size_),
+      send_firsts_(this->size_),
+      send_controls_(this->size_),
+      send_begin_(0),
+      send_end_(0),
+      tail_segment_size_(0),
+      tail_bytes_(0),
+      tail_open_(false) {
+    for (std::size_t i = 0; i < this->size_; i++) {
+        std::memset(&this->recv_msgs_[i], 0, sizeof(mmsghdr));
+        this->recv_msgs_[i].msg_hdr.msg_iov = &this->recv_iovs_[i];
+        this->recv_msgs_[i].msg_hdr.msg_iovlen = 1;
+
+        this->send_iovs_[2 * i].iov_base = this->send_headers_[i].data();
+        std::memset(&this->send_msgs_[i], 0, sizeof(mmsghdr));
+    }
+}
+
+udp_batch::~udp_batch() { this->release(); }
+
+bool udp_batch::enable_offload(int fd) {
+    /* UDP_SEGMENT is set per message, 0 as the socket default is a no-op */
+    int gso_size = 0;
+    this->gso_ = ::setsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso_size,
+                              sizeof(gso_size)) == 0;
+
+    int on = 1;
+    this->gro_ = ::setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+
+    return this->gso_ || this->gro_;
+}
+
+std::size_t udp_batch::receive(int fd, asio::error_code& ec) {
+    this->acquire();
+
+    for (std::size_t i = 0; i < this->size_; i++) {
+        msghdr& hdr = this->recv_msgs_[i].msg_hdr;
+
+        hdr.msg_name = this->senders_[i].data();
+        hdr.msg_namelen =
+            static_cast<socklen_t>(this->senders_[i].capacity());
+
+        if (this->gro_) {
+            hdr.msg_control = this->recv_controls_[i].data;
+            hdr.msg_controllen = sizeof(control_buffer);
+        }
+    }
+
+    int n;
+    do {
+        n = ::recvmmsg(fd, this->recv_msgs_.data(),
+                       static_cast<unsigned int>(this->size_), MSG_DONTWAIT,
+                       nullptr);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        ec = (errno == EAGAIN || errno == EWOULDBLOCK)
+                 ? asio::error_code(asio::error::would_block)
+                 : asio::error_code(errno, asio::system_category());
+        /* not held while the association waits */
+        this->release();
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        msghdr& hdr = this->recv_msgs_[i].msg_hdr;
+        std::size_t length = this->recv_msgs_[i].msg_len;
+        std::size_t segment_size = length;
+
+        if (this->gro_) {
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+                 cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP &&
+                    cmsg->cmsg_type == UDP_GRO) {
+                    int gso_size;
+                    std::memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                    if (gso_size > 0) {
+                        segment_size = std::min<std::size_t>(
+                            static_cast<std::size_t>(gso_size), length);
+                    }
+                }
+            }
+
+            /* a cut off run keeps only its whole datagrams */
+            if ((hdr.msg_flags & MSG_TRUNC) && segment_size < length) {
+                length -= length % segment_size;
+            }
+        }
+
+        this->senders_[i].resize(hdr.msg_namelen);
+        this->datagrams_[i] = std::string_view(
+            static_cast<const char*>(this->recv_iovs_[i].iov_base), length);
+        this->segment_sizes_[i] = segment_size;
+    }
+
+    ec.clear();
+    return static_cast<std::size_t>(n);
+}
+
+void udp_batch::release() {
+    if (!this->buffers_) {
+        return;
+    }
+
+    auto& arenas = spare_arenas();
+    if (arenas.size() < max_spare_arenas) {
+        arenas.push_back({this->size_, std::move(this->buffers_)});
+    }
+    this->buffers_.reset();
+}
+
+void udp_batch::assign(std::string_view data,
+                       const asio::ip::udp::endpoint& sender) {
+    this->datagrams_[0] = data;
+    this->senders_[0] = sender;
+    this->segment_sizes_[0] = data.size();
+}
+
+bool udp_batch::queue(std::string_view header, std::string_view payload,
+                      const asio::ip::udp::endpoint& endpoint) {
+    if (this->queued_ == this->size_) {
+        return false;
+    }
+
+    std::size_t d = this->queued_++;
+    std::size_t length = header.size() + payload.size();
+
+    std::memcpy(this->send_headers_[d].data(), header.data(), header.size());
+    this->send_iovs_[2 * d].iov_len = header.size();
+    this->send_iovs_[2 * d + 1].iov_base = const_cast<char*>(payload.data());
+    this->send_iovs_[2 * d + 1].iov_len = payload.size();
+    this->send_endpoints_[d] = endpoint;
+
+    /*
+     * Every segment but the last has the size of the first, so the run
+     * stays open while datagrams of that size to the same endpoint follow.
+     */
+    if (this->gso_ && this->tail_open_) {
+        std::size_t tail = this->send_end_ - 1;
+        std::size_t first = this->send_firsts_[tail];
+
+        if (length > 0 && length <= this->tail_segment_size_ &&
+            this->tail_bytes_ + length <= max_segmented_size &&
+            d - first < max_segments &&
+            endpoint == this->send_endpoints_[first]) {
+            msghdr& hdr = this->send_msgs_[tail].msg_hdr;
+
+            if (hdr.msg_iovlen == 2) {
+                hdr.msg_control = this->send_controls_[tail].data;
+                hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+                uint16_t gso_size =
+                    static_cast<uint16_t>(this->tail_segment_size_);
+                std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            }
+
+            hdr.msg_iovlen += 2;
+            this->tail_bytes_ += length;
+            this->tail_open_ = length == this->tail_segment_size_;
+            return true;
+        }
+    }
+
+    this->begin_message(this->send_end_++, d);
+    this->tail_segment_size_ = length;
+    this->tail_bytes_ = length;
+    this->tail_open_ = length > 0;
+
+    return true;
+}
+
+void udp_batch::send(int fd, asio::error_code& ec) {
+    ec.clear();
+
+    while (this->send_begin_ < this->send_end_) {
+        int n = ::sendmmsg(
+            fd, this->send_msgs_.data() + this->send_begin_,
+            static_cast<unsigned int>(this->send_end_ - this->send_begin_),
+            MSG_DONTWAIT);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ec = asio::error::would_block;
+                return;
+            }
+
+            /* e.g. a segment over the path MTU, fall back to plain sends */
+            if (this->send_msgs_[this->send_begin_].msg_hdr.msg_iovlen > 2) {
+                this->gso_ = false;
+                this->unsegment(this->send_begin_);
+                continue;
+            }
+
+            /* the front datagram failed, drop it and carry on */
+            ec = asio::error_code(errno, asio::system_category());
+            this->send_begin_++;
+            continue;
+        }
+
+        this->send_begin_ += static_cast<std::size_t>(n);
+    }
+
+    this->clear_queue();
+}
+
+void udp_batch::clear_queue() {
+    this->queued_ = 0;
+    this->send_begin_ = 0;
+    this->send_end_ = 0;
+    this->tail_open_ = false;
+}
+
+void udp_batch::begin_message(std::size_t m, std::size_t d) {
+    msghdr& hdr = this->send_msgs_[m].msg_hdr;
+
+    hdr.msg_iov = &this->send_iovs_[2 * d];
+    hdr.msg_iovlen = 2;
+    hdr.msg_name = this->send_endpoints_[d].data();
+    hdr.msg_namelen = static_cast<socklen_t>(this->send_endpoints_[d].size());
+    hdr.msg_control = nullptr;
+    hdr.msg_controllen = 0;
+
+    this->send_firsts_[m] = d;
+}
+
+void udp_batch::acquire() {
+    if (this->buffers_) {
+        return;
+    }
+
+    auto& arenas = spare_arenas();
+    auto it = std::find_if(
+        arenas.begin(), arenas.end(),
+        [this](const spare_arena& a) { return a.size == this->size_; });
+
+    if (it != arenas.end()) {
+        this->buffers_ = std::move(it->buffers);
+        arenas.erase(it);
+    } else {
+        /* left uninitialised, only pages a datagram touched are resident */
+        this->buffers_.reset(new char[this->size_ * max_datagram_size]);
+    }
+
+    for (std::size_t i = 0; i < this->size_; i++) {
+        this->recv_iovs_[i].iov_base =
+            this->buffers_.get() + i * max_datagram_size;
+        this->recv_iovs_[i].iov_len = max_datagram_size;
+    }
+}
+
+void udp_batch::unsegment(std::size_t m) {
+    std::size_t first = this->send_firsts_[m];
+
+    /* there are never more messages than datagrams, so m <= first */
+    for (std::size_t d = first; d < this->queued_; d++) {
+        this->begin_message(m + (d - first), d);
+    }
+
+    this->send_end_ = m + (this->queued_ - first);
+    this->tail_open_ = false;
+}
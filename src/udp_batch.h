@@ -0,0 +1,172 @@
+#pragma once
+
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "asiomp.h"
+#include "public.h"
+
+/*
+ * Datagram batch of a UDP ASSOCIATE relay. receive() drains up to size()
+ * datagrams with one recvmmsg(2) into slots of a receive arena, queue()
+ * stages a header and a payload for one sendmmsg(2) in send(). Neither
+ * allocates per datagram. Payloads are referenced, not copied, so they
+ * must stay valid until the queue has been sent.
+ *
+ * An arena holds size() datagrams of any size, megabytes at the default
+ * batch size, so a batch only borrows one from its worker while it has
+ * datagrams to relay and gives it back with release(). Idle associations
+ * hold none and a worker keeps only a few spare ones.
+ *
+ * With offload enabled, a receive slot may hold a run of datagrams the
+ * kernel coalesced (UDP_GRO), and consecutive queued datagrams to the same
+ * endpoint go out as one message the kernel segments (UDP_SEGMENT).
+ */
+class udp_batch {
+public:
+    /* large enough for the payload of any UDP datagram */
+    static constexpr std::size_t max_datagram_size = UINT16_MAX;
+
+    /* UDP_MAX_SEGMENTS of the kernel */
+    static constexpr std::size_t max_segments = 64;
+
+    /* the UDP payload limit over IPv6 also holds for IPv4 */
+    static constexpr std::size_t max_segmented_size = UINT16_MAX - 8 - 40;
+
+    /* spare receive arenas a worker keeps for its batches */
+    static constexpr std::size_t max_spare_arenas = 4;
+
+    explicit udp_batch(std::size_t size);
+
+    ~udp_batch();
+
+    udp_batch(const udp_batch&) = delete;
+
+    udp_batch& operator=(const udp_batch&) = delete;
+
+    inline std::size_t size() const { return this->size_; }
+
+    /*
+     * Probe fd for UDP_SEGMENT and UDP_GRO and use whichever the kernel
+     * supports. Returns false when neither is, the batch then stays plain.
+     */
+    bool enable_offload(int fd);
+
+    /*
+     * non-blocking, fails with would_block when nothing is pending, the
+     * datagrams stay valid until release()
+     */
+    std::size_t receive(int fd, asio::error_code& ec);
+
+    /* gives the receive arena back once the queue has been sent */
+    void release();
+
+    /* make a datagram received elsewhere the only one of the batch */
+    void assign(std::string_view data, const asio::ip::udp::endpoint& sender);
+
+    inline std::string_view datagram(std::size_t i) const {
+        return this->datagrams_[i];
+    }
+
+    inline const asio::ip::udp::endpoint& sender(std::size_t i) const {
+        return this->senders_[i];
+    }
+
+    /* length of each datagram in slot i, the last one may be shorter */
+    inline std::size_t segment_size(std::size_t i) const {
+        return this->segment_sizes_[i];
+    }
+
+    /* false when the queue is full */
+    bool queue(std::string_view header, std::string_view payload,
+               const asio::ip::udp::endpoint& endpoint);
+
+    inline bool queue_empty() const {
+        return this->send_begin_ == this->send_end_;
+    }
+
+    inline bool queue_full() const { return this->queued_ == this->size_; }
+
+    /* the queued datagrams of a batch without offload */
+    inline std::size_t queue_begin() const { return this->send_begin_; }
+
+    inline std::size_t queue_end() const { return this->send_end_; }
+
+    inline std::array<asio::const_buffer, 2> queued_buffers(
+        std::size_t i) const {
+        return {{asio::buffer(this->send_iovs_[2 * i].iov_base,
+                              this->send_iovs_[2 * i].iov_len),
+                 asio::buffer(this->send_iovs_[2 * i + 1].iov_base,
+                              this->send_iovs_[2 * i + 1].iov_len)}};
+    }
+
+    inline const asio::ip::udp::endpoint& queued_endpoint(
+        std::size_t i) const {
+        return this->send_endpoints_[i];
+    }
+
+    /*
+     * Non-blocking. Sends the queue front to back and fails with
+     * would_block when the socket is full, the rest stays queued. A
+     * datagram the kernel refuses is dropped and reported in ec. When a
+     * segmented message is refused, segmentation is turned off and its
+     * datagrams are sent one by one instead.
+     */
+    void send(int fd, asio::error_code& ec);
+
+    void clear_queue();
+
+private:
+    /* start message m with datagram d */
+    void begin_message(std::size_t m, std::size_t d);
+
+    /* resend the datagrams from message m on without segmentation */
+    void unsegment(std::size_t m);
+
+    /* borrow a receive arena from the worker */
+    void acquire();
+
+private:
+    /* room for the one int or uint16_t control message either way */
+    union control_buffer {
+        cmsghdr align;
+        char data[CMSG_SPACE(sizeof(int))];
+    };
+
+    std::size_t size_;
+    bool gso_;
+    bool gro_;
+
+    std::unique_ptr<char[]> buffers_;
+    std::vector<mmsghdr> recv_msgs_;
+    std::vector<iovec> recv_iovs_;
+    std::vector<control_buffer> recv_controls_;
+    std::vector<asio::ip::udp::endpoint> senders_;
+    std::vector<std::string_view> datagrams_;
+    std::vector<std::size_t> segment_sizes_;
+
+    /* per datagram, a header and a payload iovec each */
+    std::vector<iovec> send_iovs_;
+    std::vector<std::array<char, coro_socks::max_udp_header_size>>
+        send_headers_;
+    std::vector<asio::ip::udp::endpoint> send_endpoints_;
+    std::size_t queued_;
+
+    /* per message, a run of datagrams when segmented */
+    std::vector<mmsghdr> send_msgs_;
+    std::vector<std::size_t> send_firsts_;
+    std::vector<control_buffer> send_controls_;
+    std::size_t send_begin_;
+    std::size_t send_end_;
+
+    /* the last message, segments are appended while it is open */
+    std::size_t tail_segment_size_;
+    std::size_t tail_bytes_;
+    bool tail_open_;
+};
@@ -0,0 +1,250 @@
+#include "udp_flow_table.h"
+
+#include <algorithm>
+#include <bit>
+
+namespace {
+
+std::size_t mix(uint64_t h) {
+    /* the finalizer of MurmurHash3, the index only uses the low bits */
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return static_cast<std::size_t>(h);
+}
+
+}    // namespace
+
+udp_flow_table::udp_flow_table(std::size_t max_flows,
+                               std::chrono::seconds idle_timeout)
+    : idle_timeout_(idle_timeout), size_(0) {
+    max_flows = std::max<std::size_t>(max_flows, 1);
+
+    /* at most half full, so a probe always ends at an empty position */
+    std::size_t index_size = std::bit_ceil(std::max<std::size_t>(
+        max_flows * 2, 8));
+    this->mask_ = index_size - 1;
+
+    this->flows_ = std::vector<flow>(max_flows);
+    this->used_ = std::vector<bool>(max_flows, false);
+    this->by_remote_ = std::vector<uint32_t>(index_size, npos);
+    this->by_name_ = std::vector<uint32_t>(index_size, npos);
+
+    for (std::size_t i = max_flows; i > 0; i--) {
+        this->free_.push_back(static_cast<uint32_t>(i - 1));
+    }
+}
+
+udp_flow_table::flow* udp_flow_table::find(
+    const asio::ip::udp::endpoint& remote, clock::time_point now) {
+    uint32_t slot = this->remote_slot(remote);
+    if (slot == npos) {
+        return nullptr;
+    }
+
+    if (this->expired(this->flows_[slot], now)) {
+        this->erase(slot);
+        return nullptr;
+    }
+
+    this->flows_[slot].last_used = now;
+    return &this->flows_[slot];
+}
+
+udp_flow_table::flow* udp_flow_table::find(std::string_view name,
+                                           uint16_t port,
+                                           clock::time_point now) {
+    uint32_t slot = this->name_slot(name, port);
+    if (slot == npos) {
+        return nullptr;
+    }
+
+    if (this->expired(this->flows_[slot], now)) {
+        this->erase(slot);
+        return nullptr;
+    }
+
+    this->flows_[slot].last_used = now;
+    return &this->flows_[slot];
+}
+
+udp_flow_table::flow* udp_flow_table::insert(
+    const asio::ip::udp::endpoint& remote, std::string_view name,
+    clock::time_point now) {
+    flow* f = this->find(remote, now);
+
+    if (f == nullptr) {
+        if (this->free_.empty()) {
+            this->erase(this->victim(now));
+        }
+
+        uint32_t slot = this->free_.back();
+        this->free_.pop_back();
+        this->used_[slot] = true;
+        this->size_++;
+
+        f = &this->flows_[slot];
+        f->remote = remote;
+        f->header_len = coro_socks::encode_udp_header(remote, f->header.data());
+        f->name.clear();
+        f->last_used = now;
+
+        this->link(this->by_remote_, hash(remote), slot);
+    }
+
+    if (!name.empty() && f->name != name) {
+        this->set_name(static_cast<uint32_t>(f - this->flows_.data()), name);
+    }
+
+    return f;
+}
+
+std::size_t udp_flow_table::hash(const asio::ip::udp::endpoint& remote) {
+    uint64_t h;
+
+    if (remote.address().is_v4()) {
+        h = remote.address().to_v4().to_uint();
+    } else {
+        auto bytes = remote.address().to_v6().to_bytes();
+        h = std::hash<std::string_view>{}(std::string_view(
+            reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+    }
+
+    return mix(h ^ (static_cast<uint64_t>(remote.port()) << 48));
+}
+
+std::size_t udp_flow_table::hash(std::string_view name, uint16_t port) {
+    return mix(std::hash<std::string_view>{}(name) ^
+               (static_cast<uint64_t>(port) << 48));
+}
+
+uint32_t udp_flow_table::remote_slot(
+    const asio::ip::udp::endpoint& remote) const {
+    for (std::size_t i = hash(remote) & this->mask_;;
+         i = (i + 1) & this->mask_) {
+        uint32_t slot = this->by_remote_[i];
+        if (slot == npos || this->flows_[slot].remote == remote) {
+            return slot;
+        }
+    }
+}
+
+uint32_t udp_flow_table::name_slot(std::string_view name,
+                                   uint16_t port) const {
+    for (std::size_t i = hash(name, port) & this->mask_;;
+         i = (i + 1) & this->mask_) {
+        uint32_t slot = this->by_name_[i];
+        if (slot == npos || (this->flows_[slot].name == name &&
+                             this->flows_[slot].remote.port() == port)) {
+            return slot;
+        }
+    }
+}
+
+void udp_flow_table::link(std::vector<uint32_t>& index, std::size_t h,
+                          uint32_t slot) {
+    std::size_t i = h & this->mask_;
+
+    while (index[i] != npos) {
+        i = (i + 1) & this->mask_;
+    }
+
+    index[i] = slot;
+}
+
+template <typename Hash>
+void udp_flow_table::unlink(std::vector<uint32_t>& index, std::size_t h,
+                            uint32_t slot, Hash hash_of) {
+    std::size_t i = h & this->mask_;
+
+    while (index[i] != slot) {
+        i = (i + 1) & this->mask_;
+    }
+
+    /* backward shift, no tombstones: pull up entries the hole cut off */
+    for (std::size_t j = i;;) {
+        j = (j + 1) & this->mask_;
+        if (index[j] == npos) {
+            break;
+        }
+
+        std::size_t home = hash_of(index[j]) & this->mask_;
+        bool reachable = i <= j ? (i < home && home <= j)
+                                : (i < home || home <= j);
+        if (reachable) {
+            continue;
+        }
+
+        index[i] = index[j];
+        i = j;
+    }
+
+    index[i] = npos;
+}
+
+void udp_flow_table::set_name(uint32_t slot, std::string_view name) {
+    flow& f = this->flows_[slot];
+    auto name_of = [this](uint32_t s) {
+        return hash(this->flows_[s].name, this->flows_[s].remote.port());
+    };
+
+    if (!f.name.empty()) {
+        this->unlink(this->by_name_, name_of(slot), slot, name_of);
+    }
+
+    /* the name now leads here, not to where it resolved before */
+    uint32_t other = this->name_slot(name, f.remote.port());
+    if (other != npos) {
+        this->unlink(this->by_name_, name_of(other), other, name_of);
+        this->flows_[other].name.clear();
+    }
+
+    f.name.assign(name);
+    this->link(this->by_name_, name_of(slot), slot);
+}
+
+uint32_t udp_flow_table::victim(clock::time_point now) const {
+    uint32_t lru = npos;
+
+    for (uint32_t slot = 0; slot < this->flows_.size(); slot++) {
+        if (!this->used_[slot]) {
+            continue;
+        }
+
+        if (this->expired(this->flows_[slot], now)) {
+            return slot;
+        }
+
+        if (lru == npos ||
+            this->flows_[slot].last_used < this->flows_[lru].last_used) {
+            lru = slot;
+        }
+    }
+
+    return lru;
+}
+
+void udp_flow_table::erase(uint32_t slot) {
+    flow& f = this->flows_[slot];
+
+    this->unlink(this->by_remote_, hash(f.remote), slot, [this](uint32_t s) {
+        return hash(this->flows_[s].remote);
+    });
+
+    if (!f.name.empty()) {
+        this->unlink(this->by_name_, hash(f.name, f.remote.port()), slot,
+                     [this](uint32_t s) {
+                         return hash(this->flows_[s].name,
+                                     this->flows_[s].remote.port());
+                     });
+        f.name.clear();
+    }
+
+    this->used_[slot] = false;
+    this->free_.push_back(slot);
+    this->size_--;
+}
+
+bool udp_flow_table::expired(const flow& f, clock::time_point now) const {
+    return now - f.last_used > this->idle_timeout_;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "asiomp.h"
+#include "public.h"
+
+/*
+ * Destinations of one UDP ASSOCIATE relay. A flow is created when the
+ * client sends to a remote and holds the SOCKS header its replies go back
+ * with, encoded once. Flows are found by remote endpoint for replies and
+ * by the domain name the client addressed, so a name is only resolved
+ * when its flow is new. Both indexes are linear probing tables over the
+ * fixed flow slots. A flow idle for longer than the timeout is gone, and
+ * when all slots are taken the least recently used flow is replaced.
+ */
+class udp_flow_table {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct flow {
+        asio::ip::udp::endpoint remote;
+        std::array<char, coro_socks::max_udp_header_size> header;
+        std::size_t header_len;
+        /* the domain name the client used, empty for addresses */
+        std::string name;
+        clock::time_point last_used;
+    };
+
+    udp_flow_table(std::size_t max_flows, std::chrono::seconds idle_timeout);
+
+    udp_flow_table(const udp_flow_table&) = delete;
+
+    udp_flow_table& operator=(const udp_flow_table&) = delete;
+
+    /* the live flow to remote, refreshed, or nullptr */
+    flow* find(const asio::ip::udp::endpoint& remote, clock::time_point now);
+
+    /* the live flow the client reached as name:port, refreshed, or nullptr */
+    flow* find(std::string_view name, uint16_t port, clock::time_point now);
+
+    /* find or add the flow to remote and remember name for it */
+    flow* insert(const asio::ip::udp::endpoint& remote, std::string_view name,
+                 clock::time_point now);
+
+    inline std::size_t size() const { return this->size_; }
+
+private:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    static std::size_t hash(const asio::ip::udp::endpoint& remote);
+
+    static std::size_t hash(std::string_view name, uint16_t port);
+
+    /* the slot indexed under the key, npos when there is none */
+    uint32_t remote_slot(const asio::ip::udp::endpoint& remote) const;
+
+    uint32_t name_slot(std::string_view name, uint16_t port) const;
+
+    void link(std::vector<uint32_t>& index, std::size_t h, uint32_t slot);
+
+    template <typename Hash>
+    void unlink(std::vector<uint32_t>& index, std::size_t h, uint32_t slot,
+                Hash hash_of);
+
+    void set_name(uint32_t slot, std::string_view name);
+
+    /* an expired flow if there is one, else the least recently used */
+    uint32_t victim(clock::time_point now) const;
+
+    void erase(uint32_t slot);
+
+    bool expired(const flow& f, clock::time_point now) const;
+
+private:
+    std::chrono::seconds idle_timeout_;
+    std::size_t size_;
+    std::size_t mask_;
+
+    std::vector<flow> flows_;
+    std::vector<bool> used_;
+    std::vector<uint32_t> free_;
+
+    std::vector<uint32_t> by_remote_;
+    std::vector<uint32_t> by_name_;
+};
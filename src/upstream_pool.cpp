@@ -0,0 +1,259 @@
+#include "upstream_pool.h"
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <vector>
+
+#include "dns_cache.h"
+#include "happy_eyeballs.h"
+#include "metrics.h"
+
+namespace {
+
+bool same_upstream(const upstream_config& a, const upstream_config& b) {
+    return a.address == b.address && a.port == b.port &&
+           a.username == b.username && a.password == b.password &&
+           a.pool_size == b.pool_size;
+}
+
+/* the pools of one worker and the snapshot they were built for */
+struct upstream_pools {
+    std::shared_ptr<const socks_config> config;
+    std::vector<std::shared_ptr<upstream_pool>> pools;
+};
+
+}    // namespace
+
+std::shared_ptr<upstream_pool> upstream_pool::get(
+    const asio::any_io_executor& ex, const upstream_config& config) {
+    /* never torn down, sessions may outlive the thread locals at exit */
+    static thread_local upstream_pools* pools = new upstream_pools();
+
+    if (pools->config.get() != socks_config::get()) {
+        std::vector<std::shared_ptr<upstream_pool>> rebuilt;
+
+        pools->config = socks_config::snapshot();
+
+        for (auto&& upstream : pools->config->upstreams()) {
+            auto it = std::find_if(
+                pools->pools.begin(), pools->pools.end(),
+                [&upstream](const std::shared_ptr<upstream_pool>& pool) {
+                    return same_upstream(pool->config_, upstream);
+                });
+
+            rebuilt.push_back(it != pools->pools.end()
+                                  ? *it
+                                  : std::make_shared<upstream_pool>(
+                                        ex, upstream));
+        }
+
+        pools->pools = std::move(rebuilt);
+    }
+
+    for (auto&& pool : pools->pools) {
+        if (same_upstream(pool->config_, config)) {
+            return pool;
+        }
+    }
+
+    /* gone with a reload, every acquire dials */
+    upstream_config unpooled = config;
+    unpooled.pool_size = 0;
+
+    return std::make_shared<upstream_pool>(ex, unpooled);
+}
+
+upstream_pool::upstream_pool(const asio::any_io_executor& ex,
+                             const upstream_config& config)
+    : executor_(ex), config_(config), refilling_(false), refill_after_() {}
+
+asio::awaitable<void> upstream_pool::acquire(asio::ip::tcp::socket& socket,
+                                             asio::error_code& ec) {
+    while (!this->idle_.empty()) {
+        asio::ip::tcp::socket pooled = std::move(this->idle_.front());
+        this->idle_.pop_front();
+
+        if (!alive(pooled)) {
+            socks_metrics::get()->add(
+                socks_metrics::counter::upstream_pool_discarded);
+            continue;
+        }
+
+        socks_metrics::get()->add(socks_metrics::counter::upstream_pool_hits);
+        socket = std::move(pooled);
+        this->start_refill();
+
+        ec.clear();
+        co_return;
+    }
+
+    socks_metrics::get()->add(socks_metrics::counter::upstream_pool_misses);
+    this->start_refill();
+
+    co_await this->dial(socket, ec);
+}
+
+asio::awaitable<void> upstream_pool::dial(asio::ip::tcp::socket& socket,
+                                          asio::error_code& ec) {
+    dns_cache::addresses addresses;
+
+    auto addr = asio::ip::make_address(this->config_.address, ec);
+    if (!ec) {
+        addresses = std::make_shared<std::vector<asio::ip::address>>(
+            1, addr);
+    } else {
+        addresses = co_await dns_cache::get()->resolve(
+            this->executor_, this->config_.address, ec);
+        if (ec) {
+            co_return;
+        }
+    }
+
+    happy_eyeballs connector(this->executor_);
+    asio::steady_timer timer(this->executor_);
+    auto waiting = std::make_shared<bool>(true);
+
+    /* an upstream that accepts and then says nothing must not hold a
+     * session or the refill for longer than an idle client could */
+    timer.expires_after(
+        std::chrono::seconds(socks_config::get()->keep_alive_time()));
+    timer.async_wait(
+        [&socket, &connector, waiting](const asio::error_code& ec) {
+            asio::error_code ignored_ec;
+
+            if (!ec && *waiting) {
+                *waiting = false;
+                connector.cancel();
+                socket.close(ignored_ec);
+            }
+        });
+
+    co_await this->negotiate(connector, socket, *addresses, ec);
+
+    if (!*waiting) {
+        ec = asio::error::timed_out;
+    }
+
+    *waiting = false;
+    timer.cancel();
+
+    co_return;
+}
+
+asio::awaitable<void> upstream_pool::negotiate(
+    happy_eyeballs& connector, asio::ip::tcp::socket& socket,
+    const std::vector<asio::ip::address>& addresses, asio::error_code& ec) {
+    co_await connector.async_connect(socket, addresses, this->config_.port,
+                                     ec);
+    if (ec) {
+        co_return;
+    }
+
+    bool auth = !this->config_.username.empty();
+    uint8_t greeting[3] = {
+        coro_socks::Version::V5, 0x01,
+        auth ? coro_socks::Method::UserPassWd : coro_socks::Method::NoAuth};
+
+    co_await asio::async_write(socket, asio::buffer(greeting),
+                               asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return;
+    }
+
+    uint8_t method_reply[2];
+    co_await asio::async_read(socket, asio::buffer(method_reply),
+                              asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return;
+    }
+
+    if (method_reply[0] != coro_socks::Version::V5 ||
+        method_reply[1] != greeting[2]) {
+        ec = asio::error::connection_refused;
+        co_return;
+    }
+
+    if (!auth) {
+        co_return;
+    }
+
+    uint8_t ulen = static_cast<uint8_t>(this->config_.username.size());
+    uint8_t plen = static_cast<uint8_t>(this->config_.password.size());
+    uint8_t ver = 0x01;
+
+    std::array<asio::const_buffer, 5> auth_request = {
+        {asio::buffer(&ver, 1), asio::buffer(&ulen, 1),
+         asio::buffer(this->config_.username),
+         asio::buffer(&plen, 1), asio::buffer(this->config_.password)}};
+
+    co_await asio::async_write(socket, auth_request,
+                               asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return;
+    }
+
+    uint8_t auth_reply[2];
+    co_await asio::async_read(socket, asio::buffer(auth_reply),
+                              asio::redirect_error(asio::use_awaitable, ec));
+    if (ec) {
+        co_return;
+    }
+
+    if (auth_reply[1] != coro_socks::ReplyAuthStatus::Success) {
+        ec = asio::error::access_denied;
+    }
+
+    co_return;
+}
+
+void upstream_pool::start_refill() {
+    if (this->refilling_ || this->config_.pool_size == 0 ||
+        std::chrono::steady_clock::now() < this->refill_after_) {
+        return;
+    }
+
+    this->refilling_ = true;
+    asio::co_spawn(
+        this->executor_,
+        [self = this->shared_from_this()] { return self->refill(); },
+        asio::detached);
+}
+
+asio::awaitable<void> upstream_pool::refill() {
+    asio::error_code ec;
+
+    /* at most one pool's worth of dials per run, taking connections as
+     * fast as they come in must not keep a refill going for good */
+    for (uint32_t dials = 0; dials < this->config_.pool_size &&
+                             this->idle_.size() < this->config_.pool_size;
+         dials++) {
+        asio::ip::tcp::socket socket(this->executor_);
+
+        co_await this->dial(socket, ec);
+        if (ec) {
+            SPDLOG_WARN("failed to refill upstream pool {}:{}: {}",
+                        this->config_.address, this->config_.port,
+                        ec.message());
+            this->refill_after_ =
+                std::chrono::steady_clock::now() + refill_backoff;
+            break;
+        }
+
+        this->idle_.push_back(std::move(socket));
+        socks_metrics::get()->add(
+            socks_metrics::counter::upstream_pool_refills);
+    }
+
+    this->refilling_ = false;
+}
+
+bool upstream_pool::alive(asio::ip::tcp::socket& socket) {
+    char byte;
+    ssize_t n = ::recv(socket.native_handle(), &byte, 1,
+                       MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "asiomp.h"
+#include "config.h"
+#include "happy_eyeballs.h"
+
+/*
+ * Per-worker pool of connections to one upstream SOCKS5 proxy, each one
+ * already past method negotiation and authentication, so a chained CONNECT
+ * only pays for its request. Taking a connection starts a refill in the
+ * background up to the configured pool size. A pooled connection the
+ * upstream closed in the meantime is noticed and dropped when taken.
+ *
+ * The pools of a worker follow the upstreams of the latest snapshot. A
+ * reload keeps the pools of upstreams it left unchanged and drops the
+ * others, which close once their refills and acquires are done. Sessions
+ * still on an older snapshot reach its upstreams without a pool.
+ */
+class upstream_pool : public std::enable_shared_from_this<upstream_pool> {
+public:
+    /* the pool of an upstream of the session's snapshot */
+    static std::shared_ptr<upstream_pool> get(const asio::any_io_executor& ex,
+                                              const upstream_config& config);
+
+    /* a negotiated connection, warm from the pool or dialled on the spot */
+    asio::awaitable<void> acquire(asio::ip::tcp::socket& socket,
+                                  asio::error_code& ec);
+
+    inline std::size_t idle() const { return this->idle_.size(); }
+
+    upstream_pool(const asio::any_io_executor& ex,
+                  const upstream_config& config);
+
+private:
+
+    upstream_pool(const upstream_pool&) = delete;
+
+    upstream_pool& operator=(const upstream_pool&) = delete;
+
+    /* connect, negotiate the method and authenticate, within keep_alive_time */
+    asio::awaitable<void> dial(asio::ip::tcp::socket& socket,
+                               asio::error_code& ec);
+
+    asio::awaitable<void> negotiate(
+        happy_eyeballs& connector, asio::ip::tcp::socket& socket,
+        const std::vector<asio::ip::address>& addresses, asio::error_code& ec);
+
+    asio::awaitable<void> refill();
+
+    void start_refill();
+
+    /* no EOF, error or stray data waiting on an idle connection */
+    static bool alive(asio::ip::tcp::socket& socket);
+
+private:
+    /* a failed refill is not retried before this */
+    static constexpr std::chrono::seconds refill_backoff{1};
+
+    asio::any_io_executor executor_;
+    upstream_config config_;
+    std::deque<asio::ip::tcp::socket> idle_;
+    bool refilling_;
+    std::chrono::steady_clock::time_point refill_after_;
+};
@@ -0,0 +1,633 @@
+#include "uring_service.h"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "metrics.h"
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                      min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, const void* arg,
+                      unsigned nr_args) {
+    return static_cast<int>(
+        ::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+inline unsigned load_acquire(const unsigned* p) {
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline void store_release(unsigned* p, unsigned v) {
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+}    // namespace
+
+uring_service* uring_service::get(const asio::any_io_executor& ex) {
+    /* lives as long as the worker, it is never torn down because the
+     * io_context it is bound to may already be gone at thread exit */
+    static thread_local uring_service* service = nullptr;
+    static thread_local bool tried = false;
+
+    if (!tried) {
+        tried = true;
+
+        auto* s = new uring_service(ex);
+        if (s->setup()) {
+            service = s;
+            SPDLOG_INFO("io_uring enabled, fixed buffers: {}, multishot: {}",
+                        service->fixed_buffers(),
+                        service->datagram_buffers());
+        } else {
+            SPDLOG_WARN("io_uring unavailable, falling back to epoll");
+            delete s;
+        }
+    }
+
+    return service;
+}
+
+uring_service::uring_service(const asio::any_io_executor& ex)
+    : ex_(ex),
+      ring_fd_(-1),
+      event_fd_(-1),
+      event_count_(0),
+      sq_ptr_(MAP_FAILED),
+      sq_size_(0),
+      cq_ptr_(MAP_FAILED),
+      cq_size_(0),
+      sqes_(nullptr),
+      pending_(0),
+      flush_scheduled_(false),
+      skip_success_(false),
+      ops_(nullptr),
+      fixed_base_(nullptr),
+      datagram_base_(nullptr),
+      datagram_ring_(nullptr),
+      datagram_tail_(0),
+      stats_{} {
+    std::memset(&this->params_, 0, sizeof(this->params_));
+}
+
+uring_service::~uring_service() {
+    /* only reached when setup failed, before any buffer was registered */
+    if (this->sqes_ != nullptr) {
+        ::munmap(this->sqes_, this->params_.sq_entries * sizeof(io_uring_sqe));
+    }
+
+    if (this->cq_ptr_ != MAP_FAILED && this->cq_ptr_ != this->sq_ptr_) {
+        ::munmap(this->cq_ptr_, this->cq_size_);
+    }
+
+    if (this->sq_ptr_ != MAP_FAILED) {
+        ::munmap(this->sq_ptr_, this->sq_size_);
+    }
+
+    if (this->event_fd_ >= 0) {
+        ::close(this->event_fd_);
+    }
+
+    if (this->ring_fd_ >= 0) {
+        ::close(this->ring_fd_);
+    }
+}
+
+bool uring_service::setup() {
+    this->params_.flags = IORING_SETUP_CQSIZE;
+    this->params_.cq_entries = cq_entries;
+
+    this->ring_fd_ = io_uring_setup(sq_entries, &this->params_);
+    if (this->ring_fd_ < 0) {
+        return false;
+    }
+
+    auto& p = this->params_;
+
+    this->sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    this->cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        this->sq_size_ = this->cq_size_ =
+            std::max(this->sq_size_, this->cq_size_);
+    }
+
+    this->sq_ptr_ =
+        ::mmap(nullptr, this->sq_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, this->ring_fd_, IORING_OFF_SQ_RING);
+    if (this->sq_ptr_ == MAP_FAILED) {
+        return false;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        this->cq_ptr_ = this->sq_ptr_;
+    } else {
+        this->cq_ptr_ = ::mmap(nullptr, this->cq_size_,
+                               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               this->ring_fd_, IORING_OFF_CQ_RING);
+        if (this->cq_ptr_ == MAP_FAILED) {
+            return false;
+        }
+    }
+
+    void* sqes = ::mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        this->ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    this->sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    auto* sq = static_cast<char*>(this->sq_ptr_);
+    this->sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    this->sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    this->sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    this->sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+    auto* cq = static_cast<char*>(this->cq_ptr_);
+    this->cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    this->cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    this->cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    this->cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    this->skip_success_ = (p.features & IORING_FEAT_CQE_SKIP) != 0;
+
+    /* every opcode used by the relay and datagram paths must exist */
+    std::vector<char> probe_mem(sizeof(io_uring_probe) +
+                                256 * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(probe_mem.data());
+    if (io_uring_register(this->ring_fd_, IORING_REGISTER_PROBE, probe,
+                          256) < 0) {
+        return false;
+    }
+
+    for (int opcode : {IORING_OP_POLL_ADD, IORING_OP_READ_FIXED,
+                       IORING_OP_WRITE_FIXED, IORING_OP_RECV, IORING_OP_SEND,
+                       IORING_OP_RECVMSG, IORING_OP_SENDMSG,
+                       IORING_OP_ASYNC_CANCEL}) {
+        if (opcode > probe->last_op ||
+            !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+
+    this->event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->event_fd_ < 0) {
+        return false;
+    }
+
+    if (io_uring_register(this->ring_fd_, IORING_REGISTER_EVENTFD,
+                          &this->event_fd_, 1) < 0) {
+        return false;
+    }
+
+    this->event_descriptor_ =
+        std::make_unique<asio::posix::stream_descriptor>(this->ex_,
+                                                         this->event_fd_);
+
+    this->setup_fixed_buffers();
+    this->setup_datagram_buffers();
+
+    this->wait_eventfd();
+
+    return true;
+}
+
+void uring_service::setup_fixed_buffers() {
+    std::size_t total = fixed_buffer_size * fixed_buffer_num;
+
+    void* base = ::mmap(nullptr, total, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return;
+    }
+
+    std::vector<iovec> iovs(fixed_buffer_num);
+    for (std::size_t i = 0; i < fixed_buffer_num; i++) {
+        iovs[i].iov_base = static_cast<char*>(base) + i * fixed_buffer_size;
+        iovs[i].iov_len = fixed_buffer_size;
+    }
+
+    /* may fail with ENOMEM under a small RLIMIT_MEMLOCK, the relay then
+     * uses plain recv/send with pooled buffers */
+    if (io_uring_register(this->ring_fd_, IORING_REGISTER_BUFFERS,
+                          iovs.data(), fixed_buffer_num) < 0) {
+        ::munmap(base, total);
+        return;
+    }
+
+    this->fixed_base_ = static_cast<char*>(base);
+    for (int i = fixed_buffer_num - 1; i >= 0; i--) {
+        this->fixed_free_.push_back(i);
+    }
+}
+
+void uring_service::setup_datagram_buffers() {
+    std::size_t ring_size = datagram_buffer_num * sizeof(io_uring_buf);
+    std::size_t total = datagram_buffer_size * datagram_buffer_num;
+
+    void* ring = ::mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return;
+    }
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = datagram_buffer_num;
+    reg.bgid = datagram_group;
+
+    /* provided buffer rings need 5.19, multishot recvmsg needs 6.0 and is
+     * detected on the first completion */
+    if (io_uring_register(this->ring_fd_, IORING_REGISTER_PBUF_RING, &reg,
+                          1) < 0) {
+        ::munmap(ring, ring_size);
+        return;
+    }
+
+    void* base = ::mmap(nullptr, total, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        io_uring_buf_reg unreg;
+        std::memset(&unreg, 0, sizeof(unreg));
+        unreg.bgid = datagram_group;
+        io_uring_register(this->ring_fd_, IORING_UNREGISTER_PBUF_RING, &unreg,
+                          1);
+        ::munmap(ring, ring_size);
+        return;
+    }
+
+    this->datagram_ring_ = static_cast<io_uring_buf_ring*>(ring);
+    this->datagram_base_ = static_cast<char*>(base);
+
+    for (uint16_t bid = 0; bid < datagram_buffer_num; bid++) {
+        this->recycle_datagram_buffer(bid);
+    }
+}
+
+int uring_service::acquire_fixed(char** data) {
+    if (this->fixed_free_.empty()) {
+        return -1;
+    }
+
+    int index = this->fixed_free_.back();
+    this->fixed_free_.pop_back();
+    *data = this->fixed_base_ + index * fixed_buffer_size;
+
+    return index;
+}
+
+void uring_service::release_fixed(int index) {
+    this->fixed_free_.push_back(index);
+}
+
+char* uring_service::datagram_buffer(uint16_t bid) const {
+    return this->datagram_base_ + bid * datagram_buffer_size;
+}
+
+void uring_service::recycle_datagram_buffer(uint16_t bid) {
+    auto& buf = this->datagram_ring_
+                    ->bufs[this->datagram_tail_ & (datagram_buffer_num - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(this->datagram_buffer(bid));
+    buf.len = datagram_buffer_size;
+    buf.bid = bid;
+
+    this->datagram_tail_++;
+    __atomic_store_n(&this->datagram_ring_->tail, this->datagram_tail_,
+                     __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* uring_service::get_sqe() {
+    unsigned tail = *this->sq_tail_;
+
+    if (tail - load_acquire(this->sq_head_) >= this->params_.sq_entries) {
+        this->submit();
+        tail = *this->sq_tail_;
+    }
+
+    unsigned index = tail & *this->sq_mask_;
+    io_uring_sqe* sqe = &this->sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+
+    this->sq_array_[index] = index;
+    store_release(this->sq_tail_, tail + 1);
+
+    this->schedule_flush();
+
+    return sqe;
+}
+
+void uring_service::start_op(io_uring_sqe* sqe, op* o) {
+    sqe->user_data = reinterpret_cast<uint64_t>(o);
+
+    o->prev = nullptr;
+    o->next = this->ops_;
+    if (this->ops_ != nullptr) {
+        this->ops_->prev = o;
+    }
+    this->ops_ = o;
+
+    this->pending_++;
+}
+
+void uring_service::start_multishot_recvmsg(int fd, const msghdr* msg,
+                                            op* o) {
+    o->fd = fd;
+
+    io_uring_sqe* sqe = this->get_sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = datagram_group;
+    this->start_op(sqe, o);
+}
+
+void uring_service::cancel(int fd) {
+    std::vector<uint64_t> targets;
+
+    /* a linked read is only reachable through its poll head */
+    for (op* o = this->ops_; o != nullptr; o = o->next) {
+        if (o->fd == fd) {
+            targets.push_back(reinterpret_cast<uint64_t>(o));
+            targets.push_back(reinterpret_cast<uint64_t>(o) | 1);
+        }
+    }
+
+    for (uint64_t target : targets) {
+        io_uring_sqe* sqe = this->get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = target;
+        sqe->user_data = 0;
+        this->pending_++;
+    }
+}
+
+void uring_service::schedule_flush() {
+    if (this->flush_scheduled_) {
+        return;
+    }
+
+    this->flush_scheduled_ = true;
+
+    asio::post(this->ex_, [this] {
+        this->flush_scheduled_ = false;
+        this->submit();
+    });
+}
+
+void uring_service::submit() {
+    while (this->pending_ > 0) {
+        int ret = io_uring_enter(this->ring_fd_, this->pending_, 0, 0);
+        this->stats_.enter_calls++;
+        socks_metrics::get()->add(socks_metrics::counter::uring_enter_calls);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* completion queue overflow, make room and retry later */
+            if (errno == EAGAIN || errno == EBUSY) {
+                this->reap();
+                this->schedule_flush();
+                return;
+            }
+
+            SPDLOG_ERROR("io_uring_enter failed: {}", std::strerror(errno));
+            return;
+        }
+
+        this->stats_.submitted += ret;
+        socks_metrics::get()->add(socks_metrics::counter::uring_submitted,
+                                  static_cast<uint64_t>(ret));
+        this->pending_ -= ret;
+    }
+}
+
+void uring_service::reap() {
+    unsigned head = *this->cq_head_;
+    uint64_t reaped = 0;
+
+    while (head != load_acquire(this->cq_tail_)) {
+        io_uring_cqe* cqe = &this->cqes_[head & *this->cq_mask_];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+
+        store_release(this->cq_head_, ++head);
+        this->stats_.completions++;
+        reaped++;
+
+        /* cancel requests and the poll heads of linked reads */
+        if (user_data == 0 || (user_data & 1)) {
+            continue;
+        }
+
+        op* o = reinterpret_cast<op*>(user_data);
+
+        if (!(flags & IORING_CQE_F_MORE)) {
+            if (o->prev != nullptr) {
+                o->prev->next = o->next;
+            } else {
+                this->ops_ = o->next;
+            }
+
+            if (o->next != nullptr) {
+                o->next->prev = o->prev;
+            }
+        }
+
+        o->complete(res, flags);
+    }
+
+    if (reaped > 0) {
+        socks_metrics::get()->add(socks_metrics::counter::uring_completions,
+                                  reaped);
+    }
+}
+
+void uring_service::wait_eventfd() {
+    this->event_descriptor_->async_read_some(
+        asio::buffer(&this->event_count_, sizeof(this->event_count_)),
+        [this](asio::error_code ec, std::size_t) {
+            if (ec && ec != asio::error::would_block) {
+                SPDLOG_ERROR("io_uring eventfd failed: {}", ec.message());
+                return;
+            }
+
+            this->stats_.wakeups++;
+            socks_metrics::get()->add(socks_metrics::counter::uring_wakeups);
+            this->reap();
+            this->wait_eventfd();
+        });
+}
+
+uring_service::stats uring_service::get_stats() const { return this->stats_; }
+
+uring_datagram_receiver::uring_datagram_receiver(uring_service* service,
+                                                 int fd)
+    : state_(std::make_shared<state>()) {
+    auto& s = *this->state_;
+
+    s.service = service;
+    s.fd = fd;
+    s.multishot = service->datagram_buffers();
+    s.armed = false;
+    s.closed = false;
+    s.held_bid = -1;
+    s.data = nullptr;
+    s.sender = nullptr;
+
+    std::memset(&s.msg, 0, sizeof(s.msg));
+    s.msg.msg_name = &s.name;
+    s.msg.msg_namelen = sizeof(s.name);
+
+    if (!s.multishot) {
+        s.buffer.resize(UINT16_MAX);
+        s.iov.iov_base = s.buffer.data();
+        s.iov.iov_len = s.buffer.size();
+        s.msg.msg_iov = &s.iov;
+        s.msg.msg_iovlen = 1;
+    }
+}
+
+uring_datagram_receiver::~uring_datagram_receiver() {
+    auto& s = *this->state_;
+
+    s.closed = true;
+    s.recycle();
+
+    /* buffers of datagrams nobody is going to read */
+    for (auto& c : s.ready) {
+        if (c.res >= 0 && (c.flags & IORING_CQE_F_BUFFER)) {
+            s.service->recycle_datagram_buffer(
+                static_cast<uint16_t>(c.flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+    }
+    s.ready.clear();
+}
+
+void uring_datagram_receiver::state::arm(const std::shared_ptr<state>& self) {
+    this->armed = true;
+
+    if (this->multishot) {
+        this->service->start_multishot_recvmsg(this->fd, &this->msg,
+                                               new recv_op(self));
+        return;
+    }
+
+    this->msg.msg_namelen = sizeof(this->name);
+
+    auto* o = new recv_op(self);
+    o->fd = this->fd;
+
+    io_uring_sqe* sqe = this->service->get_sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = this->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&this->msg);
+    sqe->len = 1;
+    this->service->start_op(sqe, o);
+}
+
+void uring_datagram_receiver::state::recycle() {
+    if (this->held_bid >= 0) {
+        this->service->recycle_datagram_buffer(
+            static_cast<uint16_t>(this->held_bid));
+        this->held_bid = -1;
+    }
+}
+
+void uring_datagram_receiver::state::deliver(
+    std::unique_ptr<uring_service::op> w) {
+    if (this->ready.empty()) {
+        this->waiter = std::move(w);
+        if (!this->armed && !this->closed) {
+            this->arm(this->shared_from_this());
+        }
+        return;
+    }
+
+    completion c = this->ready.front();
+    this->ready.pop_front();
+
+    int res = c.res;
+
+    if (res >= 0 && (c.flags & IORING_CQE_F_BUFFER)) {
+        uint16_t bid = static_cast<uint16_t>(c.flags >> IORING_CQE_BUFFER_SHIFT);
+        char* buf = this->service->datagram_buffer(bid);
+        auto* out = reinterpret_cast<io_uring_recvmsg_out*>(buf);
+        char* name = buf + sizeof(io_uring_recvmsg_out);
+
+        this->held_bid = bid;
+        this->data = name + this->msg.msg_namelen + this->msg.msg_controllen;
+        res = static_cast<int>(out->payloadlen);
+
+        std::memcpy(this->sender->data(), name,
+                    std::min<std::size_t>(out->namelen, sizeof(this->name)));
+        this->sender->resize(out->namelen);
+    } else if (res >= 0) {
+        this->data = this->buffer.data();
+
+        std::memcpy(this->sender->data(), &this->name, this->msg.msg_namelen);
+        this->sender->resize(this->msg.msg_namelen);
+    }
+
+    /* never complete inside the initiating function */
+    asio::post(this->service->get_executor(),
+               [w = std::move(w), res]() mutable { w->complete(res, 0); });
+}
+
+void uring_datagram_receiver::recv_op::complete(int res, uint32_t flags) {
+    auto s = this->state_;
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        s->armed = false;
+        delete this;
+    }
+
+    if (s->multishot && (res == -EINVAL || res == -ENOBUFS)) {
+        /* no multishot support in this kernel, or every provided buffer is
+         * held by other sessions: use a private buffer from now on */
+        s->multishot = false;
+        s->buffer.resize(UINT16_MAX);
+        s->iov.iov_base = s->buffer.data();
+        s->iov.iov_len = s->buffer.size();
+        s->msg.msg_iov = &s->iov;
+        s->msg.msg_iovlen = 1;
+
+        if (!s->closed && !s->armed && s->waiter) {
+            s->arm(s);
+        }
+        return;
+    }
+
+    s->ready.push_back({res, flags});
+
+    /* a multishot receive that ended early is restarted right away, the
+     * single-shot one waits for the next receive since it shares a buffer */
+    if (s->multishot && !s->closed && !s->armed && res >= 0) {
+        s->arm(s);
+    }
+
+    if (s->waiter) {
+        auto w = std::move(s->waiter);
+        s->deliver(std::move(w));
+    }
+}
@@ -0,0 +1,447 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <deque>
+#include <vector>
+
+#include "asiomp.h"
+
+/*
+ * A per-worker io_uring instance driven from the asio event loop. The
+ * kernel signals completions through an eventfd that is read by a
+ * posix::stream_descriptor, submissions queued while handlers run are
+ * flushed with a single io_uring_enter at the end of the batch.
+ */
+class uring_service {
+public:
+    static constexpr unsigned sq_entries = 256;
+    static constexpr unsigned cq_entries = 4096;
+
+    static constexpr std::size_t fixed_buffer_size = 65536;
+    static constexpr std::size_t fixed_buffer_num = 32;
+
+    /* provided buffers for multishot datagram receive */
+    static constexpr uint16_t datagram_group = 1;
+    static constexpr std::size_t datagram_buffer_size = 65536 + 256;
+    static constexpr std::size_t datagram_buffer_num = 64;
+
+    struct stats {
+        uint64_t submitted;
+        uint64_t enter_calls;
+        uint64_t completions;
+        uint64_t wakeups;
+    };
+
+    class op {
+    public:
+        virtual ~op() = default;
+
+        virtual void complete(int res, uint32_t flags) = 0;
+
+        int fd = -1;
+        op* prev = nullptr;
+        op* next = nullptr;
+    };
+
+    /* returns nullptr when io_uring cannot be used by this worker */
+    static uring_service* get(const asio::any_io_executor& ex);
+
+    inline const asio::any_io_executor& get_executor() const {
+        return this->ex_;
+    }
+
+    inline bool fixed_buffers() const { return this->fixed_base_ != nullptr; }
+
+    inline bool datagram_buffers() const {
+        return this->datagram_base_ != nullptr;
+    }
+
+    int acquire_fixed(char** data);
+
+    void release_fixed(int index);
+
+    char* datagram_buffer(uint16_t bid) const;
+
+    void recycle_datagram_buffer(uint16_t bid);
+
+    /* read into a registered buffer once fd is readable */
+    template <typename CompletionToken>
+    auto async_read_fixed(int fd, char* data, std::size_t size, int index,
+                          CompletionToken&& token);
+
+    template <typename CompletionToken>
+    auto async_write_fixed(int fd, const char* data, std::size_t size,
+                           int index, CompletionToken&& token);
+
+    template <typename CompletionToken>
+    auto async_recv(int fd, char* data, std::size_t size,
+                    CompletionToken&& token);
+
+    template <typename CompletionToken>
+    auto async_send(int fd, const char* data, std::size_t size,
+                    CompletionToken&& token);
+
+    template <typename CompletionToken>
+    auto async_poll(int fd, short events, CompletionToken&& token);
+
+    template <typename CompletionToken>
+    auto async_recvmsg(int fd, msghdr* msg, CompletionToken&& token);
+
+    template <typename CompletionToken>
+    auto async_sendmsg(int fd, const msghdr* msg, CompletionToken&& token);
+
+    /* arm a multishot recvmsg drawing from the datagram buffer group, the
+     * op is completed once per datagram while IORING_CQE_F_MORE is set */
+    void start_multishot_recvmsg(int fd, const msghdr* msg, op* o);
+
+    /* cancel every operation still in flight on fd */
+    void cancel(int fd);
+
+    stats get_stats() const;
+
+private:
+    friend class uring_datagram_receiver;
+
+    explicit uring_service(const asio::any_io_executor& ex);
+
+    ~uring_service();
+
+    bool setup();
+
+    void setup_fixed_buffers();
+
+    void setup_datagram_buffers();
+
+    io_uring_sqe* get_sqe();
+
+    void start_op(io_uring_sqe* sqe, op* o);
+
+    void schedule_flush();
+
+    void submit();
+
+    void reap();
+
+    void wait_eventfd();
+
+    template <typename Handler>
+    class handler_op;
+
+    template <typename Prepare, typename CompletionToken>
+    auto async_start(int fd, Prepare&& prepare, CompletionToken&& token);
+
+private:
+    asio::any_io_executor ex_;
+    int ring_fd_;
+    int event_fd_;
+    std::unique_ptr<asio::posix::stream_descriptor> event_descriptor_;
+    uint64_t event_count_;
+
+    io_uring_params params_;
+    void* sq_ptr_;
+    std::size_t sq_size_;
+    void* cq_ptr_;
+    std::size_t cq_size_;
+    io_uring_sqe* sqes_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_mask_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned* cq_mask_;
+    io_uring_cqe* cqes_;
+
+    unsigned pending_;
+    bool flush_scheduled_;
+    bool skip_success_;
+    op* ops_;
+
+    char* fixed_base_;
+    std::vector<int> fixed_free_;
+
+    char* datagram_base_;
+    io_uring_buf_ring* datagram_ring_;
+    uint16_t datagram_tail_;
+
+    stats stats_;
+};
+
+template <typename Handler>
+class uring_service::handler_op : public uring_service::op {
+public:
+    explicit handler_op(Handler&& handler) : handler_(std::move(handler)) {}
+
+    void complete(int res, uint32_t) override {
+        asio::error_code ec;
+        std::size_t n = 0;
+
+        if (res < 0) {
+            ec = asio::error_code(-res, asio::error::get_system_category());
+        } else {
+            n = static_cast<std::size_t>(res);
+        }
+
+        Handler handler(std::move(this->handler_));
+        delete this;
+        std::move(handler)(ec, n);
+    }
+
+private:
+    Handler handler_;
+};
+
+template <typename Prepare, typename CompletionToken>
+auto uring_service::async_start(int fd, Prepare&& prepare,
+                                CompletionToken&& token) {
+    return asio::async_initiate<CompletionToken,
+                                void(asio::error_code, std::size_t)>(
+        [this, fd](auto handler, Prepare prepare) {
+            using handler_type = std::decay_t<decltype(handler)>;
+            auto* o = new handler_op<handler_type>(std::move(handler));
+            o->fd = fd;
+            prepare(o);
+        },
+        token, std::forward<Prepare>(prepare));
+}
+
+template <typename CompletionToken>
+auto uring_service::async_read_fixed(int fd, char* data, std::size_t size,
+                                     int index, CompletionToken&& token) {
+    return this->async_start(
+        fd,
+        [this, fd, data, size, index](op* o) {
+            /* poll first, READ_FIXED on an O_NONBLOCK socket would fail
+             * with EAGAIN instead of waiting */
+            io_uring_sqe* sqe = this->get_sqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = POLLIN;
+            sqe->flags = IOSQE_IO_LINK;
+            if (this->skip_success_) {
+                sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+            }
+            sqe->user_data = reinterpret_cast<uint64_t>(o) | 1;
+            this->pending_++;
+
+            sqe = this->get_sqe();
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(data);
+            sqe->len = static_cast<uint32_t>(size);
+            sqe->buf_index = static_cast<uint16_t>(index);
+            this->start_op(sqe, o);
+        },
+        std::forward<CompletionToken>(token));
+}
+
+template <typename CompletionToken>
+auto uring_service::async_write_fixed(int fd, const char* data,
+                                      std::size_t size, int index,
+                                      CompletionToken&& token) {
+    return this->async_start(
+        fd,
+        [this, fd, data, size, index](op* o) {
+            io_uring_sqe* sqe = this->get_sqe();
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(data);
+            sqe->len = static_cast<uint32_t>(size);
+            sqe->buf_index = static_cast<uint16_t>(index);
+            this->start_op(sqe, o);
+        },
+        std::forward<CompletionToken>(token));
+}
+
+template <typename CompletionToken>
+auto uring_service::async_recv(int fd, char* data, std::size_t size,
+                               CompletionToken&& token) {
+    return this->async_start(
+        fd,
+        [this, fd, data, size](op* o) {
+            io_uring_sqe* sqe = this->get_sqe();
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(data);
+            sqe->len = static_cast<uint32_t>(size);
+            this->start_op(sqe, o);
+        },
+        std::forward<CompletionToken>(token));
+}
+
+template <typename CompletionToken>
+auto uring_service::async_send(int fd, const char* data, std::size_t size,
+                               CompletionToken&& token) {
+    return this->async_start(
+        fd,
+        [this, fd, data, size](op* o) {
+            io_uring_sqe* sqe = this->get_sqe();
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(data);
+            sqe->len = static_cast<uint32_t>(size);
+            sqe->msg_flags = MSG_NOSIGNAL;
+            this->start_op(sqe, o);
+        },
+        std::forward<CompletionToken>(token));
+}
+
+template <typename CompletionToken>
+auto uring_service::async_poll(int fd, short events,
+                               CompletionToken&& token) {
+    return this->async_start(
+        fd,
+        [this, fd, events](op* o) {
+            io_uring_sqe* sqe = this->get_sqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = static_cast<uint16_t>(events);
+            this->start_op(sqe, o);
+        },
+        std::forward<CompletionToken>(token));
+}
+
+template <typename CompletionToken>
+auto uring_service::async_recvmsg(int fd, msghdr* msg,
+                                  CompletionToken&& token) {
+    return this->async_start(
+        fd,
+        [this, fd, msg](op* o) {
+            io_uring_sqe* sqe = this->get_sqe();
+            sqe->opcode = IORING_OP_RECVMSG;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(msg);
+            sqe->len = 1;
+            this->start_op(sqe, o);
+        },
+        std::forward<CompletionToken>(token));
+}
+
+template <typename CompletionToken>
+auto uring_service::async_sendmsg(int fd, const msghdr* msg,
+                                  CompletionToken&& token) {
+    return this->async_start(
+        fd,
+        [this, fd, msg](op* o) {
+            io_uring_sqe* sqe = this->get_sqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = fd;
+            sqe->addr = reinterpret_cast<uint64_t>(msg);
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            this->start_op(sqe, o);
+        },
+        std::forward<CompletionToken>(token));
+}
+
+/*
+ * Receives datagrams for one UDP socket through io_uring. Uses a multishot
+ * recvmsg on the worker's provided buffer ring when the kernel supports
+ * it, and a single-shot recvmsg into a private buffer otherwise.
+ */
+class uring_datagram_receiver {
+public:
+    uring_datagram_receiver(uring_service* service, int fd);
+
+    ~uring_datagram_receiver();
+
+    uring_datagram_receiver(const uring_datagram_receiver&) = delete;
+
+    uring_datagram_receiver& operator=(const uring_datagram_receiver&) =
+        delete;
+
+    /* completes with the length of the next datagram, its payload and
+     * sender stay valid until the following receive */
+    template <typename CompletionToken>
+    auto async_receive(asio::ip::udp::endpoint& sender,
+                       CompletionToken&& token);
+
+    inline const char* data() const { return this->state_->data; }
+
+private:
+    struct completion {
+        int res;
+        uint32_t flags;
+    };
+
+    struct state;
+
+    class recv_op : public uring_service::op {
+    public:
+        explicit recv_op(std::shared_ptr<state> s) : state_(std::move(s)) {}
+
+        void complete(int res, uint32_t flags) override;
+
+    private:
+        std::shared_ptr<state> state_;
+    };
+
+    struct state : public std::enable_shared_from_this<state> {
+        uring_service* service;
+        int fd;
+        bool multishot;
+        bool armed;
+        bool closed;
+        msghdr msg;
+        sockaddr_storage name;
+        iovec iov;
+        std::vector<char> buffer;
+        std::deque<completion> ready;
+        int held_bid;
+        const char* data;
+        asio::ip::udp::endpoint* sender;
+        std::unique_ptr<uring_service::op> waiter;
+
+        void arm(const std::shared_ptr<state>& self);
+
+        void recycle();
+
+        void deliver(std::unique_ptr<uring_service::op> w);
+    };
+
+    template <typename Handler>
+    class waiter_op : public uring_service::op {
+    public:
+        explicit waiter_op(Handler&& handler)
+            : handler_(std::move(handler)) {}
+
+        void complete(int res, uint32_t) override {
+            asio::error_code ec;
+            std::size_t n = 0;
+
+            if (res < 0) {
+                ec = asio::error_code(-res,
+                                      asio::error::get_system_category());
+            } else {
+                n = static_cast<std::size_t>(res);
+            }
+
+            std::move(this->handler_)(ec, n);
+        }
+
+    private:
+        Handler handler_;
+    };
+
+    std::shared_ptr<state> state_;
+};
+
+template <typename CompletionToken>
+auto uring_datagram_receiver::async_receive(asio::ip::udp::endpoint& sender,
+                                            CompletionToken&& token) {
+    return asio::async_initiate<CompletionToken,
+                                void(asio::error_code, std::size_t)>(
+        [this, &sender](auto handler) {
+            using handler_type = std::decay_t<decltype(handler)>;
+            auto& s = this->state_;
+
+            s->recycle();
+            s->sender = &sender;
+            s->deliver(std::make_unique<waiter_op<handler_type>>(
+                std::move(handler)));
+        },
+        token);
+}